@@ -47,6 +47,8 @@ static int cf_use_idle (const char *);
 static int cf_order (const char *);
 static int cf_const_mem (int);
 static int cf_kill_orphs (int);
+static int cf_mem_limit (int);
+static int cf_mem_migrate (int);
 
 %}
 
@@ -54,6 +56,8 @@ static int cf_kill_orphs (int);
 %token USE_IDLE     "use-idle"
 %token CONST_MEM    "constrain-mem"
 %token KILL_ORPHS   "kill-orphs"
+%token MEM_LIMIT    "mem-limit"
+%token MEM_MIGRATE  "mem-migrate"
 %token ORDER        "order"
 %token TRUE         "true"
 %token FALSE        "false"
@@ -80,6 +84,10 @@ stmt    : POLICY '=' STRING      { if (cf_policy ($3) < 0)       YYABORT; }
         | CONST_MEM '=' FALSE    { if (cf_const_mem (0) < 0)     YYABORT; }
         | KILL_ORPHS '=' TRUE    { if (cf_kill_orphs (1) < 0)    YYABORT; }
         | KILL_ORPHS '=' FALSE   { if (cf_kill_orphs (0) < 0)    YYABORT; }
+        | MEM_LIMIT '=' TRUE     { if (cf_mem_limit (1) < 0)     YYABORT; }
+        | MEM_LIMIT '=' FALSE    { if (cf_mem_limit (0) < 0)     YYABORT; }
+        | MEM_MIGRATE '=' TRUE   { if (cf_mem_migrate (1) < 0)   YYABORT; }
+        | MEM_MIGRATE '=' FALSE  { if (cf_mem_migrate (0) < 0)   YYABORT; }
         | ORDER '=' STRING       { if (cf_order ($3) < 0)        YYABORT; }
 
 end     : '\n'                   { cpuset_conf_line++; }
@@ -193,6 +201,20 @@ static int cf_kill_orphs (int val)
     return (cpuset_conf_set_kill_orphans (conf, val));
 }
 
+static int cf_mem_limit (int val)
+{
+    log_debug ("%s: %d: Setting mem-limit to %s.\n",
+            cf_file (), cf_line(), val ? "true" : "false");
+    return (cpuset_conf_set_mem_limit (conf, val));
+}
+
+static int cf_mem_migrate (int val)
+{
+    log_debug ("%s: %d: Setting mem-migrate to %s.\n",
+            cf_file (), cf_line(), val ? "true" : "false");
+    return (cpuset_conf_set_mem_migrate (conf, val));
+}
+
 /*
  * vi: ts=4 sw=4 expandtab
  */
@@ -45,6 +45,8 @@ struct cpuset_conf {
     unsigned        use_idle_if_multiple:1;
     unsigned        constrain_mems:1;
     unsigned        kill_orphans:1;
+    unsigned        mem_limit:1;
+    unsigned        mem_migrate:1;
 };
 
 
@@ -81,6 +83,16 @@ int cpuset_conf_kill_orphans (cpuset_conf_t conf)
     return (conf->kill_orphans);
 }
 
+int cpuset_conf_mem_limit (cpuset_conf_t conf)
+{
+    return (conf->mem_limit);
+}
+
+int cpuset_conf_mem_migrate (cpuset_conf_t conf)
+{
+    return (conf->mem_migrate);
+}
+
 int cpuset_conf_reverse_order (cpuset_conf_t conf)
 {
     return (conf->reverse_order);
@@ -184,6 +196,20 @@ int cpuset_conf_parse_opt (cpuset_conf_t conf, const char *opt)
         (strcmp ("constrain-mem", opt) == 0))
         return (cpuset_conf_set_constrain_mem (conf, 1));
 
+    if ((strcmp ("!mem-limit", opt) == 0) ||
+        (strcmp ("nomem-limit", opt) == 0))
+        return (cpuset_conf_set_mem_limit (conf, 0));
+
+    if (strcmp ("mem-limit", opt) == 0)
+        return (cpuset_conf_set_mem_limit (conf, 1));
+
+    if ((strcmp ("!mem-migrate", opt) == 0) ||
+        (strcmp ("nomem-migrate", opt) == 0))
+        return (cpuset_conf_set_mem_migrate (conf, 0));
+
+    if (strcmp ("mem-migrate", opt) == 0)
+        return (cpuset_conf_set_mem_migrate (conf, 1));
+
     if ((strcmp ("reverse", opt) == 0) || 
         (strcmp ("order=reverse", opt) == 0))
         return (cpuset_conf_set_order (conf, 1));
@@ -202,6 +228,22 @@ int cpuset_conf_set_constrain_mem (cpuset_conf_t conf, int constrain_mem)
     return (0);
 }
 
+int cpuset_conf_set_mem_limit (cpuset_conf_t conf, int mem_limit)
+{
+    if (!conf)
+        return (-1);
+    conf->mem_limit = mem_limit;
+    return (0);
+}
+
+int cpuset_conf_set_mem_migrate (cpuset_conf_t conf, int mem_migrate)
+{
+    if (!conf)
+        return (-1);
+    conf->mem_migrate = mem_migrate;
+    return (0);
+}
+
 int cpuset_conf_set_kill_orphans (cpuset_conf_t conf, int kill_orphans)
 {
     if (!conf)
@@ -241,6 +283,8 @@ cpuset_conf_t cpuset_conf_create ()
     conf->use_idle_if_multiple = 1;
     conf->constrain_mems =       1;
     conf->kill_orphans =         0;
+    conf->mem_limit =            0;
+    conf->mem_migrate =          0;
 
     return (conf);
 }
@@ -53,6 +53,10 @@ int cpuset_conf_alloc_idle_multiple (cpuset_conf_t conf);
 
 int cpuset_conf_kill_orphans (cpuset_conf_t conf);
 
+int cpuset_conf_mem_limit (cpuset_conf_t conf);
+
+int cpuset_conf_mem_migrate (cpuset_conf_t conf);
+
 int cpuset_conf_reverse_order (cpuset_conf_t conf);
 
 int cpuset_conf_set_policy (cpuset_conf_t conf, enum fit_policy policy);
@@ -69,6 +73,10 @@ int cpuset_conf_set_policy_string (cpuset_conf_t conf, const char *name);
 
 int cpuset_conf_set_constrain_mem (cpuset_conf_t conf, int constrain_mem);
 
+int cpuset_conf_set_mem_limit (cpuset_conf_t conf, int mem_limit);
+
+int cpuset_conf_set_mem_migrate (cpuset_conf_t conf, int mem_migrate);
+
 int cpuset_conf_set_order (cpuset_conf_t conf, int reverse);
 /*
  *  Create and Destroy:
@@ -90,7 +90,11 @@ where args... is a comma separated list of one or more of the following\n\
                         no    Equivalent to no-idle.\n\
 \n\
    nomem               Do not also constrain memory to the local nodes of\n\
-                        the selected CPUs.\n\n";
+                        the selected CPUs.\n\
+   mem-limit           Limit memory use of the job step to the amount of\n\
+                        memory allocated to the step.\n\
+   mem-migrate         Migrate memory already in use by the step or task\n\
+                        to the memory nodes of its new cpuset.\n\n";
 
 static List user_options = NULL;
 
@@ -106,6 +110,7 @@ static int per_task_cpuset = 0;      /* --use-cpuset=tasks */
 static uint32_t jobid;
 static uint32_t stepid;
 static int step_ncpus = -1;
+static uint64_t step_mem_mb = 0;
 static int ncpus_per_task = -1;
 static int debug_level = 0;
 static int user_debug_level = 0;
@@ -197,6 +202,7 @@ int migrate_job_to_cpuset (uint32_t jobid, uid_t uid, pid_t pid)
     int rc;
     char path[4096];
     int n = 0;
+    long pages = -1;
 
     cpuset_getcpusetpath (0, path, sizeof (path));
 
@@ -227,8 +233,26 @@ int migrate_job_to_cpuset (uint32_t jobid, uid_t uid, pid_t pid)
     else
         cpuset_debug ("Migrate: Moving to cpuset %s\n", path);
 
+    /*
+     *  If memory_migrate is enabled for step and task cpusets,
+     *   estimate migrated pages from the node-wide vmstat counter.
+     *   The slurm cpuset lock only serializes other cpuset moves;
+     *   compaction, NUMA balancing and other cgroups migrating pages
+     *   are also counted, so this is an upper bound at best.
+     */
+    if ((int) uid < 0 && cpuset_conf_mem_migrate (conf))
+        pages = vmstat_read ("pgmigrate_success");
+
     if (cpuset_move (pid, path) < 0) 
         return (-1);
+
+    if (pages >= 0) {
+        long npages = vmstat_read ("pgmigrate_success");
+        if (npages >= 0)
+            cpuset_verbose ("Migrate: ~%ld pages migrated node-wide"
+                    " while moving to %s\n",
+                    npages - pages, path);
+    }
     return (0);
 }
 
@@ -247,6 +271,45 @@ static int job_ncpus_per_task (spank_t sp)
     return (ncpus_per_task);
 }
 
+/*
+ *  Return nonzero if the running SLURM returns 64bit values for
+ *   S_JOB_ALLOC_MEM and S_STEP_ALLOC_MEM (17.02 and later).
+ */
+static int alloc_mem_is_64bit (spank_t sp)
+{
+    const char *major;
+    const char *minor;
+    int maj;
+
+    if (spank_get_item (sp, S_SLURM_VERSION_MAJOR, &major) != ESPANK_SUCCESS
+     || spank_get_item (sp, S_SLURM_VERSION_MINOR, &minor) != ESPANK_SUCCESS)
+        return (1);
+
+    maj = str2int (major);
+    return (maj > 17 || (maj == 17 && str2int (minor) >= 2));
+}
+
+/*
+ *  Return allocated memory in MB for S_JOB_ALLOC_MEM or S_STEP_ALLOC_MEM,
+ *   or 0 if unavailable (no limit). Older versions of SLURM return
+ *   a 32bit value for these items.
+ */
+static uint64_t alloc_mem_mb (spank_t sp, spank_item_t item)
+{
+    uint64_t mb64;
+    uint32_t mb32;
+
+    if (alloc_mem_is_64bit (sp)) {
+        if (spank_get_item (sp, item, &mb64) != ESPANK_SUCCESS)
+            return (0);
+        return (mb64);
+    }
+
+    if (spank_get_item (sp, item, &mb32) != ESPANK_SUCCESS)
+        return (0);
+    return (mb32);
+}
+
 static int job_step_ncpus (spank_t sp)
 {
     uint32_t ntasks;
@@ -384,6 +447,10 @@ int slurm_spank_init (spank_t sp, int ac, char *av[])
         if ((rc = create_cpuset_for_job (conf, jobid, uid, ncpus)) < 0)
             goto done;
 
+        if (set_mem_limit_for_job (conf, jobid, uid,
+                    alloc_mem_mb (sp, S_JOB_ALLOC_MEM)) < 0)
+            cpuset_error ("Failed to set memory limit for job %u\n", jobid);
+
         if ((rc = migrate_job_to_cpuset (jobid, uid, 0)) < 0) {
             log_err ("Failed to migrate jobid %d to cpuset: %s\n",
                     jobid, strerror (errno));
@@ -392,6 +459,7 @@ int slurm_spank_init (spank_t sp, int ac, char *av[])
     }
 
     step_ncpus = job_step_ncpus (sp);
+    step_mem_mb = alloc_mem_mb (sp, S_STEP_ALLOC_MEM);
 
 done:
     slurm_cpuset_unlock (lockfd);
@@ -479,8 +547,10 @@ static int parse_user_option (int val, const char *optarg, int remote)
                     stepid, strerror (errno));
             per_task_cpuset = 0;
         }
-        else 
+        else {
+            set_mem_limit_for_step (conf, stepid, step_mem_mb);
             rc = migrate_job_to_cpuset (stepid, -1, 0);
+        }
         slurm_cpuset_unlock (lockfd);
     }
 
@@ -511,8 +581,10 @@ int slurm_spank_init_post_opt (spank_t sp, int ac, char **av)
 
     if ((rc = create_cpuset_for_step (conf, stepid, step_ncpus)) < 0)
         per_task_cpuset = 0;
-    else
+    else {
+        set_mem_limit_for_step (conf, stepid, step_mem_mb);
         rc = migrate_job_to_cpuset (stepid, -1, 0);
+    }
 
     if (debug_level > 0)
         print_current_cpuset_info ();
@@ -24,9 +24,12 @@
 
 
 #include <string.h>
+#include <stdio.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <inttypes.h>
 
 #include "log.h"
 #include "conf.h"
@@ -147,6 +150,13 @@ job_cpuset_create (cpuset_conf_t cf, uint32_t jobid, uid_t uid,
     if ((cp = do_cpuset_create (cf, alloc)) < 0)
         return (-1);
 
+    /*
+     *  For step and task cpusets, optionally migrate pages already
+     *   touched by the moved processes to the new memory nodes.
+     */
+    if ((int) uid < 0 && cpuset_conf_mem_migrate (cf))
+        cpuset_set_iopt (cp, "memory_migrate", 1);
+
     if (job_cpuset_path (jobid, uid, path, sizeof (path)) < 0) {
         cpuset_error ("Failed to generate job cpuset path: %s\n", 
                 strerror (errno));
@@ -255,6 +265,99 @@ int create_cpuset_for_task (cpuset_conf_t cf, unsigned int taskid, int ncpus)
     return (create_cpuset (cf, taskid, -1, ncpus));
 }
 
+/*
+ *  Write string [val] into memory controller file [name] under cpuset
+ *   [path]. Returns -1 with errno == ENOENT if the file does not exist,
+ *   i.e. the memory controller is not mounted with the cpuset hierarchy.
+ */
+static int mem_file_write (const char *path, const char *name, const char *val)
+{
+    char file [4096];
+    int fd, n;
+    int len = strlen (val);
+
+    n = snprintf (file, sizeof (file), "/dev/cpuset%s/%s", path, name);
+    if ((n < 0) || (n >= sizeof (file)))
+        return (-1);
+
+    if ((fd = open (file, O_WRONLY)) < 0)
+        return (-1);
+
+    n = write (fd, val, len);
+    close (fd);
+
+    if (n != len) {
+        cpuset_error ("write %s to %s: %m\n", val, file);
+        return (-1);
+    }
+
+    cpuset_debug ("%s = %s\n", file, val);
+    return (0);
+}
+
+/*
+ *  Cap memory usage of cpuset [id] to [mb] megabytes. Use the cgroup v2
+ *   interface (memory.max) if available, otherwise fall back to the
+ *   legacy memory controller. In both cases swap is included in the
+ *   limit, so that a job cannot push the rest of the node into swap.
+ *
+ *  A soft limit (memory.high, or memory.soft_limit_in_bytes) is also
+ *   set a little below the hard limit, so the cpuset is throttled and
+ *   reclaimed before it is OOM killed.
+ */
+static int set_mem_limit (cpuset_conf_t cf, unsigned int id, uid_t uid,
+        uint64_t mb)
+{
+    char path [4096];
+    char val [64];
+    char high [64];
+
+    if (!cpuset_conf_mem_limit (cf) || mb == 0)
+        return (0);
+
+    if (job_cpuset_path (id, uid, path, sizeof (path)) < 0) {
+        cpuset_error ("Failed to generate cpuset path for id %u\n", id);
+        return (-1);
+    }
+
+    snprintf (val, sizeof (val), "%" PRIu64, mb * 1024 * 1024);
+    snprintf (high, sizeof (high), "%" PRIu64, mb * 1024 * 1024 / 100 * 95);
+
+    if (mem_file_write (path, "memory.max", val) == 0) {
+        mem_file_write (path, "memory.swap.max", "0");
+        mem_file_write (path, "memory.high", high);
+        return (0);
+    }
+    else if (errno != ENOENT)
+        return (-1);
+
+    /*
+     *  Legacy memory controller: memsw limit must be set after the
+     *   memory limit, since it may not be lower than memory.limit_in_bytes.
+     */
+    if (mem_file_write (path, "memory.limit_in_bytes", val) == 0) {
+        mem_file_write (path, "memory.memsw.limit_in_bytes", val);
+        mem_file_write (path, "memory.soft_limit_in_bytes", high);
+        return (0);
+    }
+    else if (errno == ENOENT)
+        cpuset_error ("mem-limit: no memory controller in %s\n", path);
+
+    return (-1);
+}
+
+int set_mem_limit_for_job (cpuset_conf_t cf, unsigned int jobid, uid_t uid,
+        uint64_t mb)
+{
+    return (set_mem_limit (cf, jobid, uid, mb));
+}
+
+int set_mem_limit_for_step (cpuset_conf_t cf, unsigned int stepid,
+        uint64_t mb)
+{
+    return (set_mem_limit (cf, stepid, -1, mb));
+}
+
 static int user_cpuset_orphan (uid_t uid, const char *path)
 {
     char orphan [1024];
@@ -43,6 +43,12 @@ int create_cpuset_for_step (cpuset_conf_t cf,
 int create_cpuset_for_task (cpuset_conf_t cf,
 		unsigned int taskid, int ncpus_per_task);
 
+int set_mem_limit_for_job (cpuset_conf_t cf,
+		unsigned int jobid, uid_t uid, uint64_t mb);
+
+int set_mem_limit_for_step (cpuset_conf_t cf,
+		unsigned int stepid, uint64_t mb);
+
 int user_cpuset_update (cpuset_conf_t cf, 
 		uid_t uid, const struct bitmask *b);
 
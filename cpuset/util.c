@@ -463,6 +463,30 @@ int slurm_cpuset_create (cpuset_conf_t cf)
     return (create_and_lock_cpuset_dir (cf, "/slurm"));
 }
 
+/*
+ *  Return value of counter [name] from /proc/vmstat, or -1 if not found.
+ */
+long vmstat_read (const char *name)
+{
+    FILE *fp;
+    char key [64];
+    long val;
+    long rc = -1;
+
+    if ((fp = fopen ("/proc/vmstat", "r")) == NULL)
+        return (-1);
+
+    while (fscanf (fp, "%63s %ld", key, &val) == 2) {
+        if (strcmp (key, name) == 0) {
+            rc = val;
+            break;
+        }
+    }
+
+    fclose (fp);
+    return (rc);
+}
+
 int str2int (const char *str)
 {
     char *p;
@@ -56,6 +56,8 @@ int slurm_cpuset_clean_path (const char *path);
 
 int str2int (const char *str);
 
+long vmstat_read (const char *name);
+
 const char * cpuset_path_to_name (const char *path);
 #endif
 
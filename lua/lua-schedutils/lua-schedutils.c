@@ -1,10 +1,17 @@
 #define _GNU_SOURCE
 #include <sched.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <lua.h>
 #include <lualib.h>
@@ -14,14 +21,42 @@
 
 #define MAX_LUAINT (0xfffffffffffff0)
 
-static cpu_set_t * l_cpu_set_alloc (lua_State *L)
+/*
+ *  A node_set is a cpu_set_t with a different metatable. The layout
+ *   of cpu_set_t (an array of unsigned long) is exactly what the
+ *   NUMA memory policy system calls expect for a node mask.
+ */
+#define NODE_SETSIZE CPU_SETSIZE
+
+/*
+ *  Return the type name ("CpuSet" or "NodeSet") of the set at index,
+ *   defaulting to "CpuSet" for anything that is not a NodeSet.
+ */
+static const char * l_set_tname (lua_State *L, int index)
+{
+    int is_node_set = 0;
+
+    if (lua_isuserdata (L, index) && lua_getmetatable (L, index)) {
+        luaL_getmetatable (L, "NodeSet");
+        is_node_set = lua_rawequal (L, -1, -2);
+        lua_pop (L, 2);
+    }
+    return (is_node_set ? "NodeSet" : "CpuSet");
+}
+
+static cpu_set_t * l_set_alloc (lua_State *L, const char *tname)
 {
     cpu_set_t *setp = lua_newuserdata (L, sizeof (*setp));
-	luaL_getmetatable (L, "CpuSet");
+	luaL_getmetatable (L, tname);
 	lua_setmetatable (L, -2);
     return (setp);
 }
 
+static cpu_set_t * l_cpu_set_alloc (lua_State *L)
+{
+    return (l_set_alloc (L, "CpuSet"));
+}
+
 static int lua_string_to_cpu_setp (lua_State *L, int index, cpu_set_t *setp)
 {
     int err = 0;
@@ -81,10 +116,17 @@ static cpu_set_t *lua_to_cpu_setp (lua_State *L, int index)
 {
     cpu_set_t *setp;
 
-    if (lua_isuserdata (L, index))
+    if (lua_isuserdata (L, index)) {
+        if (strcmp (l_set_tname (L, index), "NodeSet") == 0)
+            return (lua_touserdata (L, index));
         return luaL_checkudata (L, index, "CpuSet");
+    }
 
-    setp = l_cpu_set_alloc (L);
+    /*
+     *  Convert to the same type as the first argument, so that
+     *   e.g. node_set:union ("0-1") returns a node_set.
+     */
+    setp = l_set_alloc (L, l_set_tname (L, 1));
     if (lua_isnil (L, index))
         CPU_ZERO (setp);
     else if (lua_type (L, index) == LUA_TNUMBER) {
@@ -100,7 +142,7 @@ static cpu_set_t *lua_to_cpu_setp (lua_State *L, int index)
     return setp;
 }
 
-static int l_cpu_set_new (lua_State *L)
+static int l_set_new (lua_State *L, const char *tname)
 {
     /*
      *   If no arguments passed on stack (stack is empty)
@@ -108,21 +150,52 @@ static int l_cpu_set_new (lua_State *L)
      *    argument at position 1 to cpu_set_t and return that.
      */
     if (lua_gettop (L) == 0) {
-        cpu_set_t *setp = l_cpu_set_alloc (L);
+        cpu_set_t *setp = l_set_alloc (L, tname);
         CPU_ZERO (setp);
     }
     else if ((lua_gettop (L) == 1)) {
-        if (!lua_to_cpu_setp (L, 1))
+        cpu_set_t *setp;
+        if (lua_isuserdata (L, 1)) {
+            /*
+             *  Return a set of the requested type unchanged, convert
+             *   between cpu_set and node_set by copying.
+             */
+            cpu_set_t *src = lua_to_cpu_setp (L, 1);
+            if (strcmp (l_set_tname (L, 1), tname) == 0)
+                return (1);
+            setp = l_set_alloc (L, tname);
+            *setp = *src;
+            return (1);
+        }
+        setp = l_set_alloc (L, tname);
+        if (lua_isnil (L, 1))
+            CPU_ZERO (setp);
+        else if (lua_type (L, 1) == LUA_TNUMBER) {
+            if (lua_number_to_cpu_setp (L, 1, setp) == 2)
+                return (2);
+        }
+        else if (lua_string_to_cpu_setp (L, 1, setp) == 2)
             return (2); /* Error returns (nil, msg) */
     }
     else if (lua_istable (L, 1))
-        luaL_error (L, "Table is 1st arg to new(), did you mean cpu_set.new()"); 
+        luaL_error (L, "Table is 1st arg to new(), did you mean %s.new()",
+                    strcmp (tname, "NodeSet") ? "cpu_set" : "node_set");
     else
         luaL_error (L, "Expected < 2 arguments to new, got %d", lua_gettop (L));
 
     return (1);
 }
 
+static int l_cpu_set_new (lua_State *L)
+{
+    return (l_set_new (L, "CpuSet"));
+}
+
+static int l_node_set_new (lua_State *L)
+{
+    return (l_set_new (L, "NodeSet"));
+}
+
 static int l_cpu_set_count (lua_State *L)
 {
 	int i, n;
@@ -210,7 +283,7 @@ static int l_cpu_set_intersect (lua_State *L)
 
 static int l_cpu_set_add (lua_State *L)
 {
-    cpu_set_t *result = l_cpu_set_alloc (L);
+    cpu_set_t *result = l_set_alloc (L, l_set_tname (L, 1));
     cpu_set_t *s1;
     cpu_set_t *s2;
     int i;
@@ -264,7 +337,7 @@ static int l_cpu_set_delete (lua_State *L)
  */
 static int l_cpu_set_subtract (lua_State *L)
 {
-    cpu_set_t *result = l_cpu_set_alloc (L);
+    cpu_set_t *result = l_set_alloc (L, l_set_tname (L, 1));
     cpu_set_t *s1 = lua_to_cpu_setp (L, 1);
     cpu_set_t *s2 = lua_to_cpu_setp (L, 2);
     int i;
@@ -601,16 +674,17 @@ static int l_cpu_set_expand (lua_State *L)
 static int l_cpu_set_copy (lua_State *L)
 {
     cpu_set_t *setp = lua_to_cpu_setp (L, 1);
-    cpu_set_t *copy = l_cpu_set_alloc (L);
+    cpu_set_t *copy = l_set_alloc (L, l_set_tname (L, 1));
     *copy = *setp;
     return (1);
 }
 
 int l_getaffinity (lua_State *L)
 {
+    pid_t pid = luaL_optint (L, 1, 0);
     cpu_set_t *setp = l_cpu_set_alloc (L);
 
-    if (sched_getaffinity (0, sizeof (*setp), setp) < 0) {
+    if (sched_getaffinity (pid, sizeof (*setp), setp) < 0) {
         lua_pushnil (L);
         lua_pushfstring (L, "sched_getaffinity: %s",  strerror (errno));
         return (2);
@@ -621,16 +695,709 @@ int l_getaffinity (lua_State *L)
 int l_setaffinity (lua_State *L)
 {
     cpu_set_t *setp = lua_to_cpu_setp (L, 1);
+    pid_t pid = luaL_optint (L, 2, 0);
+
+    if (setp == NULL)
+        return (2);
+
+    if (sched_setaffinity (pid, sizeof (*setp), setp) < 0) {
+        lua_pushnil (L);
+        lua_pushfstring (L, "sched_setaffinity: %s", strerror (errno));
+        return (2);
+    }
+    lua_pushboolean (L, 1);
+    return (1);
+}
+
+static int l_syscall_error (lua_State *L, const char *fn)
+{
+    lua_pushnil (L);
+    lua_pushfstring (L, "%s: %s", fn, strerror (errno));
+    return (2);
+}
+
+static int l_syscall_success (lua_State *L)
+{
+    lua_pushboolean (L, 1);
+    return (1);
+}
+
+/*
+ *  Map between names used in lua and constants for the system calls
+ *   below. The constants are defined here if necessary so that this
+ *   module does not depend on libnuma or new kernel headers.
+ */
+struct name_value {
+    const char *name;
+    int         value;
+};
+
+static int l_checkname (lua_State *L, int index, struct name_value *t,
+                        const char *what)
+{
+    const char *name = luaL_checkstring (L, index);
+    for (; t->name; t++)
+        if (strcmp (t->name, name) == 0)
+            return (t->value);
+    return luaL_error (L, "invalid %s '%s'", what, name);
+}
+
+static void l_pushname (lua_State *L, struct name_value *t, int value)
+{
+    for (; t->name; t++) {
+        if (t->value == value) {
+            lua_pushstring (L, t->name);
+            return;
+        }
+    }
+    lua_pushnumber (L, value);
+}
+
+/*
+ *  NUMA memory policy
+ */
+#ifndef MPOL_DEFAULT
+# define MPOL_DEFAULT           0
+# define MPOL_PREFERRED         1
+# define MPOL_BIND              2
+# define MPOL_INTERLEAVE        3
+# define MPOL_LOCAL             4
+#endif
+#ifndef MPOL_F_STATIC_NODES
+# define MPOL_F_STATIC_NODES    (1 << 15)
+# define MPOL_F_RELATIVE_NODES  (1 << 14)
+#endif
+#ifndef MPOL_F_MEMS_ALLOWED
+# define MPOL_F_MEMS_ALLOWED    (1 << 2)
+#endif
+
+static struct name_value mempolicy_modes [] = {
+    { "default",    MPOL_DEFAULT    },
+    { "preferred",  MPOL_PREFERRED  },
+    { "bind",       MPOL_BIND       },
+    { "interleave", MPOL_INTERLEAVE },
+    { "local",      MPOL_LOCAL      },
+    { NULL,         0               },
+};
+
+/*
+ *  The kernel discards the last bit of maxnode, so pass one more
+ *   than the number of bits in the mask (as libnuma does).
+ */
+#define NODE_MAXNODE (NODE_SETSIZE + 1)
+
+/*
+ *  set_mempolicy (mode, [node_set], [flags]). Memory policy applies to
+ *   the calling thread only and is inherited across fork(2) and exec.
+ *   Other processes can be moved with migrate_pages().
+ */
+static int l_set_mempolicy (lua_State *L)
+{
+    int mode = l_checkname (L, 1, mempolicy_modes, "memory policy");
+    cpu_set_t *nodes = NULL;
+    const char *flags = luaL_optstring (L, 3, NULL);
+
+    if (!lua_isnoneornil (L, 2) && !(nodes = lua_to_cpu_setp (L, 2)))
+        return (2);
+
+    if (flags && strcmp (flags, "static") == 0)
+        mode |= MPOL_F_STATIC_NODES;
+    else if (flags && strcmp (flags, "relative") == 0)
+        mode |= MPOL_F_RELATIVE_NODES;
+    else if (flags)
+        return luaL_error (L, "set_mempolicy: invalid flag '%s'", flags);
+
+    if (syscall (SYS_set_mempolicy, mode, nodes,
+                 nodes ? NODE_MAXNODE : 0) < 0)
+        return (l_syscall_error (L, "set_mempolicy"));
+    return (l_syscall_success (L));
+}
+
+/*
+ *  get_mempolicy () returns (mode, node_set) for the calling thread.
+ *   get_mempolicy ("allowed") returns the set of nodes allowed by the
+ *   current cpuset.
+ */
+static int l_get_mempolicy (lua_State *L)
+{
+    const char *what = luaL_optstring (L, 1, NULL);
+    int allowed = 0;
+    int mode = 0;
+    cpu_set_t *nodes;
+
+    if (what && strcmp (what, "allowed") == 0)
+        allowed = 1;
+    else if (what)
+        return luaL_error (L, "get_mempolicy: invalid argument '%s'", what);
+
+    nodes = l_set_alloc (L, "NodeSet");
+    CPU_ZERO (nodes);
+    if (syscall (SYS_get_mempolicy, &mode, nodes, NODE_MAXNODE, NULL,
+                 allowed ? MPOL_F_MEMS_ALLOWED : 0) < 0)
+        return (l_syscall_error (L, "get_mempolicy"));
+
+    if (allowed)
+        return (1);
+
+    l_pushname (L, mempolicy_modes,
+                mode & ~(MPOL_F_STATIC_NODES|MPOL_F_RELATIVE_NODES));
+    lua_insert (L, -2);
+    return (2);
+}
+
+/*
+ *  migrate_pages (pid, from, to) moves pages of any process from
+ *   nodes in [from] to nodes in [to]. Returns the number of pages
+ *   that could not be moved.
+ */
+static int l_migrate_pages (lua_State *L)
+{
+    pid_t pid = luaL_checkint (L, 1);
+    cpu_set_t *from;
+    cpu_set_t *to;
+    long rc;
+
+    if (!(from = lua_to_cpu_setp (L, 2)) || !(to = lua_to_cpu_setp (L, 3)))
+        return (2);
+
+    if ((rc = syscall (SYS_migrate_pages, pid, NODE_MAXNODE, from, to)) < 0)
+        return (l_syscall_error (L, "migrate_pages"));
+    lua_pushnumber (L, rc);
+    return (1);
+}
+
+/*
+ *  CPU scheduling policy
+ */
+#ifndef SCHED_BATCH
+# define SCHED_BATCH            3
+#endif
+#ifndef SCHED_IDLE
+# define SCHED_IDLE             5
+#endif
+#ifndef SCHED_DEADLINE
+# define SCHED_DEADLINE         6
+#endif
+#ifndef SCHED_RESET_ON_FORK
+# define SCHED_RESET_ON_FORK    0x40000000
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+# define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+static struct name_value sched_policies [] = {
+    { "other",      SCHED_OTHER     },
+    { "fifo",       SCHED_FIFO      },
+    { "rr",         SCHED_RR        },
+    { "batch",      SCHED_BATCH     },
+    { "idle",       SCHED_IDLE      },
+    { "deadline",   SCHED_DEADLINE  },
+    { NULL,         0               },
+};
+
+/*
+ *  setscheduler (pid, policy, [priority])
+ */
+static int l_setscheduler (lua_State *L)
+{
+    pid_t pid = luaL_checkint (L, 1);
+    int policy = l_checkname (L, 2, sched_policies, "scheduling policy");
+    struct sched_param p;
+
+    memset (&p, 0, sizeof (p));
+    p.sched_priority = luaL_optint (L, 3, 0);
+
+    if (sched_setscheduler (pid, policy, &p) < 0)
+        return (l_syscall_error (L, "sched_setscheduler"));
+    return (l_syscall_success (L));
+}
+
+/*
+ *  getscheduler ([pid]) returns (policy, priority)
+ */
+static int l_getscheduler (lua_State *L)
+{
+    pid_t pid = luaL_optint (L, 1, 0);
+    struct sched_param p;
+    int policy;
+
+    if ((policy = sched_getscheduler (pid)) < 0
+        || sched_getparam (pid, &p) < 0)
+        return (l_syscall_error (L, "sched_getscheduler"));
+
+    l_pushname (L, sched_policies, policy & ~SCHED_RESET_ON_FORK);
+    lua_pushnumber (L, p.sched_priority);
+    return (2);
+}
+
+/*
+ *  Private copy of the kernel's struct sched_attr (SCHED_ATTR_SIZE_VER0),
+ *   since glibc only recently started to provide it.
+ */
+struct l_sched_attr {
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t  sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+static uint64_t l_getfield_u64 (lua_State *L, int t, const char *key)
+{
+    uint64_t val;
+    lua_getfield (L, t, key);
+    val = (uint64_t) luaL_optnumber (L, -1, 0);
+    lua_pop (L, 1);
+    return (val);
+}
+
+/*
+ *  setattr (pid, { policy=, priority=, nice=, runtime=, deadline=,
+ *                  period=, reset_on_fork= })
+ *
+ *  runtime, deadline and period are in nanoseconds and only used
+ *   with the "deadline" policy.
+ */
+static int l_setattr (lua_State *L)
+{
+    pid_t pid = luaL_checkint (L, 1);
+    struct l_sched_attr attr;
+
+    luaL_checktype (L, 2, LUA_TTABLE);
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+
+    lua_getfield (L, 2, "policy");
+    attr.sched_policy = lua_isnil (L, -1) ? SCHED_OTHER :
+        l_checkname (L, -1, sched_policies, "scheduling policy");
+    lua_pop (L, 1);
+
+    lua_getfield (L, 2, "reset_on_fork");
+    if (lua_toboolean (L, -1))
+        attr.sched_flags |= SCHED_FLAG_RESET_ON_FORK;
+    lua_pop (L, 1);
+
+    lua_getfield (L, 2, "nice");
+    attr.sched_nice = luaL_optint (L, -1, 0);
+    lua_pop (L, 1);
+
+    attr.sched_priority = l_getfield_u64 (L, 2, "priority");
+    attr.sched_runtime =  l_getfield_u64 (L, 2, "runtime");
+    attr.sched_deadline = l_getfield_u64 (L, 2, "deadline");
+    attr.sched_period =   l_getfield_u64 (L, 2, "period");
+
+    if (syscall (SYS_sched_setattr, pid, &attr, 0) < 0)
+        return (l_syscall_error (L, "sched_setattr"));
+    return (l_syscall_success (L));
+}
+
+/*
+ *  I/O scheduling class and priority (see ioprio_set(2))
+ */
+#define IOPRIO_CLASS_SHIFT      13
+#define IOPRIO_PRIO_MASK        ((1 << IOPRIO_CLASS_SHIFT) - 1)
+#define IOPRIO_WHO_PROCESS      1
+
+static struct name_value ioprio_classes [] = {
+    { "none",       0 },
+    { "rt",         1 },
+    { "be",         2 },
+    { "idle",       3 },
+    { NULL,         0 },
+};
+
+/*
+ *  ioprio_set (pid, class, [level])
+ */
+static int l_ioprio_set (lua_State *L)
+{
+    pid_t pid = luaL_checkint (L, 1);
+    int class = l_checkname (L, 2, ioprio_classes, "I/O class");
+    int level = luaL_optint (L, 3, 0);
+
+    if (level < 0 || level > 7)
+        return luaL_error (L, "ioprio_set: invalid level %d", level);
+
+    if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid,
+                 (class << IOPRIO_CLASS_SHIFT) | level) < 0)
+        return (l_syscall_error (L, "ioprio_set"));
+    return (l_syscall_success (L));
+}
+
+/*
+ *  ioprio_get ([pid]) returns (class, level)
+ */
+static int l_ioprio_get (lua_State *L)
+{
+    pid_t pid = luaL_optint (L, 1, 0);
+    long rc;
+
+    if ((rc = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid)) < 0)
+        return (l_syscall_error (L, "ioprio_get"));
+
+    l_pushname (L, ioprio_classes, rc >> IOPRIO_CLASS_SHIFT);
+    lua_pushnumber (L, rc & IOPRIO_PRIO_MASK);
+    return (2);
+}
+
+/*
+ *  setpriority (pid, nice) / getpriority ([pid])
+ */
+static int l_setpriority (lua_State *L)
+{
+    pid_t pid = luaL_checkint (L, 1);
+    int nice = luaL_checkint (L, 2);
+
+    if (setpriority (PRIO_PROCESS, pid, nice) < 0)
+        return (l_syscall_error (L, "setpriority"));
+    return (l_syscall_success (L));
+}
+
+static int l_getpriority (lua_State *L)
+{
+    pid_t pid = luaL_optint (L, 1, 0);
+    int nice;
+
+    /*  -1 is a valid return value, so errno must be checked */
+    errno = 0;
+    if ((nice = getpriority (PRIO_PROCESS, pid)) == -1 && errno != 0)
+        return (l_syscall_error (L, "getpriority"));
+    lua_pushnumber (L, nice);
+    return (1);
+}
+
+/*
+ *  Native readers for procfs, sysfs and the kernel log, so scripts
+ *   do not need to fork cat(1) or dmesg(1) for every task.
+ */
+
+static int l_push_errno (lua_State *L, const char *fn, const char *path)
+{
+    lua_pushnil (L);
+    lua_pushfstring (L, "%s: %s: %s", fn, path, strerror (errno));
+    return (2);
+}
+
+/*
+ *  Read the whole of file [path] into a string on the lua stack.
+ *   procfs and sysfs files report a bogus size, so read until EOF.
+ */
+static int read_file (lua_State *L, const char *path)
+{
+    luaL_Buffer b;
+    ssize_t n;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return (-1);
+
+    luaL_buffinit (L, &b);
+    for (;;) {
+        char *p = luaL_prepbuffer (&b);
+        if ((n = read (fd, p, LUAL_BUFFERSIZE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            close (fd);
+            luaL_pushresult (&b);
+            lua_pop (L, 1);
+            return (-1);
+        }
+        if (n == 0)
+            break;
+        luaL_addsize (&b, n);
+    }
+    close (fd);
+    luaL_pushresult (&b);
+    return (0);
+}
+
+static int l_readfile (lua_State *L)
+{
+    const char *path = luaL_checkstring (L, 1);
+
+    if (read_file (L, path) < 0)
+        return (l_push_errno (L, "readfile", path));
+    return (1);
+}
 
-    if (sched_setaffinity (0, sizeof (*setp), setp) < 0) {
+static const char * proc_path (lua_State *L, int index, const char *file)
+{
+    if (lua_isnoneornil (L, index))
+        return lua_pushfstring (L, "/proc/self/%s", file);
+    return lua_pushfstring (L, "/proc/%d/%s",
+                            (int) luaL_checkinteger (L, index), file);
+}
+
+/*
+ *  Return /proc/[pid]/status as a table. Values of the form "N kB"
+ *   and plain integers are converted to numbers (in kB for the former),
+ *   everything else is left as a string.
+ */
+static int l_proc_status (lua_State *L)
+{
+    const char *path = proc_path (L, 1, "status");
+    const char *s;
+    const char *eol;
+
+    if (read_file (L, path) < 0)
+        return (l_push_errno (L, "proc_status", path));
+
+    s = lua_tostring (L, -1);
+    lua_newtable (L);
+
+    for (; *s; s = eol + 1) {
+        const char *colon;
+        const char *v;
+        char *end;
+        long long n;
+
+        if (!(eol = strchr (s, '\n')))
+            eol = s + strlen (s);
+        if (!(colon = memchr (s, ':', eol - s)))
+            goto next;
+
+        lua_pushlstring (L, s, colon - s);
+
+        for (v = colon + 1; v < eol && isspace (*v); v++)
+            ;
+        n = strtoll (v, &end, 10);
+        if (end != v && (end == eol || strncmp (end, " kB", 3) == 0))
+            lua_pushnumber (L, (lua_Number) n);
+        else
+            lua_pushlstring (L, v, eol - v);
+
+        lua_rawset (L, -3);
+next:
+        if (*eol == '\0')
+            break;
+    }
+    return (1);
+}
+
+/*
+ *  Field names for /proc/[pid]/stat, from proc(5). Fields 1 and 2
+ *   (pid and comm) are handled separately.
+ */
+static const char *proc_stat_fields [] = {
+    "state", "ppid", "pgrp", "session", "tty_nr", "tpgid", "flags",
+    "minflt", "cminflt", "majflt", "cmajflt", "utime", "stime",
+    "cutime", "cstime", "priority", "nice", "num_threads",
+    "itrealvalue", "starttime", "vsize", "rss", "rsslim", "startcode",
+    "endcode", "startstack", "kstkesp", "kstkeip", "signal", "blocked",
+    "sigignore", "sigcatch", "wchan", "nswap", "cnswap", "exit_signal",
+    "processor", "rt_priority", "policy", "delayacct_blkio_ticks",
+    "guest_time", "cguest_time",
+    NULL
+};
+
+static int l_proc_stat (lua_State *L)
+{
+    const char *path = proc_path (L, 1, "stat");
+    const char *s;
+    const char *lp;
+    const char *rp;
+    int i;
+
+    if (read_file (L, path) < 0)
+        return (l_push_errno (L, "proc_stat", path));
+
+    /*
+     *  comm may contain spaces and parentheses, so it extends from
+     *   the first '(' to the last ')'
+     */
+    s = lua_tostring (L, -1);
+    if (!(lp = strchr (s, '(')) || !(rp = strrchr (s, ')'))) {
         lua_pushnil (L);
-        lua_pushfstring (L, "sched_getaffinity: %s", strerror (errno));
+        lua_pushfstring (L, "proc_stat: %s: failed to parse", path);
         return (2);
     }
+
+    lua_newtable (L);
+    lua_pushnumber (L, strtol (s, NULL, 10));
+    lua_setfield (L, -2, "pid");
+    lua_pushlstring (L, lp + 1, rp - lp - 1);
+    lua_setfield (L, -2, "comm");
+
+    s = rp + 1;
+    for (i = 0; proc_stat_fields[i]; i++) {
+        char *end;
+        while (*s == ' ')
+            s++;
+        if (*s == '\0' || *s == '\n')
+            break;
+        if (i == 0) {
+            lua_pushlstring (L, s, 1);
+            s++;
+        }
+        else {
+            lua_pushnumber (L, (lua_Number) strtoull (s, &end, 10));
+            s = end;
+        }
+        lua_setfield (L, -2, proc_stat_fields[i]);
+    }
+    return (1);
+}
+
+/*
+ *  /dev/kmsg reader. Each read(2) returns exactly one record of the
+ *   form "prio,seq,usec,flags;message\n". The reader keeps the last
+ *   sequence number returned so that repeated calls only return new
+ *   messages, even if the device is reopened.
+ */
+struct kmsg_reader {
+    int fd;
+    long long seq;
+};
+
+#define KMSG_RECORD_MAX 8192
+
+static struct kmsg_reader * l_tokmsg (lua_State *L, int index)
+{
+    struct kmsg_reader *k = luaL_checkudata (L, index, "KmsgReader");
+    if (k->fd < 0)
+        luaL_error (L, "kmsg: attempt to use a closed reader");
+    return (k);
+}
+
+static int l_kmsg_open (lua_State *L)
+{
+    struct kmsg_reader *k;
+    int fd;
+
+    if ((fd = open ("/dev/kmsg", O_RDONLY | O_NONBLOCK)) < 0)
+        return (l_push_errno (L, "kmsg_open", "/dev/kmsg"));
+
+    k = lua_newuserdata (L, sizeof (*k));
+    k->fd = fd;
+    k->seq = lua_isnoneornil (L, 1) ? -1 : (long long) luaL_checknumber (L, 1);
+    luaL_getmetatable (L, "KmsgReader");
+    lua_setmetatable (L, -2);
+    return (1);
+}
+
+/*
+ *  Parse one kmsg record and push it onto the stack as a table.
+ *   Returns -1 if the record could not be parsed.
+ */
+static int kmsg_record_push (lua_State *L, char *buf, long long *seqp)
+{
+    char *msg;
+    char *eol;
+    int prio;
+    long long seq;
+    unsigned long long usec;
+
+    if (sscanf (buf, "%d,%lld,%llu,", &prio, &seq, &usec) != 3)
+        return (-1);
+    if (!(msg = strchr (buf, ';')))
+        return (-1);
+    msg++;
+    if ((eol = strchr (msg, '\n')))
+        *eol = '\0';
+
+    lua_newtable (L);
+    lua_pushnumber (L, seq);
+    lua_setfield (L, -2, "seq");
+    lua_pushnumber (L, prio & 7);
+    lua_setfield (L, -2, "level");
+    lua_pushnumber (L, prio >> 3);
+    lua_setfield (L, -2, "facility");
+    lua_pushnumber (L, usec / 1.0e6);
+    lua_setfield (L, -2, "time");
+    lua_pushstring (L, msg);
+    lua_setfield (L, -2, "msg");
+
+    *seqp = seq;
+    return (0);
+}
+
+/*
+ *  k:read ([max]) returns an array of records newer than the cursor.
+ */
+static int l_kmsg_read (lua_State *L)
+{
+    struct kmsg_reader *k = l_tokmsg (L, 1);
+    int max = luaL_optint (L, 2, 0);
+    char buf [KMSG_RECORD_MAX];
+    int n = 0;
+
+    lua_newtable (L);
+    while (max <= 0 || n < max) {
+        long long seq;
+        ssize_t len = read (k->fd, buf, sizeof (buf) - 1);
+
+        if (len < 0) {
+            /*
+             *  EPIPE: the record we were about to read was overwritten
+             *   in the ring buffer. The next read continues with the
+             *   oldest available record.
+             */
+            if (errno == EINTR || errno == EPIPE)
+                continue;
+            if (errno == EAGAIN)
+                break;
+            return (l_push_errno (L, "kmsg:read", "/dev/kmsg"));
+        }
+        if (len == 0)
+            break;
+        buf[len] = '\0';
+
+        if (kmsg_record_push (L, buf, &seq) < 0)
+            continue;
+        if (seq <= k->seq) {
+            lua_pop (L, 1);
+            continue;
+        }
+        k->seq = seq;
+        lua_rawseti (L, -2, ++n);
+    }
+    return (1);
+}
+
+/*
+ *  k:seek ("end") skips all current messages, k:seek ("start")
+ *   rewinds to the oldest message in the ring buffer. Both reset
+ *   the sequence cursor.
+ */
+static int l_kmsg_seek (lua_State *L)
+{
+    struct kmsg_reader *k = l_tokmsg (L, 1);
+    const char *where = luaL_optstring (L, 2, "end");
+    int whence;
+
+    if (strcmp (where, "end") == 0)
+        whence = SEEK_END;
+    else if (strcmp (where, "start") == 0)
+        whence = SEEK_SET;
+    else
+        return luaL_error (L, "kmsg:seek: invalid argument '%s'", where);
+
+    if (lseek (k->fd, 0, whence) < 0)
+        return (l_push_errno (L, "kmsg:seek", "/dev/kmsg"));
+    k->seq = -1;
     lua_pushboolean (L, 1);
     return (1);
 }
 
+static int l_kmsg_seq (lua_State *L)
+{
+    struct kmsg_reader *k = l_tokmsg (L, 1);
+    lua_pushnumber (L, k->seq);
+    return (1);
+}
+
+static int l_kmsg_close (lua_State *L)
+{
+    struct kmsg_reader *k = luaL_checkudata (L, 1, "KmsgReader");
+    if (k->fd >= 0)
+        close (k->fd);
+    k->fd = -1;
+    return (0);
+}
+
 static const struct luaL_Reg cpu_set_functions [] = {
 	{ "new",        l_cpu_set_new       },
     { "union",      l_cpu_set_union     },
@@ -666,14 +1433,57 @@ static const struct luaL_Reg cpu_set_methods [] = {
 	{ NULL,         NULL                },
 };
 
+static const struct luaL_Reg node_set_functions [] = {
+	{ "new",        l_node_set_new      },
+    { "union",      l_cpu_set_union     },
+    { "intersect",  l_cpu_set_intersect },
+	{ NULL,         NULL                },
+};
+
+static const struct luaL_Reg kmsg_methods [] = {
+    { "read",       l_kmsg_read         },
+    { "seek",       l_kmsg_seek         },
+    { "seq",        l_kmsg_seq          },
+    { "close",      l_kmsg_close        },
+    { "__gc",       l_kmsg_close        },
+	{ NULL,         NULL                },
+};
+
 static const struct luaL_Reg schedutils_functions [] = {
     { "getaffinity", l_getaffinity      },
     { "setaffinity", l_setaffinity      },
+    { "readfile",    l_readfile         },
+    { "proc_status", l_proc_status      },
+    { "proc_stat",   l_proc_stat        },
+    { "kmsg_open",   l_kmsg_open        },
+    { "set_mempolicy", l_set_mempolicy  },
+    { "get_mempolicy", l_get_mempolicy  },
+    { "migrate_pages", l_migrate_pages  },
+    { "setscheduler",  l_setscheduler   },
+    { "getscheduler",  l_getscheduler   },
+    { "setattr",       l_setattr        },
+    { "ioprio_set",    l_ioprio_set     },
+    { "ioprio_get",    l_ioprio_get     },
+    { "setpriority",   l_setpriority    },
+    { "getpriority",   l_getpriority    },
 	{ NULL,          NULL               },
 };
 
 int luaopen_schedutils (lua_State *L)
 {
+    luaL_newmetatable (L, "KmsgReader");
+    lua_pushvalue (L, -1);
+    lua_setfield (L, -2, "__index");
+    luaL_register (L, NULL, kmsg_methods);
+    lua_pop (L, 1);
+
+    /*
+     *  node_set shares all of its methods with cpu_set
+     */
+    luaL_newmetatable (L, "NodeSet");
+    luaL_register (L, NULL, cpu_set_methods);
+    lua_pop (L, 1);
+
 	luaL_newmetatable (L, "CpuSet");
 	luaL_register (L, NULL, cpu_set_methods);
 
@@ -691,6 +1501,12 @@ int luaopen_schedutils (lua_State *L)
     lua_pushvalue (L, -2);
     lua_setfield (L, -2, "cpuset");
 
+    lua_newtable (L);
+    lua_pushnumber (L, NODE_SETSIZE);
+    lua_setfield (L, -2, "SETSIZE");
+    luaL_register (L, NULL, node_set_functions);
+    lua_setfield (L, -2, "nodeset");
+
     return 1;
 }
 
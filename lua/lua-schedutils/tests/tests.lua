@@ -511,3 +511,55 @@ function test_cpu_set_tohex()
 		                           t.input, tostring(c), hex, tostring(new)))
 	end
 end
+
+function test_readfile()
+	local s, err = sched.readfile ("/proc/self/stat")
+	assert_string (s, err)
+	local r, err = sched.readfile ("/nonexistent")
+	assert_nil (r)
+	assert_string (err)
+end
+
+function test_proc_status()
+	local st, err = sched.proc_status ()
+	assert_table (st, err)
+	assert_string (st.Name)
+	assert_number (st.Pid)
+	assert_number (st.VmRSS)
+end
+
+function test_proc_stat()
+	local st, err = sched.proc_stat ()
+	assert_table (st, err)
+	assert_number (st.pid)
+	assert_string (st.comm)
+	assert_string (st.state)
+	assert_number (st.num_threads)
+	assert_true (st.num_threads >= 1)
+end
+
+function test_node_set()
+	local node_set = sched.nodeset
+	local n = node_set.new ("0-3")
+	assert_userdata (n)
+	assert_equal ("0-3", tostring (n))
+	assert_equal (4, n:count())
+	assert_true (n:isset (2))
+	n:clr (2)
+	assert_equal ("0,1,3", tostring (n))
+	local u = n:union ("4")
+	assert_equal ("0,1,3,4", tostring (u))
+	assert_equal ("0,1,3,4", tostring (node_set.new (cpu_set.new ("0,1,3,4"))))
+end
+
+function test_getscheduler()
+	local policy, prio = sched.getscheduler ()
+	assert_string (policy)
+	assert_number (prio)
+end
+
+function test_getpriority()
+	local nice, err = sched.getpriority ()
+	assert_number (nice, err)
+	assert_true (sched.setpriority (0, nice))
+end
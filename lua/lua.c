@@ -24,14 +24,27 @@
 
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <dlfcn.h>
 #include <glob.h>
 #include <setjmp.h> /* need longjmp for lua_atpanic */
 #include <libgen.h> /* basename(3) */
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+extern char **environ;
 
 #include <slurm/spank.h>
 #include <lua.h>
@@ -42,10 +55,69 @@
 
 SPANK_PLUGIN (lua, 1)
 
-/*  Name of spank_t lightuserdata reference in
- *   spank table passed to lua spank functions.
+/*  Name of metatable for the spank handle userdata passed
+ *   to lua spank functions.
+ */
+#define SPANK_HANDLE_MT "SPANK.handle"
+
+/*
+ *  The spank handle is a single userdata per lua State, reused
+ *   for every callback. Only the spank_t is updated per call, and
+ *   is cleared again on return so that a handle saved by a script
+ *   cannot be used outside of a callback.
+ *
+ *  Built-in fields and methods are read-only. Fields assigned by
+ *   a script go into a separate table which is replaced after any
+ *   call that wrote to it, so they don't leak between scripts or
+ *   into later callbacks.
+ */
+struct lua_spank_handle {
+    spank_t sp;
+    int dirty;
+};
+static int spank_handle_ref = LUA_NOREF;
+static int spank_handle_fields_ref = LUA_NOREF;
+static spank_context_t spank_handle_ctx = S_CTX_ERROR;
+static char **spank_handle_av = NULL;
+static int spank_handle_ac = -1;
+
+/*
+ *  Spank callbacks which may be implemented by lua scripts. Each
+ *   script's implemented callbacks are resolved once after load
+ *   into a bitmap indexed by position in this table.
+ */
+static const char * spank_callback_names [] = {
+    "slurm_spank_init",
+    "slurm_spank_slurmd_init",
+    "slurm_spank_job_prolog",
+    "slurm_spank_init_post_opt",
+    "slurm_spank_local_user_init",
+    "slurm_spank_user_init",
+    "slurm_spank_task_init_privileged",
+    "slurm_spank_task_init",
+    "slurm_spank_task_post_fork",
+    "slurm_spank_task_exit",
+    "slurm_spank_job_epilog",
+    "slurm_spank_slurmd_exit",
+    "slurm_spank_exit",
+    "slurm_spank_lua_reset",
+    NULL
+};
+#define SPANK_NCALLBACKS \
+    (sizeof (spank_callback_names) / sizeof (spank_callback_names[0]) - 1)
+
+/*
+ *  Per-script, per-callback profiling data, only allocated when
+ *   the 'profile' option is used.
  */
-#define SPANK_REFNAME "spank"
+struct lua_script_prof {
+    unsigned long ncalls;
+    double        wall;     /* seconds */
+    double        cpu;      /* seconds */
+    long          mem;      /* bytes, lua heap growth */
+};
+static int lua_profile = 0;
+static const char *lua_profile_file = NULL;
 
 /*
  *  This module keeps a list of options provided by the lua
@@ -79,15 +151,130 @@ struct lua_script {
     lua_State *L;
     int ref;
     int fail_on_error;
+    unsigned long callbacks;
+    struct lua_script_prof *prof;
 };
 List lua_script_list = NULL;
 
+/*
+ *  Path, inode, size and modification time of every script matched
+ *   by the script glob when the global lua State was created, along
+ *   with the plugin arguments. Used in resident mode to decide if the
+ *   loaded scripts are still valid.
+ */
+struct lua_script_stamp {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+static List script_stamp_list = NULL;
+static char *resident_args = NULL;
+static size_t resident_args_len = 0;
+static spank_context_t resident_context = S_CTX_ERROR;
+
 /*
  *  Tell lua_atpanic where to longjmp on exceptions:
  */
 static jmp_buf panicbuf;
 static int spank_atpanic (lua_State *L) { longjmp (panicbuf, 0); }
 
+/*
+ *  Resource limits for lua scripts (maxmem= and maxinstr= options):
+ *
+ *  All memory for the lua State is allocated via lua_limit_alloc(),
+ *   which accounts for every allocation and, while a script is
+ *   running under lua_script_pcall(), refuses allocations which
+ *   would exceed the memory ceiling for the State. Lua then raises
+ *   a memory error in the script.
+ *
+ *  The instruction budget is enforced per callback with a count hook
+ *   which raises an error once more than maxinstr VM instructions
+ *   have been executed (at a granularity of LUA_INSTR_HOOK_COUNT).
+ */
+#define LUA_INSTR_HOOK_COUNT 1000
+
+struct lua_limits {
+    size_t        mem_used;
+    size_t        mem_max;
+    int           mem_enforce;
+    int           mem_exceeded;
+    unsigned long instr_max;
+    unsigned long instr_count;
+    int           instr_exceeded;
+};
+static struct lua_limits lua_limits;
+
+static void * lua_limit_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    struct lua_limits *l = ud;
+    void *p;
+
+    if (nsize == 0) {
+        free (ptr);
+        l->mem_used -= osize;
+        return (NULL);
+    }
+
+    if (l->mem_enforce && l->mem_max && nsize > osize
+        && l->mem_used + (nsize - osize) > l->mem_max) {
+        l->mem_exceeded = 1;
+        return (NULL);
+    }
+
+    if ((p = realloc (ptr, nsize)) == NULL)
+        return (NULL);
+
+    l->mem_used += nsize - osize;
+    return (p);
+}
+
+static void lua_instr_hook (lua_State *L, lua_Debug *ar)
+{
+    lua_limits.instr_count += LUA_INSTR_HOOK_COUNT;
+    if (lua_limits.instr_count > lua_limits.instr_max) {
+        lua_limits.instr_exceeded = 1;
+        luaL_error (L, "instruction limit (%lu) exceeded",
+                    lua_limits.instr_max);
+    }
+}
+
+/*
+ *  lua_pcall() for script [s] with memory and instruction limits
+ *   applied. Limit violations are reported for the script and
+ *   the function [fn] being called.
+ */
+static int lua_script_pcall (struct lua_script *s, const char *fn,
+        int nargs, int nresults)
+{
+    int rc;
+
+    lua_limits.mem_enforce = 1;
+    lua_limits.mem_exceeded = 0;
+    lua_limits.instr_exceeded = 0;
+
+    if (lua_limits.instr_max) {
+        lua_limits.instr_count = 0;
+        lua_sethook (s->L, lua_instr_hook, LUA_MASKCOUNT, LUA_INSTR_HOOK_COUNT);
+    }
+
+    rc = lua_pcall (s->L, nargs, nresults, 0);
+
+    if (lua_limits.instr_max)
+        lua_sethook (s->L, NULL, 0, 0);
+    lua_limits.mem_enforce = 0;
+
+    if (lua_limits.mem_exceeded)
+        slurm_error ("spank/lua: %s: %s: memory limit (%lu bytes) exceeded",
+                     basename (s->path), fn,
+                     (unsigned long) lua_limits.mem_max);
+    if (lua_limits.instr_exceeded)
+        slurm_error ("spank/lua: %s: %s: instruction limit (%lu) exceeded",
+                     basename (s->path), fn, lua_limits.instr_max);
+    return (rc);
+}
+
 /*
  *  Lua scripts pass string versions of spank_item_t to get/set_time.
  *   This table maps the name to item and vice versa.
@@ -164,31 +351,22 @@ static int lua_script_rc (lua_State *L)
         rc = lua_tonumber (L, -1);
 
     /* Clean up the stack */
-    lua_pop (L, 0);
+    lua_pop (L, 1);
     return (rc);
 }
 
 /*
- *  Return spank_t handle as lightuserdata from the spank table
- *   at index [index] on the Lua stack.
+ *  Return spank_t from the spank handle userdata at index [index]
+ *   on the Lua stack.
  */
 static spank_t lua_getspank (lua_State *L, int index)
 {
-    spank_t sp;
-
-    if (!lua_istable (L, 1))
-        luaL_error (L, "Invalid argument expected table got %s",
-                luaL_typename (L, 1));
-
-    lua_getfield (L, index, SPANK_REFNAME);
-    if (!lua_islightuserdata (L, -1))
-        return (NULL);
+    struct lua_spank_handle *h = luaL_checkudata (L, index, SPANK_HANDLE_MT);
 
-    sp = lua_touserdata (L, -1);
+    if (h->sp == NULL)
+        luaL_error (L, "spank handle used outside of spank callback");
 
-    /*  Pop lightuserdata off the stack */
-    lua_pop (L, 1);
-    return (sp);
+    return (h->sp);
 }
 
 /*
@@ -284,7 +462,7 @@ static void set_env_table_entry (lua_State *L, int i, const char *entry)
 /*
  *  Copy S_JOB_ENV to a table on the Lua stack.
  */
-static int l_spank_get_item_env (lua_State *L, spank_t sp)
+static int l_spank_get_item_env_table (lua_State *L, spank_t sp)
 {
     spank_err_t err;
     const char **env;
@@ -304,6 +482,131 @@ static int l_spank_get_item_env (lua_State *L, spank_t sp)
     return (1);
 }
 
+/*
+ *  spank:get_item ("S_JOB_ENV", "lazy") returns a proxy userdata
+ *   which reads the job environment in place on each access, instead
+ *   of copying the whole environment into a table:
+ *
+ *    env.NAME / env["NAME"]   value of NAME or nil
+ *    env ()                   iterator over name, value (also __pairs)
+ *
+ *  The environment is fetched from SLURM on every access, since it
+ *   may be reallocated by setenv. The proxy refers to the spank handle,
+ *   so like the handle it is only valid during a spank callback.
+ */
+#define SPANK_ENV_MT "SPANK.env"
+
+struct lua_spank_env {
+    struct lua_spank_handle *h;
+};
+
+static const char ** lua_spank_env_get (lua_State *L, int index)
+{
+    struct lua_spank_env *e = luaL_checkudata (L, index, SPANK_ENV_MT);
+    const char **env;
+    spank_err_t err;
+
+    if (e->h->sp == NULL)
+        luaL_error (L, "S_JOB_ENV used outside of spank callback");
+
+    err = spank_get_item (e->h->sp, S_JOB_ENV, &env);
+    if (err != ESPANK_SUCCESS)
+        luaL_error (L, "S_JOB_ENV: %s", spank_strerror (err));
+
+    return (env);
+}
+
+/*
+ *  Iterator closure with upvalues proxy, index of next entry, and
+ *   the environment array that index refers to. The index is only
+ *   revalidated if the array was reallocated since the last step.
+ */
+static int l_spank_env_next (lua_State *L)
+{
+    const char **env = lua_spank_env_get (L, lua_upvalueindex (1));
+    int i = lua_tointeger (L, lua_upvalueindex (2));
+    const char *val;
+
+    if (env != lua_touserdata (L, lua_upvalueindex (3))) {
+        int n;
+        for (n = 0; n < i && env[n] != NULL; n++)
+            ;
+        i = n;
+        lua_pushlightuserdata (L, env);
+        lua_replace (L, lua_upvalueindex (3));
+    }
+    if (env[i] == NULL)
+        return (0);
+
+    lua_pushinteger (L, i + 1);
+    lua_replace (L, lua_upvalueindex (2));
+
+    if ((val = strchr (env[i], '=')) == NULL) {
+        lua_pushstring (L, env[i]);
+        lua_pushstring (L, "");
+    }
+    else {
+        lua_pushlstring (L, env[i], val - env[i]);
+        lua_pushstring (L, val+1);
+    }
+    return (2);
+}
+
+static int l_spank_env_pairs (lua_State *L)
+{
+    const char **env = lua_spank_env_get (L, 1);
+
+    lua_pushvalue (L, 1);
+    lua_pushinteger (L, 0);
+    lua_pushlightuserdata (L, env);
+    lua_pushcclosure (L, l_spank_env_next, 3);
+    return (1);
+}
+
+static int l_spank_env_index (lua_State *L)
+{
+    const char **env = lua_spank_env_get (L, 1);
+    const char **p;
+    size_t len;
+    const char *name = luaL_checklstring (L, 2, &len);
+
+    for (p = env; *p != NULL; p++) {
+        if (strncmp (*p, name, len) == 0 && (*p)[len] == '=') {
+            lua_pushstring (L, *p + len + 1);
+            return (1);
+        }
+    }
+
+    lua_pushnil (L);
+    return (1);
+}
+
+static int l_spank_get_item_env (lua_State *L, spank_t sp)
+{
+    struct lua_spank_env *e;
+    const char *mode = luaL_optstring (L, 3, NULL);
+
+    if (mode == NULL)
+        return l_spank_get_item_env_table (L, sp);
+    if (strcmp (mode, "lazy") != 0)
+        return luaL_error (L, "S_JOB_ENV: invalid mode '%s'", mode);
+
+    e = lua_newuserdata (L, sizeof (*e));
+    e->h = luaL_checkudata (L, 1, SPANK_HANDLE_MT);
+
+    if (luaL_newmetatable (L, SPANK_ENV_MT)) {
+        lua_pushcfunction (L, l_spank_env_index);
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, l_spank_env_pairs);
+        lua_setfield (L, -2, "__call");
+        lua_pushcfunction (L, l_spank_env_pairs);
+        lua_setfield (L, -2, "__pairs");
+    }
+    lua_setmetatable (L, -2);
+
+    return (1);
+}
+
 /*
  *  Copy GID list as array on the Lua stack.
  */
@@ -571,7 +874,7 @@ static int lua_spank_option_callback (int val, const char *optarg, int remote)
             o->script->path, o->l_function, o->s_opt.name,
             optarg ? optarg : "nil");
 
-    if (lua_pcall (L, 3, 1, 0) != 0) {
+    if (lua_script_pcall (o->script, o->l_function, 3, 1) != 0) {
         slurm_error ("Failed to call lua callback function %s: %s",
                     o->l_function, lua_tostring (L, -1));
         lua_pop (L, 1);
@@ -820,134 +1123,1434 @@ static const struct luaL_Reg spank_functions [] = {
 };
 
 
-static int lua_spank_table_create (lua_State *L, spank_t sp, int ac, char **av)
+/*
+ *  Built-in fields and methods of the spank handle are kept in the
+ *   environment table of the userdata, script fields in the table
+ *   referenced by spank_handle_fields_ref.
+ */
+static int l_spank_handle_index (lua_State *L)
 {
-    const char *str;
-    int i;
+    lua_getfenv (L, 1);
+    lua_pushvalue (L, 2);
+    lua_rawget (L, -2);
+    if (!lua_isnil (L, -1))
+        return (1);
 
-    lua_newtable (L);
-    luaL_register (L, NULL, spank_functions);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, spank_handle_fields_ref);
+    lua_pushvalue (L, 2);
+    lua_rawget (L, -2);
+    return (1);
+}
 
-    /*  Register spank handle as light userdata inside spank table:
-     */
-    lua_pushlightuserdata (L, sp);
-    lua_setfield (L, -2, SPANK_REFNAME);
+static int l_spank_handle_newindex (lua_State *L)
+{
+    struct lua_spank_handle *h = lua_touserdata (L, 1);
+
+    lua_getfenv (L, 1);
+    lua_pushvalue (L, 2);
+    lua_rawget (L, -2);
+    if (!lua_isnil (L, -1))
+        return luaL_error (L, "spank handle field '%s' is read-only",
+                           lua_tostring (L, 2));
+
+    lua_rawgeti (L, LUA_REGISTRYINDEX, spank_handle_fields_ref);
+    lua_pushvalue (L, 2);
+    lua_pushvalue (L, 3);
+    lua_rawset (L, -3);
+    h->dirty = 1;
+    return (0);
+}
+
+static void lua_spank_handle_create (lua_State *L, spank_t sp)
+{
+    struct lua_spank_handle *h;
+    const char *str;
 
-    l_spank_context (L);
-    lua_setfield (L, -2, "context");
+    h = lua_newuserdata (L, sizeof (*h));
+    h->sp = NULL;
+    h->dirty = 0;
 
+    if (luaL_newmetatable (L, SPANK_HANDLE_MT)) {
+        lua_pushcfunction (L, l_spank_handle_index);
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, l_spank_handle_newindex);
+        lua_setfield (L, -2, "__newindex");
+    }
+    lua_setmetatable (L, -2);
+
+    lua_newtable (L);
+    luaL_register (L, NULL, spank_functions);
     if (spank_get_item (sp, S_SLURM_VERSION, &str) == ESPANK_SUCCESS) {
         lua_pushstring (L, str);
         lua_setfield (L, -2, "slurm_version");
     }
+    lua_setfenv (L, -2);
 
+    spank_handle_ref = luaL_ref (L, LUA_REGISTRYINDEX);
     lua_newtable (L);
-    for (i = 1; i < ac; i++) {
-        lua_pushstring (L, av[i]);
-        lua_rawseti (L, -2, i);
-    }
-    lua_setfield (L, -2, "args");
+    spank_handle_fields_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+    spank_handle_ctx = S_CTX_ERROR;
+    spank_handle_av = NULL;
+    spank_handle_ac = -1;
+}
 
-    return (0);
+/*
+ *  spank.args is a read-only proxy for the table of plugin arguments,
+ *   so it can be shared by all calls in a context. Lua 5.1 ignores
+ *   __len, __pairs and __ipairs on tables, so calling the proxy also
+ *   returns an iterator over index, argument.
+ */
+static int l_spank_args_newindex (lua_State *L)
+{
+    return luaL_error (L, "spank.args is read-only");
 }
 
-static int lua_spank_call (struct lua_script *s, spank_t sp, const char *fn,
-        int ac, char **av)
+static void lua_spank_args_table (lua_State *L, int index)
 {
-    struct lua_State *L = s->L;
-    /*
-     * Missing functions are not an error
-     */
-    lua_getglobal (L, fn);
-    if (lua_isnil (L, -1)) {
-        lua_pop (L, 1);
+    lua_getmetatable (L, index);
+    lua_getfield (L, -1, "__index");
+    lua_remove (L, -2);
+}
+
+static int l_spank_args_len (lua_State *L)
+{
+    lua_spank_args_table (L, 1);
+    lua_pushinteger (L, lua_objlen (L, -1));
+    return (1);
+}
+
+static int l_spank_args_next (lua_State *L)
+{
+    int i = luaL_checknumber (L, 2) + 1;
+
+    lua_spank_args_table (L, 1);
+    lua_rawgeti (L, -1, i);
+    if (lua_isnil (L, -1))
         return (0);
-    }
+    lua_pushinteger (L, i);
+    lua_insert (L, -2);
+    return (2);
+}
 
-    /*
-     * Create spank object to pass to spank functions
-     */
-    lua_spank_table_create (L, sp, ac, av);
+static int l_spank_args_ipairs (lua_State *L)
+{
+    lua_pushcfunction (L, l_spank_args_next);
+    lua_pushvalue (L, 1);
+    lua_pushinteger (L, 0);
+    return (3);
+}
 
-    if (lua_pcall (L, 1, 1, 0)) {
-        slurm_error ("spank/lua: %s: %s", fn, lua_tostring (L, -1));
-        return (s->fail_on_error ? -1 : 0);
-    }
+static void lua_spank_args_push (lua_State *L, int ac, char **av)
+{
+    int i;
 
-    return lua_script_rc (L);
+    lua_newtable (L);
+    lua_createtable (L, 0, 7);
+
+    lua_createtable (L, ac > 1 ? ac - 1 : 0, 0);
+    for (i = 1; i < ac; i++) {
+        lua_pushstring (L, av[i]);
+        lua_rawseti (L, -2, i);
+    }
+    lua_setfield (L, -2, "__index");
+
+    lua_pushcfunction (L, l_spank_args_newindex);
+    lua_setfield (L, -2, "__newindex");
+    lua_pushcfunction (L, l_spank_args_len);
+    lua_setfield (L, -2, "__len");
+    lua_pushcfunction (L, l_spank_args_ipairs);
+    lua_setfield (L, -2, "__ipairs");
+    lua_pushcfunction (L, l_spank_args_ipairs);
+    lua_setfield (L, -2, "__pairs");
+    lua_pushcfunction (L, l_spank_args_ipairs);
+    lua_setfield (L, -2, "__call");
+    lua_pushboolean (L, 0);
+    lua_setfield (L, -2, "__metatable");
+
+    lua_setmetatable (L, -2);
 }
 
 /*
- *  Convert '%' to '%%" on the msg string on top of the stack.
+ *  Push the spank handle for [sp] onto the stack of [L], creating
+ *   it on first use. The context and args fields are only rebuilt
+ *   when the context or plugin arguments change.
  */
-static const char *l_string_sanitized (lua_State *L)
+static void lua_spank_handle_push (lua_State *L, spank_t sp, int ac, char **av)
 {
-    int err;
-    const char fn[] = "local s = ... return string.gsub(s, '%%', '%%%%')";
+    struct lua_spank_handle *h;
 
-    err = luaL_loadstring (L, fn);
-    if (err) {
-        slurm_error ("spank/lua: loadstring (%s): %s", fn, lua_tostring(L, -1));
-        return (NULL);
-    }
+    if (spank_handle_ref == LUA_NOREF)
+        lua_spank_handle_create (L, sp);
 
-    /*
-     *  Move string to top of stack:
-     */
-    lua_pushvalue (L, 2);
-    lua_remove (L, 2);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, spank_handle_ref);
+    h = lua_touserdata (L, -1);
+    h->sp = sp;
 
-    /*
-     *  Call gsub, throwing away 2nd return value (number of matches),
-     *   leaving modified string on top of stack:
-     */
-    err = lua_pcall (L, 1, 1, 0);
-    if (err) {
-        slurm_error ("spank/lua: sanitize msg: %s", lua_tostring (L, -1));
-        return (NULL);
+    lua_getfenv (L, -1);
+
+    if (spank_context () != spank_handle_ctx) {
+        l_spank_context (L);
+        lua_setfield (L, -2, "context");
+        spank_handle_ctx = spank_context ();
+        spank_handle_av = NULL;
     }
 
-    return (lua_tostring (L, -1));
+    if (av != spank_handle_av || ac != spank_handle_ac) {
+        lua_spank_args_push (L, ac, av);
+        lua_setfield (L, -2, "args");
+        spank_handle_av = av;
+        spank_handle_ac = ac;
+    }
+
+    lua_pop (L, 1);
 }
 
-static int l_spank_log_msg (lua_State *L)
+static void lua_spank_handle_release (lua_State *L)
 {
-    int level = luaL_checknumber (L, 1);
-    const char *msg;
+    struct lua_spank_handle *h;
 
-    msg = l_string_sanitized (L);
-    if (!msg)
-        return (0);
+    lua_rawgeti (L, LUA_REGISTRYINDEX, spank_handle_ref);
+    h = lua_touserdata (L, -1);
+    h->sp = NULL;
+    lua_pop (L, 1);
 
-    if (level == -1) {
-        slurm_error ("%s", msg);
-        lua_pushnumber (L, -1);
-        return (1);
+    if (h->dirty) {
+        luaL_unref (L, LUA_REGISTRYINDEX, spank_handle_fields_ref);
+        lua_newtable (L);
+        spank_handle_fields_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+        h->dirty = 0;
     }
+}
 
-    if (level == 0)
-        slurm_info ("%s", msg);
-    else if (level == 1)
-        slurm_verbose ("%s", msg);
-    else if (level == 2)
-        slurm_debug ("%s", msg);
-    return (0);
+/*
+ *  Return index of callback [name] in spank_callback_names, or -1.
+ */
+static int spank_callback_index (const char *name)
+{
+    int i;
+    for (i = 0; spank_callback_names[i] != NULL; i++)
+        if (strcmp (spank_callback_names[i], name) == 0)
+            return (i);
+    return (-1);
 }
 
-static int SPANK_table_create (lua_State *L)
+/*
+ *  Return bitmap of spank callbacks implemented by the script
+ *   loaded in [L].
+ */
+static unsigned long lua_script_callbacks (lua_State *L)
 {
-    lua_newtable (L);
-    lua_pushcfunction (L, l_spank_log_msg);
-    lua_setfield (L, -2, "_log_msg");
+    unsigned long callbacks = 0;
+    int i;
 
-    /*
-     *  Create more user-friendly lua versions of SLURM log functions
-     *   with lua.
-     */
-    luaL_loadstring (L, "SPANK._log_msg (-1, string.format(unpack({...})))");
-    lua_setfield (L, -2, "log_error");
+    for (i = 0; spank_callback_names[i] != NULL; i++) {
+        lua_getglobal (L, spank_callback_names[i]);
+        if (lua_isfunction (L, -1))
+            callbacks |= (1UL << i);
+        lua_pop (L, 1);
+    }
+    return (callbacks);
+}
 
-    luaL_loadstring (L, "SPANK._log_msg (0, string.format(unpack({...})))");
+/*****************************************************************************
+ *
+ *  Profiling:
+ *
+ ****************************************************************************/
+
+struct lua_prof_sample {
+    struct timespec wall;
+    struct timespec cpu;
+    long mem;
+};
+
+static long lua_mem_bytes (lua_State *L)
+{
+    return (lua_gc (L, LUA_GCCOUNT, 0) * 1024L + lua_gc (L, LUA_GCCOUNTB, 0));
+}
+
+static void lua_prof_sample (lua_State *L, struct lua_prof_sample *p)
+{
+    clock_gettime (CLOCK_MONOTONIC, &p->wall);
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &p->cpu);
+    p->mem = lua_mem_bytes (L);
+}
+
+static double timespec_diff (struct timespec *t1, struct timespec *t0)
+{
+    return ((t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9);
+}
+
+static void lua_prof_record (struct lua_script *s, int cb,
+        struct lua_prof_sample *start)
+{
+    struct lua_prof_sample end;
+    struct lua_script_prof *p;
+
+    if (!s->prof && !(s->prof = calloc (SPANK_NCALLBACKS, sizeof (*p))))
+        return;
+
+    lua_prof_sample (s->L, &end);
+
+    p = &s->prof[cb];
+    p->ncalls++;
+    p->wall += timespec_diff (&end.wall, &start->wall);
+    p->cpu += timespec_diff (&end.cpu, &start->cpu);
+    p->mem += end.mem - start->mem;
+}
+
+/*
+ *  Binary profile record appended to the 'profile=FILE' file, one
+ *   record per script and callback, each written with a single write(2).
+ *   Every record starts with LUA_PROF_MAGIC and the format version.
+ */
+#define LUA_PROF_MAGIC      0x6c707266 /* "lprf" */
+#define LUA_PROF_VERSION    1
+
+struct lua_prof_record {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t jobid;
+    uint32_t stepid;
+    uint32_t pid;
+    uint32_t ncalls;
+    uint64_t wall_usec;
+    uint64_t cpu_usec;
+    int64_t  mem;
+    char     script [64];
+    char     callback [40];
+};
+
+static void lua_prof_dump (List l, spank_t sp)
+{
+    struct lua_prof_record r;
+    struct lua_script *s;
+    ListIterator i;
+    int fd = -1;
+    int cb;
+
+    if (!lua_profile || l == NULL)
+        return;
+
+    memset (&r, 0, sizeof (r));
+    r.magic = LUA_PROF_MAGIC;
+    r.version = LUA_PROF_VERSION;
+    spank_get_item (sp, S_JOB_ID, &r.jobid);
+    spank_get_item (sp, S_JOB_STEPID, &r.stepid);
+    r.pid = getpid ();
+
+    if (lua_profile_file &&
+        (fd = open (lua_profile_file, O_WRONLY|O_APPEND|O_CREAT, 0644)) < 0)
+        slurm_error ("spank/lua: profile: %s: %m", lua_profile_file);
+
+    i = list_iterator_create (l);
+    while ((s = list_next (i))) {
+        if (s->prof == NULL)
+            continue;
+        for (cb = 0; cb < SPANK_NCALLBACKS; cb++) {
+            struct lua_script_prof *p = &s->prof[cb];
+            if (p->ncalls == 0)
+                continue;
+            if (fd < 0) {
+                slurm_info ("spank/lua: profile: %s: %s: calls=%lu "
+                            "wall=%.3fms cpu=%.3fms mem=%+ldB",
+                            basename (s->path), spank_callback_names[cb],
+                            p->ncalls, p->wall * 1e3, p->cpu * 1e3, p->mem);
+                continue;
+            }
+            r.ncalls = p->ncalls;
+            r.wall_usec = p->wall * 1e6;
+            r.cpu_usec = p->cpu * 1e6;
+            r.mem = p->mem;
+            strncpy (r.script, basename (s->path), sizeof (r.script) - 1);
+            strncpy (r.callback, spank_callback_names[cb],
+                     sizeof (r.callback) - 1);
+            if (write (fd, &r, sizeof (r)) != sizeof (r))
+                slurm_error ("spank/lua: profile: write: %m");
+        }
+    }
+    list_iterator_destroy (i);
+
+    if (fd >= 0)
+        close (fd);
+}
+
+/*
+ *  SPANK.profile () returns profiling data collected so far as
+ *   t[script][callback] = { calls =, wall =, cpu =, mem = }, or
+ *   nil if profiling is not enabled.
+ */
+static int l_spank_profile (lua_State *L)
+{
+    struct lua_script *s;
+    ListIterator i;
+    int cb;
+
+    if (!lua_profile || lua_script_list == NULL) {
+        lua_pushnil (L);
+        return (1);
+    }
+
+    lua_newtable (L);
+    i = list_iterator_create (lua_script_list);
+    while ((s = list_next (i))) {
+        if (s->prof == NULL)
+            continue;
+        lua_newtable (L);
+        for (cb = 0; cb < SPANK_NCALLBACKS; cb++) {
+            struct lua_script_prof *p = &s->prof[cb];
+            if (p->ncalls == 0)
+                continue;
+            lua_createtable (L, 0, 4);
+            lua_pushnumber (L, p->ncalls);
+            lua_setfield (L, -2, "calls");
+            lua_pushnumber (L, p->wall);
+            lua_setfield (L, -2, "wall");
+            lua_pushnumber (L, p->cpu);
+            lua_setfield (L, -2, "cpu");
+            lua_pushnumber (L, p->mem);
+            lua_setfield (L, -2, "mem");
+            lua_setfield (L, -2, spank_callback_names[cb]);
+        }
+        lua_setfield (L, -2, basename (s->path));
+    }
+    list_iterator_destroy (i);
+    return (1);
+}
+
+static int lua_spank_call (struct lua_script *s, spank_t sp, const char *fn,
+        int cb, int ac, char **av)
+{
+    struct lua_State *L = s->L;
+    struct lua_prof_sample start;
+    int rc;
+
+    /*
+     * Missing functions are not an error
+     */
+    if (cb >= 0 && !(s->callbacks & (1UL << cb)))
+        return (0);
+
+    lua_getglobal (L, fn);
+    if (lua_isnil (L, -1)) {
+        lua_pop (L, 1);
+        return (0);
+    }
+
+    lua_spank_handle_push (L, sp, ac, av);
+
+    if (lua_profile && cb >= 0)
+        lua_prof_sample (L, &start);
+
+    if (lua_script_pcall (s, fn, 1, 1)) {
+        slurm_error ("spank/lua: %s: %s", fn, lua_tostring (L, -1));
+        lua_pop (L, 1);
+        rc = s->fail_on_error ? -1 : 0;
+    }
+    else
+        rc = lua_script_rc (L);
+
+    if (lua_profile && cb >= 0)
+        lua_prof_record (s, cb, &start);
+
+    lua_spank_handle_release (L);
+    return (rc);
+}
+
+/*
+ *  Convert '%' to '%%" on the msg string on top of the stack.
+ */
+static const char *l_string_sanitized (lua_State *L)
+{
+    int err;
+    const char fn[] = "local s = ... return string.gsub(s, '%%', '%%%%')";
+
+    err = luaL_loadstring (L, fn);
+    if (err) {
+        slurm_error ("spank/lua: loadstring (%s): %s", fn, lua_tostring(L, -1));
+        return (NULL);
+    }
+
+    /*
+     *  Move string to top of stack:
+     */
+    lua_pushvalue (L, 2);
+    lua_remove (L, 2);
+
+    /*
+     *  Call gsub, throwing away 2nd return value (number of matches),
+     *   leaving modified string on top of stack:
+     */
+    err = lua_pcall (L, 1, 1, 0);
+    if (err) {
+        slurm_error ("spank/lua: sanitize msg: %s", lua_tostring (L, -1));
+        return (NULL);
+    }
+
+    return (lua_tostring (L, -1));
+}
+
+static int l_spank_log_msg (lua_State *L)
+{
+    int level = luaL_checknumber (L, 1);
+    const char *msg;
+
+    msg = l_string_sanitized (L);
+    if (!msg)
+        return (0);
+
+    if (level == -1) {
+        slurm_error ("%s", msg);
+        lua_pushnumber (L, -1);
+        return (1);
+    }
+
+    if (level == 0)
+        slurm_info ("%s", msg);
+    else if (level == 1)
+        slurm_verbose ("%s", msg);
+    else if (level == 2)
+        slurm_debug ("%s", msg);
+    return (0);
+}
+
+/*****************************************************************************
+ *
+ *  Asynchronous subprocesses:
+ *
+ *    p = SPANK.spawn (cmd, [{ timeout = SECONDS }])
+ *    code, stdout, stderr, termsig = p:wait ()
+ *    pid = p:pid ()
+ *    ok = SPANK.wait_all ([SECONDS])
+ *
+ *  cmd is either a string run with /bin/sh -c, or an argv array.
+ *   Processes are started with posix_spawn(3) with stdin from
+ *   /dev/null and stdout and stderr collected through pipes. All
+ *   running processes are serviced by a single poll(2) loop, which
+ *   runs from p:wait() or SPANK.wait_all(), so independent commands
+ *   run concurrently. Each process is started in its own process
+ *   group, with an empty signal mask and default signal dispositions
+ *   rather than those of slurmstepd. If it is still running at its
+ *   timeout the whole group is killed with SIGKILL, and output not yet
+ *   read is discarded, so that a descendant holding the pipes open
+ *   can't extend the wait.
+ *
+ ****************************************************************************/
+#define SPANK_PROCESS_MT "SPANK.process"
+
+struct lua_process {
+    pid_t  pid;
+    int    fd [2];          /*  stdout, stderr, or -1 once closed */
+    char  *buf [2];
+    size_t len [2];
+    size_t size [2];
+    int    status;
+    int    done;
+    int    lost;            /*  Reaped by someone else, status unknown */
+    double deadline;        /*  0 if no timeout */
+};
+
+static List lua_process_list = NULL;
+
+static double lua_process_now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void lua_process_free (struct lua_process *p)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (p->fd[i] >= 0)
+            close (p->fd[i]);
+        free (p->buf[i]);
+    }
+    free (p);
+}
+
+static int lua_process_read (struct lua_process *p, int i)
+{
+    ssize_t n;
+
+    if (p->size[i] - p->len[i] < 4096) {
+        size_t size = p->size[i] ? p->size[i] * 2 : 4096;
+        char *buf = realloc (p->buf[i], size);
+        if (buf == NULL)
+            return (-1);
+        p->buf[i] = buf;
+        p->size[i] = size;
+    }
+
+    n = read (p->fd[i], p->buf[i] + p->len[i], p->size[i] - p->len[i]);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return (0);
+    if (n <= 0) {
+        close (p->fd[i]);
+        p->fd[i] = -1;
+        return (0);
+    }
+    p->len[i] += n;
+    return (0);
+}
+
+/*
+ *  Reap [p] once its output pipes are closed. slurmstepd may reap
+ *   the child first, in which case its status is lost.
+ */
+static void lua_process_reap (struct lua_process *p)
+{
+    pid_t rc;
+
+    if (p->done || p->fd[0] >= 0 || p->fd[1] >= 0)
+        return;
+    rc = waitpid (p->pid, &p->status, WNOHANG);
+    if (rc == p->pid)
+        p->done = 1;
+    else if (rc < 0 && errno == ECHILD)
+        p->done = p->lost = 1;
+}
+
+static int lua_process_running (struct lua_process *p, void *arg)
+{
+    return (!p->done);
+}
+
+static int lua_process_eq (struct lua_process *p, struct lua_process *q)
+{
+    return (p == q);
+}
+
+/*
+ *  Service all running processes until [target] is done, or until
+ *   all processes are done if [target] is NULL. Give up at absolute
+ *   time [deadline] if nonzero. Returns 1 if the wait completed.
+ */
+static int lua_process_poll (struct lua_process *target, double deadline)
+{
+    struct pollfd *fds = NULL;
+    struct lua_process **procs = NULL;
+    struct lua_process *p;
+    ListIterator i;
+    int rc = 0;
+
+    for (;;) {
+        int n = 0;
+        int nproc = 0;
+        int reaping = 0;
+        int reaped = 0;
+        double now = lua_process_now ();
+        double next = deadline;
+        int timeout;
+        int k;
+
+        if (target ? target->done
+                   : !list_find_first (lua_process_list,
+                                       (ListFindF) lua_process_running, NULL)) {
+            rc = 1;
+            break;
+        }
+        if (deadline && now >= deadline)
+            break;
+
+        nproc = list_count (lua_process_list);
+        fds = realloc (fds, 2 * nproc * sizeof (*fds));
+        procs = realloc (procs, 2 * nproc * sizeof (*procs));
+        if (nproc && (!fds || !procs))
+            break;
+
+        i = list_iterator_create (lua_process_list);
+        while ((p = list_next (i))) {
+            if (p->done)
+                continue;
+            if (p->deadline && now >= p->deadline) {
+                kill (-p->pid, SIGKILL);
+                for (k = 0; k < 2; k++) {
+                    if (p->fd[k] >= 0)
+                        close (p->fd[k]);
+                    p->fd[k] = -1;
+                }
+                p->deadline = 0;
+            }
+            if (p->deadline && (!next || p->deadline < next))
+                next = p->deadline;
+            for (k = 0; k < 2; k++) {
+                if (p->fd[k] < 0)
+                    continue;
+                fds[n].fd = p->fd[k];
+                fds[n].events = POLLIN;
+                procs[n++] = p;
+            }
+            lua_process_reap (p);
+            if (p->done)
+                reaped = 1;
+            else if (p->fd[0] < 0 && p->fd[1] < 0)
+                reaping = 1;
+        }
+        list_iterator_destroy (i);
+
+        if (reaped)
+            continue;
+
+        timeout = next ? (int) ((next - now) * 1000) + 1 : -1;
+        if (reaping && (timeout < 0 || timeout > 10))
+            timeout = 10;
+
+        if (poll (fds, n, timeout) < 0 && errno != EINTR)
+            break;
+
+        for (k = 0; k < n; k++) {
+            if (fds[k].revents == 0)
+                continue;
+            p = procs[k];
+            lua_process_read (p, fds[k].fd == p->fd[0] ? 0 : 1);
+            lua_process_reap (p);
+        }
+    }
+    free (fds);
+    free (procs);
+    return (rc);
+}
+
+static int pipe_cloexec (int fds[2])
+{
+    if (pipe (fds) < 0)
+        return (-1);
+    fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+    return (0);
+}
+
+static struct lua_process * lua_process_spawn (char **argv, double timeout)
+{
+    struct lua_process *p;
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask, dfl;
+    int out[2] = { -1, -1 };
+    int err[2] = { -1, -1 };
+    int rc;
+    int i;
+
+    if (!(p = calloc (1, sizeof (*p))))
+        return (NULL);
+
+    if (pipe_cloexec (out) < 0 || pipe_cloexec (err) < 0) {
+        rc = errno;
+        goto fail;
+    }
+
+    posix_spawn_file_actions_init (&fa);
+    posix_spawn_file_actions_addopen (&fa, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2 (&fa, out[1], 1);
+    posix_spawn_file_actions_adddup2 (&fa, err[1], 2);
+    sigemptyset (&mask);
+    sigfillset (&dfl);
+    sigdelset (&dfl, SIGKILL);
+    sigdelset (&dfl, SIGSTOP);
+    posix_spawnattr_init (&attr);
+    posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETPGROUP
+                                     | POSIX_SPAWN_SETSIGMASK
+                                     | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup (&attr, 0);
+    posix_spawnattr_setsigmask (&attr, &mask);
+    posix_spawnattr_setsigdefault (&attr, &dfl);
+    rc = posix_spawnp (&p->pid, argv[0], &fa, &attr, argv, environ);
+    posix_spawnattr_destroy (&attr);
+    posix_spawn_file_actions_destroy (&fa);
+
+    if (rc != 0)
+        goto fail;
+
+    close (out[1]);
+    close (err[1]);
+
+    p->fd[0] = out[0];
+    p->fd[1] = err[0];
+    fcntl (p->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl (p->fd[1], F_SETFL, O_NONBLOCK);
+    if (timeout > 0)
+        p->deadline = lua_process_now () + timeout;
+
+    if (!lua_process_list)
+        lua_process_list = list_create (NULL);
+    list_append (lua_process_list, p);
+    return (p);
+
+fail:
+    for (i = 0; i < 2; i++) {
+        if (out[i] >= 0)
+            close (out[i]);
+        if (err[i] >= 0)
+            close (err[i]);
+    }
+    free (p);
+    errno = rc;
+    return (NULL);
+}
+
+static struct lua_process * lua_toprocess (lua_State *L, int index)
+{
+    struct lua_process **pp = luaL_checkudata (L, index, SPANK_PROCESS_MT);
+    return (*pp);
+}
+
+static int l_process_wait (lua_State *L)
+{
+    struct lua_process *p = lua_toprocess (L, 1);
+
+    if (!lua_process_poll (p, 0))
+        return l_spank_error_msg (L, "wait failed");
+    if (p->lost)
+        return l_spank_error_msg (L, "exit status unknown: "
+                                     "process was reaped elsewhere");
+
+    if (WIFEXITED (p->status))
+        lua_pushnumber (L, WEXITSTATUS (p->status));
+    else
+        lua_pushnil (L);
+    lua_pushlstring (L, p->buf[0] ? p->buf[0] : "", p->len[0]);
+    lua_pushlstring (L, p->buf[1] ? p->buf[1] : "", p->len[1]);
+    if (WIFSIGNALED (p->status))
+        lua_pushnumber (L, WTERMSIG (p->status));
+    else
+        lua_pushnil (L);
+    return (4);
+}
+
+static int l_process_pid (lua_State *L)
+{
+    lua_pushnumber (L, lua_toprocess (L, 1)->pid);
+    return (1);
+}
+
+/*
+ *  Garbage collected process handles are killed, along with their
+ *   process group, if still running.
+ */
+static int l_process_gc (lua_State *L)
+{
+    struct lua_process *p = lua_toprocess (L, 1);
+
+    if (!p->done) {
+        kill (-p->pid, SIGKILL);
+        waitpid (p->pid, NULL, 0);
+    }
+    list_delete_all (lua_process_list, (ListFindF) lua_process_eq, p);
+    lua_process_free (p);
+    return (0);
+}
+
+static int l_spank_spawn (lua_State *L)
+{
+    struct lua_process **pp;
+    double timeout = 0;
+    char *shargv[] = { "/bin/sh", "-c", NULL, NULL };
+    char **argv = shargv;
+    int i, n;
+
+    if (lua_istable (L, 2)) {
+        lua_getfield (L, 2, "timeout");
+        timeout = lua_tonumber (L, -1);
+        lua_pop (L, 1);
+    }
+
+    if (lua_istable (L, 1)) {
+        n = lua_objlen (L, 1);
+        if (n == 0)
+            return luaL_error (L, "SPANK.spawn: empty argv");
+        argv = lua_newuserdata (L, (n + 1) * sizeof (char *));
+        for (i = 0; i < n; i++) {
+            lua_rawgeti (L, 1, i + 1);
+            argv[i] = (char *) luaL_checkstring (L, -1);
+            lua_pop (L, 1); /* string still referenced by table */
+        }
+        argv[n] = NULL;
+    }
+    else
+        shargv[2] = (char *) luaL_checkstring (L, 1);
+
+    pp = lua_newuserdata (L, sizeof (*pp));
+    if (!(*pp = lua_process_spawn (argv, timeout)))
+        return l_spank_error_msg (L, strerror (errno));
+
+    if (luaL_newmetatable (L, SPANK_PROCESS_MT)) {
+        lua_newtable (L);
+        lua_pushcfunction (L, l_process_wait);
+        lua_setfield (L, -2, "wait");
+        lua_pushcfunction (L, l_process_pid);
+        lua_setfield (L, -2, "pid");
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, l_process_gc);
+        lua_setfield (L, -2, "__gc");
+    }
+    lua_setmetatable (L, -2);
+    return (1);
+}
+
+static int l_spank_wait_all (lua_State *L)
+{
+    double timeout = luaL_optnumber (L, 1, 0);
+    double deadline = timeout > 0 ? lua_process_now () + timeout : 0;
+
+    if (lua_process_list == NULL) {
+        lua_pushboolean (L, 1);
+        return (1);
+    }
+    lua_pushboolean (L, lua_process_poll (NULL, deadline));
+    return (1);
+}
+
+/*
+ *  Node-local key/value store shared between all tasks and steps:
+ *
+ *    v = SPANK.cache:get (key)
+ *    SPANK.cache:set (key, value, [ttl])
+ *    jc = SPANK.cache:job ()
+ *
+ *  SPANK.cache is scoped to the node and is writable only by root,
+ *   readable by all. SPANK.cache:job() returns a store scoped to the
+ *   current job, owned by the job user and removed in job epilog.
+ *   Values may be strings, numbers or booleans; setting nil deletes
+ *   a key. An optional ttl in seconds expires the value.
+ *
+ *  Each store is a fixed size file in the 'kvdir' directory, mapped
+ *   with mmap(2) and used as an open addressed hash table of fixed
+ *   size slots. Access is serialized with flock(2), so a crashed
+ *   process can never leave the store locked. Since the job user may
+ *   hold the lock on a job store indefinitely, a lock is waited for
+ *   at most LUA_KVS_LOCK_MS before the access fails. Files are
+ *   opened lazily on first use.
+ *
+ *  A store owned by another user (e.g. a job store opened by root)
+ *   is never mapped, since the owner could truncate it under the
+ *   mapping. Instead it is read into a private copy under the lock
+ *   for each access, and changed slots are written back. Slots are
+ *   validated before use in either case.
+ */
+#define SPANK_KVS_MT        "SPANK.kvs"
+#define LUA_KVS_DIR         "/var/run/spank-lua"
+#define LUA_KVS_MAGIC       0x6b767331 /* "kvs1" */
+#define LUA_KVS_NSLOTS      256
+#define LUA_KVS_SLOTSIZE    4096
+#define LUA_KVS_KEYMAX      128
+#define LUA_KVS_DELETED     0xff
+#define LUA_KVS_LOCK_MS     1000
+
+struct lua_kvs_header {
+    uint32_t magic;
+    uint32_t nslots;
+    uint32_t slotsize;
+};
+
+struct lua_kvs_slot {
+    char     key [LUA_KVS_KEYMAX];
+    int64_t  expires;   /* 0 if value never expires */
+    uint32_t type;      /* LUA_TNIL (free), LUA_T*, or LUA_KVS_DELETED */
+    uint32_t len;
+    char     value [LUA_KVS_SLOTSIZE - LUA_KVS_KEYMAX - 16];
+};
+
+/*
+ *  The header occupies the first slot of the file.
+ */
+#define LUA_KVS_SIZE (LUA_KVS_SLOTSIZE * (LUA_KVS_NSLOTS + 1))
+
+struct lua_kvs {
+    char    path [1024];
+    uid_t   owner;      /* Expected owner of the file (or root) */
+    int     fd;
+    int     rdonly;
+    int     copy;       /* map is a private copy, not mmap(2)ed */
+    void   *map;
+};
+
+static const char *lua_kvs_dir = LUA_KVS_DIR;
+
+static uint32_t lua_kvs_hash (const char *key)
+{
+    uint32_t h = 2166136261u;
+    while (*key)
+        h = (h ^ (unsigned char) *key++) * 16777619u;
+    return (h);
+}
+
+static struct lua_kvs_slot * lua_kvs_slot (struct lua_kvs *kvs, int i)
+{
+    return ((struct lua_kvs_slot *) ((char *) kvs->map +
+                                     LUA_KVS_SLOTSIZE * (i + 1)));
+}
+
+static int lua_kvs_expired (struct lua_kvs_slot *slot, time_t now)
+{
+    return (slot->expires && slot->expires <= now);
+}
+
+/*
+ *  Slot contents may have been written by another user, so check
+ *   type and length before using them.
+ */
+static int lua_kvs_slot_valid (struct lua_kvs_slot *slot)
+{
+    switch (slot->type) {
+        case LUA_TNIL:
+        case LUA_KVS_DELETED:
+            return (1);
+        case LUA_TBOOLEAN:
+            return (slot->len == 1);
+        case LUA_TNUMBER:
+            return (slot->len == sizeof (lua_Number));
+        case LUA_TSTRING:
+            return (slot->len <= sizeof (slot->value));
+    }
+    return (0);
+}
+
+/*
+ *  Lock [fd] with flock [op], giving up with EWOULDBLOCK after
+ *   LUA_KVS_LOCK_MS.
+ */
+static int lua_kvs_lock (int fd, int op)
+{
+    struct timespec ts = { 0, 10 * 1000000 };
+    int ms;
+
+    for (ms = 0; flock (fd, op | LOCK_NB) < 0; ms += 10) {
+        if (errno != EWOULDBLOCK && errno != EINTR)
+            return (-1);
+        if (ms >= LUA_KVS_LOCK_MS) {
+            errno = EWOULDBLOCK;
+            return (-1);
+        }
+        nanosleep (&ts, NULL);
+    }
+    return (0);
+}
+
+/*
+ *  Refresh the private copy of a store owned by another user.
+ *   Must be called with the store locked.
+ */
+static int lua_kvs_read (struct lua_kvs *kvs)
+{
+    ssize_t n;
+
+    if (!kvs->copy)
+        return (0);
+    n = pread (kvs->fd, kvs->map, LUA_KVS_SIZE, 0);
+    if (n != LUA_KVS_SIZE) {
+        errno = n < 0 ? errno : EINVAL;
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ *  Write back [slot] of a private copy. Must be called with the
+ *   store locked.
+ */
+static int lua_kvs_write (struct lua_kvs *kvs, struct lua_kvs_slot *slot)
+{
+    off_t off = (char *) slot - (char *) kvs->map;
+
+    if (!kvs->copy)
+        return (0);
+    if (pwrite (kvs->fd, slot, LUA_KVS_SLOTSIZE, off) != LUA_KVS_SLOTSIZE)
+        return (-1);
+    return (0);
+}
+
+/*
+ *  Open and map the store file for [kvs] if not already done.
+ *   Returns -1 with errno set on failure.
+ */
+static int lua_kvs_open (struct lua_kvs *kvs)
+{
+    struct lua_kvs_header *h;
+    struct stat st;
+    uid_t uid;
+    int fd;
+    int rdonly = 0;
+    int saved_errno;
+
+    if (kvs->map)
+        return (0);
+
+    if (geteuid () == 0)
+        mkdir (lua_kvs_dir, 0755);
+
+    fd = open (kvs->path, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC,
+               kvs->owner ? 0600 : 0644);
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        fd = open (kvs->path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        rdonly = 1;
+    }
+    if (fd < 0)
+        return (-1);
+
+    if (lua_kvs_lock (fd, rdonly ? LOCK_SH : LOCK_EX) < 0
+        || fstat (fd, &st) < 0)
+        goto fail;
+
+    /*
+     *  Refuse a store file created by anyone but root or the
+     *   expected owner.
+     */
+    if (st.st_uid != 0 && st.st_uid != kvs->owner) {
+        errno = EPERM;
+        goto fail;
+    }
+    uid = st.st_uid;
+
+    if (st.st_size == 0 && !rdonly) {
+        struct lua_kvs_header hdr = { LUA_KVS_MAGIC, LUA_KVS_NSLOTS,
+                                      LUA_KVS_SLOTSIZE };
+        if (ftruncate (fd, LUA_KVS_SIZE) < 0
+            || pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+            goto fail;
+        if (kvs->owner && fchown (fd, kvs->owner, (gid_t) -1) < 0)
+            goto fail;
+        uid = kvs->owner;
+    }
+    else if (st.st_size != LUA_KVS_SIZE) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    kvs->fd = fd;
+    kvs->copy = (uid != 0 && uid != geteuid ());
+    if (kvs->copy) {
+        if (!(kvs->map = malloc (LUA_KVS_SIZE)))
+            goto fail;
+        if (lua_kvs_read (kvs) < 0)
+            goto fail;
+    }
+    else {
+        kvs->map = mmap (NULL, LUA_KVS_SIZE,
+                         rdonly ? PROT_READ : PROT_READ|PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (kvs->map == MAP_FAILED) {
+            kvs->map = NULL;
+            goto fail;
+        }
+    }
+
+    h = kvs->map;
+    if (h->magic != LUA_KVS_MAGIC
+        || h->nslots != LUA_KVS_NSLOTS
+        || h->slotsize != LUA_KVS_SLOTSIZE) {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    flock (fd, LOCK_UN);
+    kvs->rdonly = rdonly;
+    return (0);
+
+fail:
+    saved_errno = errno;
+    if (kvs->map && kvs->copy)
+        free (kvs->map);
+    else if (kvs->map)
+        munmap (kvs->map, LUA_KVS_SIZE);
+    kvs->map = NULL;
+    kvs->fd = -1;
+    close (fd);
+    errno = saved_errno;
+    return (-1);
+}
+
+static void lua_kvs_close (struct lua_kvs *kvs)
+{
+    if (kvs->map && kvs->copy)
+        free (kvs->map);
+    else if (kvs->map)
+        munmap (kvs->map, LUA_KVS_SIZE);
+    if (kvs->fd >= 0)
+        close (kvs->fd);
+    kvs->map = NULL;
+    kvs->fd = -1;
+}
+
+/*
+ *  Find the slot for [key]. If [insert] is nonzero return the slot
+ *   where [key] should be stored if it is not present. Returns NULL
+ *   if not found or the table is full. Must be called with the
+ *   store locked.
+ */
+static struct lua_kvs_slot *
+lua_kvs_lookup (struct lua_kvs *kvs, const char *key, int insert)
+{
+    struct lua_kvs_slot *avail = NULL;
+    uint32_t h = lua_kvs_hash (key);
+    time_t now = time (NULL);
+    int i;
+
+    for (i = 0; i < LUA_KVS_NSLOTS; i++) {
+        struct lua_kvs_slot *slot;
+        slot = lua_kvs_slot (kvs, (h + i) % LUA_KVS_NSLOTS);
+
+        if (!lua_kvs_slot_valid (slot))
+            continue;
+
+        if (slot->type == LUA_TNIL)
+            return (insert ? (avail ? avail : slot) : NULL);
+
+        if (slot->type != LUA_KVS_DELETED
+            && strncmp (slot->key, key, LUA_KVS_KEYMAX) == 0) {
+            if (lua_kvs_expired (slot, now) && !insert)
+                return (NULL);
+            return (slot);
+        }
+
+        /*
+         *  Deleted and expired slots may be reused, but keep
+         *   probing in case [key] is further along the chain.
+         */
+        if (!avail && (slot->type == LUA_KVS_DELETED
+                       || lua_kvs_expired (slot, now)))
+            avail = slot;
+    }
+    return (insert ? avail : NULL);
+}
+
+/*
+ *  Return the opened store at [index], or NULL with errno set if it
+ *   doesn't exist yet (ENOENT) or is locked (EWOULDBLOCK).
+ */
+static struct lua_kvs * lua_tokvs (lua_State *L, int index)
+{
+    struct lua_kvs *kvs = luaL_checkudata (L, index, SPANK_KVS_MT);
+    if (lua_kvs_open (kvs) < 0) {
+        if (errno == ENOENT || errno == EWOULDBLOCK)
+            return (NULL);
+        luaL_error (L, "SPANK.cache: %s: %s", kvs->path, strerror (errno));
+    }
+    return (kvs);
+}
+
+static int l_kvs_errno (lua_State *L, int index)
+{
+    struct lua_kvs *kvs = lua_touserdata (L, index);
+    lua_pushnil (L);
+    lua_pushfstring (L, "SPANK.cache: %s: %s", kvs->path, strerror (errno));
+    return (2);
+}
+
+static const char * l_kvs_checkkey (lua_State *L, int index)
+{
+    size_t len;
+    const char *key = luaL_checklstring (L, index, &len);
+    if (len == 0 || len >= LUA_KVS_KEYMAX)
+        luaL_error (L, "SPANK.cache: invalid key length %d", (int) len);
+    return (key);
+}
+
+static int l_kvs_get (lua_State *L)
+{
+    const char *key = l_kvs_checkkey (L, 2);
+    struct lua_kvs *kvs = lua_tokvs (L, 1);
+    struct lua_kvs_slot *slot;
+
+    /*
+     *  A store that doesn't exist yet holds no values.
+     */
+    if (!kvs && errno == ENOENT) {
+        lua_pushnil (L);
+        return (1);
+    }
+    if (!kvs || lua_kvs_lock (kvs->fd, LOCK_SH) < 0)
+        return l_kvs_errno (L, 1);
+    if (lua_kvs_read (kvs) < 0) {
+        flock (kvs->fd, LOCK_UN);
+        return luaL_error (L, "SPANK.cache: %s: %s", kvs->path,
+                           strerror (errno));
+    }
+    if (!(slot = lua_kvs_lookup (kvs, key, 0)))
+        lua_pushnil (L);
+    else if (slot->type == LUA_TBOOLEAN)
+        lua_pushboolean (L, slot->value[0]);
+    else if (slot->type == LUA_TNUMBER) {
+        lua_Number n;
+        memcpy (&n, slot->value, sizeof (n));
+        lua_pushnumber (L, n);
+    }
+    else
+        lua_pushlstring (L, slot->value, slot->len);
+    flock (kvs->fd, LOCK_UN);
+    return (1);
+}
+
+static int l_kvs_set (lua_State *L)
+{
+    struct lua_kvs *kvs;
+    const char *key = l_kvs_checkkey (L, 2);
+    int type = lua_type (L, 3);
+    double ttl = luaL_optnumber (L, 4, 0);
+    struct lua_kvs_slot *slot;
+    const char *val = NULL;
+    size_t len = 0;
+
+    if (type == LUA_TSTRING) {
+        val = lua_tolstring (L, 3, &len);
+        if (len > sizeof (slot->value))
+            return luaL_error (L, "SPANK.cache: value for %s too large", key);
+    }
+    else if (type != LUA_TNUMBER && type != LUA_TBOOLEAN && type != LUA_TNIL)
+        return luaL_error (L, "SPANK.cache: cannot store a %s",
+                           lua_typename (L, type));
+
+    if (!(kvs = lua_tokvs (L, 1)))
+        return l_kvs_errno (L, 1);
+    if (kvs->rdonly)
+        return l_spank_error_msg (L, "SPANK.cache is read-only");
+
+    if (lua_kvs_lock (kvs->fd, LOCK_EX) < 0)
+        return l_kvs_errno (L, 1);
+    if (lua_kvs_read (kvs) < 0) {
+        flock (kvs->fd, LOCK_UN);
+        return luaL_error (L, "SPANK.cache: %s: %s", kvs->path,
+                           strerror (errno));
+    }
+    if (!(slot = lua_kvs_lookup (kvs, key, type != LUA_TNIL))) {
+        flock (kvs->fd, LOCK_UN);
+        if (type == LUA_TNIL) {
+            lua_pushboolean (L, 1);
+            return (1);
+        }
+        return l_spank_error_msg (L, "SPANK.cache is full");
+    }
+
+    if (type == LUA_TNIL) {
+        slot->type = LUA_KVS_DELETED;
+        lua_kvs_write (kvs, slot);
+        flock (kvs->fd, LOCK_UN);
+        lua_pushboolean (L, 1);
+        return (1);
+    }
+
+    strncpy (slot->key, key, LUA_KVS_KEYMAX);
+    slot->expires = ttl > 0 ? (int64_t) (time (NULL) + ttl) : 0;
+    if (type == LUA_TSTRING) {
+        memcpy (slot->value, val, len);
+        slot->len = len;
+    }
+    else if (type == LUA_TNUMBER) {
+        lua_Number n = lua_tonumber (L, 3);
+        memcpy (slot->value, &n, sizeof (n));
+        slot->len = sizeof (n);
+    }
+    else {
+        slot->value[0] = lua_toboolean (L, 3);
+        slot->len = 1;
+    }
+    slot->type = type;
+    if (lua_kvs_write (kvs, slot) < 0) {
+        flock (kvs->fd, LOCK_UN);
+        return l_spank_error_msg (L, "SPANK.cache: write failed");
+    }
+    flock (kvs->fd, LOCK_UN);
+
+    lua_pushboolean (L, 1);
+    return (1);
+}
+
+static int l_kvs_gc (lua_State *L)
+{
+    lua_kvs_close (luaL_checkudata (L, 1, SPANK_KVS_MT));
+    return (0);
+}
+
+static int lua_kvs_job_path (char *buf, size_t len, uint32_t jobid)
+{
+    int n = snprintf (buf, len, "%s/job%u.kv", lua_kvs_dir, jobid);
+    return ((n < 0 || n >= len) ? -1 : 0);
+}
+
+static int l_kvs_job (lua_State *L);
+
+static void lua_kvs_push (lua_State *L, const char *path, uid_t owner)
+{
+    struct lua_kvs *kvs = lua_newuserdata (L, sizeof (*kvs));
+
+    memset (kvs, 0, sizeof (*kvs));
+    kvs->fd = -1;
+    kvs->owner = owner;
+    strncpy (kvs->path, path, sizeof (kvs->path) - 1);
+
+    if (luaL_newmetatable (L, SPANK_KVS_MT)) {
+        lua_pushvalue (L, -1);
+        lua_setfield (L, -2, "__index");
+        lua_pushcfunction (L, l_kvs_get);
+        lua_setfield (L, -2, "get");
+        lua_pushcfunction (L, l_kvs_set);
+        lua_setfield (L, -2, "set");
+        lua_pushcfunction (L, l_kvs_job);
+        lua_setfield (L, -2, "job");
+        lua_pushcfunction (L, l_kvs_gc);
+        lua_setfield (L, -2, "__gc");
+    }
+    lua_setmetatable (L, -2);
+}
+
+/*
+ *  SPANK.cache:job () returns the store for the job of the current
+ *   spank callback.
+ */
+static int l_kvs_job (lua_State *L)
+{
+    struct lua_spank_handle *h = NULL;
+    uint32_t jobid;
+    uid_t uid;
+    char path [1024];
+
+    if (spank_handle_ref != LUA_NOREF) {
+        lua_rawgeti (L, LUA_REGISTRYINDEX, spank_handle_ref);
+        h = lua_touserdata (L, -1);
+        lua_pop (L, 1);
+    }
+    if (!h || !h->sp)
+        return luaL_error (L, "SPANK.cache:job() called outside a callback");
+
+    if (spank_get_item (h->sp, S_JOB_ID, &jobid) != ESPANK_SUCCESS
+        || spank_get_item (h->sp, S_JOB_UID, &uid) != ESPANK_SUCCESS)
+        return l_spank_error_msg (L, "SPANK.cache: job id not available");
+
+    if (lua_kvs_job_path (path, sizeof (path), jobid) < 0)
+        return l_spank_error_msg (L, "SPANK.cache: path too long");
+
+    lua_kvs_push (L, path, uid);
+    return (1);
+}
+
+/*
+ *  Remove the job scoped store for the job in [sp], if any.
+ */
+static void lua_kvs_job_remove (spank_t sp)
+{
+    uint32_t jobid;
+    char path [1024];
+
+    if (spank_get_item (sp, S_JOB_ID, &jobid) == ESPANK_SUCCESS
+        && lua_kvs_job_path (path, sizeof (path), jobid) == 0)
+        unlink (path);
+}
+
+static int SPANK_table_create (lua_State *L)
+{
+    lua_newtable (L);
+    lua_pushcfunction (L, l_spank_log_msg);
+    lua_setfield (L, -2, "_log_msg");
+
+    /*
+     *  Create more user-friendly lua versions of SLURM log functions
+     *   with lua.
+     */
+    luaL_loadstring (L, "SPANK._log_msg (-1, string.format(unpack({...})))");
+    lua_setfield (L, -2, "log_error");
+
+    luaL_loadstring (L, "SPANK._log_msg (0, string.format(unpack({...})))");
     lua_setfield (L, -2, "log_info");
 
     luaL_loadstring (L, "SPANK._log_msg (1, string.format(unpack({...})))");
@@ -965,6 +2568,20 @@ static int SPANK_table_create (lua_State *L)
     lua_pushnumber (L, 0);
     lua_setfield (L, -2, "SUCCESS");
 
+    lua_pushcfunction (L, l_spank_profile);
+    lua_setfield (L, -2, "profile");
+
+    lua_pushcfunction (L, l_spank_spawn);
+    lua_setfield (L, -2, "spawn");
+
+    lua_pushcfunction (L, l_spank_wait_all);
+    lua_setfield (L, -2, "wait_all");
+
+    lua_pushfstring (L, "%s/node.kv", lua_kvs_dir);
+    lua_kvs_push (L, lua_tostring (L, -1), 0);
+    lua_setfield (L, -3, "cache");
+    lua_pop (L, 1);
+
     lua_setglobal (L, "SPANK");
     return (0);
 }
@@ -1020,6 +2637,8 @@ static struct lua_script * lua_script_create (lua_State *L, const char *path)
     script->L = lua_newthread (L);
     script->ref = luaL_ref (L, LUA_REGISTRYINDEX);
     script->fail_on_error = 0;
+    script->callbacks = 0;
+    script->prof = NULL;
 
     /*
      *  Now we need to redefine the globals table for this script/thread.
@@ -1062,6 +2681,7 @@ static struct lua_script * lua_script_create (lua_State *L, const char *path)
 static void lua_script_destroy (struct lua_script *s)
 {
     free (s->path);
+    free (s->prof);
     luaL_unref (global_L, LUA_REGISTRYINDEX, s->ref);
     /* Only call lua_close() on the main lua state  */
     free (s);
@@ -1145,20 +2765,61 @@ static int spank_lua_options_table_register (List script_list, spank_t sp)
 
 struct spank_lua_options {
     unsigned fail_on_error:1;
+    unsigned resident:1;
+    unsigned profile:1;
+    const char *cachedir;
+    const char *profile_file;
+    const char *kvdir;
+    size_t maxmem;
+    unsigned long maxinstr;
 };
 
+/*
+ *  Convert string with optional K, M, or G suffix to bytes.
+ */
+static size_t str2bytes (const char *s)
+{
+    char *p;
+    unsigned long long n = strtoull (s, &p, 10);
+
+    switch (*p) {
+        case 'G': case 'g': n *= 1024;  /* fall through */
+        case 'M': case 'm': n *= 1024;  /* fall through */
+        case 'K': case 'k': n *= 1024;
+    }
+    return ((size_t) n);
+}
+
 static int spank_lua_process_args (int *ac, char **argvp[],
         struct spank_lua_options *opt)
 {
+    memset (opt, 0, sizeof (*opt));
+
     /*
      *  Advance argv past any spank/lua options. The rest of the
      *   args are the script/glob and script arguments.
-     *
-     *  For now, the only supported spank/lua arg is 'failonerror'
-     *   so this must appear in argv[0]
      */
-    if (strcmp ((*argvp)[0], "failonerror") == 0) {
-        opt->fail_on_error = 1;
+    while (*ac > 0) {
+        if (strcmp ((*argvp)[0], "failonerror") == 0)
+            opt->fail_on_error = 1;
+        else if (strcmp ((*argvp)[0], "resident") == 0)
+            opt->resident = 1;
+        else if (strncmp ((*argvp)[0], "cachedir=", 9) == 0)
+            opt->cachedir = (*argvp)[0] + 9;
+        else if (strncmp ((*argvp)[0], "kvdir=", 6) == 0)
+            opt->kvdir = (*argvp)[0] + 6;
+        else if (strncmp ((*argvp)[0], "maxmem=", 7) == 0)
+            opt->maxmem = str2bytes ((*argvp)[0] + 7);
+        else if (strncmp ((*argvp)[0], "maxinstr=", 9) == 0)
+            opt->maxinstr = strtoul ((*argvp)[0] + 9, NULL, 10);
+        else if (strcmp ((*argvp)[0], "profile") == 0)
+            opt->profile = 1;
+        else if (strncmp ((*argvp)[0], "profile=", 8) == 0) {
+            opt->profile = 1;
+            opt->profile_file = (*argvp)[0] + 8;
+        }
+        else
+            break;
         (*ac)--;
         (*argvp)++;
     }
@@ -1175,26 +2836,211 @@ static void print_lua_script_error (struct lua_script *script)
         slurm_info ("spank/lua: Disabling %s: %s", s, err);
 }
 
+/*****************************************************************************
+ *
+ *  Bytecode cache:
+ *
+ *  If the 'cachedir=DIR' option is used, compiled scripts are
+ *   stored in DIR as lua_dump(3) output, prefixed by a header
+ *   identifying the Lua release and the device, inode, size,
+ *   nanosecond mtime and path of the source file. Cached bytecode is used only if DIR and the cache
+ *   file are owned by root and not writable by others, and if the
+ *   header matches the current source. Otherwise we silently fall
+ *   back to luaL_loadfile(). The cache is only updated by root.
+ *
+ ****************************************************************************/
+
+struct lua_cache_header {
+    char     release [16];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t mtime_nsec;
+    uint64_t pathlen;
+};
+
+static int lua_cache_header_init (struct lua_cache_header *h,
+        const char *path)
+{
+    struct stat st;
+
+    if (stat (path, &st) < 0)
+        return (-1);
+
+    memset (h, 0, sizeof (*h));
+    strncpy (h->release, LUA_RELEASE, sizeof (h->release) - 1);
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+    h->size = st.st_size;
+    h->mtime = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    h->pathlen = strlen (path);
+    return (0);
+}
+
+static int lua_cache_path (const char *cachedir, const char *path,
+        char *buf, int len)
+{
+    char *p;
+    int n = snprintf (buf, len, "%s/", cachedir);
+
+    if ((n < 0) || (n + strlen (path) + 4 >= len))
+        return (-1);
+
+    /*  Flatten script path into a single file name */
+    for (p = buf + n; *path != '\0'; path++)
+        *p++ = (*path == '/') ? '%' : *path;
+    strcpy (p, ".luac");
+    return (0);
+}
+
+static int lua_cache_secure (struct stat *st)
+{
+    return (st->st_uid == 0 && !(st->st_mode & (S_IWGRP|S_IWOTH)));
+}
+
+static int lua_cache_load (lua_State *L, const char *cachedir,
+        const char *path)
+{
+    struct lua_cache_header h, ch;
+    struct stat st;
+    char cpath [4096];
+    char chunkname [4096];
+    char *buf = NULL;
+    size_t off = sizeof (h) + strlen (path);
+    int fd;
+    int rc = -1;
+
+    if (stat (cachedir, &st) < 0 || !lua_cache_secure (&st))
+        return (-1);
+
+    if (lua_cache_header_init (&h, path) < 0
+        || lua_cache_path (cachedir, path, cpath, sizeof (cpath)) < 0)
+        return (-1);
+
+    if ((fd = open (cpath, O_RDONLY)) < 0)
+        return (-1);
+
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode)
+        || !lua_cache_secure (&st) || st.st_size <= off)
+        goto out;
+
+    if (!(buf = malloc (st.st_size))
+        || read (fd, buf, st.st_size) != st.st_size)
+        goto out;
+
+    memcpy (&ch, buf, sizeof (ch));
+    if (memcmp (&ch, &h, sizeof (h)) != 0
+        || memcmp (buf + sizeof (h), path, h.pathlen) != 0)
+        goto out;
+
+    snprintf (chunkname, sizeof (chunkname), "@%s", path);
+    if (luaL_loadbuffer (L, buf + off, st.st_size - off, chunkname) != 0) {
+        lua_pop (L, 1);
+        goto out;
+    }
+    rc = 0;
+out:
+    free (buf);
+    close (fd);
+    return (rc);
+}
+
+static int lua_cache_writer (lua_State *L, const void *p, size_t sz, void *ud)
+{
+    return (fwrite (p, sz, 1, (FILE *) ud) == 1 ? 0 : -1);
+}
+
+/*
+ *  Dump function on top of the stack of [L] to the cache file for
+ *   [path], with header [h] taken before the source was loaded.
+ *   Written to a temporary file and renamed into place so readers
+ *   never see a partial file.
+ */
+static void lua_cache_store (lua_State *L, const char *cachedir,
+        const char *path, struct lua_cache_header *h)
+{
+    char cpath [4096];
+    char tmp [4096];
+    FILE *fp;
+    int fd;
+    int rc;
+
+    if (geteuid () != 0
+        || lua_cache_path (cachedir, path, cpath, sizeof (cpath)) < 0)
+        return;
+
+    snprintf (tmp, sizeof (tmp), "%s.XXXXXX", cpath);
+    if ((fd = mkstemp (tmp)) < 0 || !(fp = fdopen (fd, "w"))) {
+        if (fd >= 0) {
+            close (fd);
+            unlink (tmp);
+        }
+        slurm_debug ("spank/lua: cache: %s: %m", tmp);
+        return;
+    }
+
+    rc = (fwrite (h, sizeof (*h), 1, fp) == 1
+          && fwrite (path, h->pathlen, 1, fp) == 1
+          && lua_dump (L, lua_cache_writer, fp) == 0);
+
+    if (fclose (fp) != 0 || !rc || chmod (tmp, 0644) < 0
+        || rename (tmp, cpath) < 0) {
+        slurm_debug ("spank/lua: cache: failed to write %s", cpath);
+        unlink (tmp);
+    }
+}
+
+/*
+ *  Load script [path] into [L], leaving the compiled chunk on top of
+ *   the stack, using the bytecode cache in [cachedir] if not NULL.
+ */
+static int lua_script_load (lua_State *L, const char *path,
+        const char *cachedir)
+{
+    struct lua_cache_header h;
+    int stamped;
+
+    if (cachedir == NULL)
+        return (luaL_loadfile (L, path));
+
+    if (lua_cache_load (L, cachedir, path) == 0) {
+        slurm_debug ("spank/lua: %s: loaded from cache", path);
+        return (0);
+    }
+
+    /*  Stamp the source before reading it, so that a concurrent
+     *   change leaves a stale header rather than stale bytecode.
+     */
+    stamped = (lua_cache_header_init (&h, path) == 0);
+
+    if (luaL_loadfile (L, path) != 0)
+        return (-1);
+
+    if (stamped)
+        lua_cache_store (L, cachedir, path, &h);
+    return (0);
+}
+
 static int lua_script_valid_in_context (spank_t sp, struct lua_script *script)
 {
     int valid = 1;
 
 #if HAVE_S_CTX_SLURMD
     if (spank_context() == S_CTX_SLURMD) {
-        lua_getglobal (script->L, "slurm_spank_slurmd_init");
-        lua_getglobal (script->L, "slurm_spank_slurmd_exit");
-        if (lua_isnil (script->L, -1) && lua_isnil (script->L, -2))
+        if (!(script->callbacks &
+              ((1UL << spank_callback_index ("slurm_spank_slurmd_init")) |
+               (1UL << spank_callback_index ("slurm_spank_slurmd_exit")))))
             valid = 0;
-        lua_pop (script->L, 2);
     }
 #endif
 #if HAVE_S_CTX_JOB_SCRIPT
     if (spank_context() == S_CTX_JOB_SCRIPT) {
-        lua_getglobal (script->L, "slurm_spank_job_prolog");
-        lua_getglobal (script->L, "slurm_spank_job_epilog");
-        if (lua_isnil (script->L, -1) && lua_isnil (script->L, -2))
+        if (!(script->callbacks &
+              ((1UL << spank_callback_index ("slurm_spank_job_prolog")) |
+               (1UL << spank_callback_index ("slurm_spank_job_epilog")))))
             valid = 0;
-        lua_pop (script->L, 2);
     }
 #endif
 
@@ -1202,11 +3048,165 @@ static int lua_script_valid_in_context (spank_t sp, struct lua_script *script)
 }
 
 
+static void lua_script_stamp_destroy (struct lua_script_stamp *st)
+{
+    free (st->path);
+    free (st);
+}
+
+/*
+ *  Return a list of stamps for all files matching [pattern].
+ */
+static List lua_script_stamp_list_create (const char *pattern)
+{
+    glob_t gl;
+    size_t i;
+    List l = list_create ((ListDelF) lua_script_stamp_destroy);
+
+    if (glob (pattern, GLOB_ERR, NULL, &gl) != 0)
+        return (l);
+
+    for (i = 0; i < gl.gl_pathc; i++) {
+        struct stat st;
+        struct lua_script_stamp *s;
+
+        if (stat (gl.gl_pathv[i], &st) < 0)
+            continue;
+        if (!(s = malloc (sizeof (*s))))
+            break;
+        s->path = strdup (gl.gl_pathv[i]);
+        s->dev = st.st_dev;
+        s->ino = st.st_ino;
+        s->size = st.st_size;
+        s->mtime = st.st_mtim;
+        list_append (l, s);
+    }
+    globfree (&gl);
+    return (l);
+}
+
+static int lua_script_stamp_list_equal (List a, List b)
+{
+    struct lua_script_stamp *x, *y;
+    ListIterator i, j;
+    int equal = 1;
+
+    if (list_count (a) != list_count (b))
+        return (0);
+
+    i = list_iterator_create (a);
+    j = list_iterator_create (b);
+    while ((x = list_next (i)) && (y = list_next (j))) {
+        if (x->ino != y->ino
+         || x->dev != y->dev
+         || x->size != y->size
+         || x->mtime.tv_sec != y->mtime.tv_sec
+         || x->mtime.tv_nsec != y->mtime.tv_nsec
+         || strcmp (x->path, y->path) != 0) {
+            equal = 0;
+            break;
+        }
+    }
+    list_iterator_destroy (i);
+    list_iterator_destroy (j);
+    return (equal);
+}
+
+/*
+ *  Join plugin arguments [ac], [av] into a single NUL separated
+ *   buffer, so they can be compared with those of a later call.
+ */
+static char * lua_args_join (int ac, char *av[], size_t *lenp)
+{
+    size_t len = 0;
+    char *buf, *p;
+    int i;
+
+    for (i = 0; i < ac; i++)
+        len += strlen (av[i]) + 1;
+
+    if (!(p = buf = malloc (len + 1)))
+        return (NULL);
+
+    for (i = 0; i < ac; i++) {
+        size_t n = strlen (av[i]) + 1;
+        memcpy (p, av[i], n);
+        p += n;
+    }
+    *lenp = len;
+    return (buf);
+}
+
+/*
+ *  Return 1 if the currently loaded lua State may be reused for
+ *   plugin arguments [ac], [av] and scripts matching [pattern], i.e.
+ *   if we are in the same context, the arguments are unchanged, and
+ *   no script has been added, removed or modified since load.
+ */
+static int spank_lua_resident_valid (int ac, char *av[], const char *pattern)
+{
+    List l;
+    char *args;
+    size_t len;
+    int valid;
+
+    if (!global_L || !script_stamp_list || !resident_args)
+        return (0);
+
+    if (spank_context () != resident_context)
+        return (0);
+
+    if (!(args = lua_args_join (ac, av, &len)))
+        return (0);
+    valid = (len == resident_args_len
+          && memcmp (args, resident_args, len) == 0);
+    free (args);
+
+    if (!valid) {
+        slurm_verbose ("spank/lua: plugin arguments changed, reloading");
+        return (0);
+    }
+
+    l = lua_script_stamp_list_create (pattern);
+    valid = lua_script_stamp_list_equal (l, script_stamp_list);
+    list_destroy (l);
+
+    if (!valid)
+        slurm_verbose ("spank/lua: %s: scripts changed, reloading", pattern);
+    return (valid);
+}
+
+static void spank_lua_fini (void)
+{
+    if (lua_script_list)
+        list_destroy (lua_script_list);
+    if (script_option_list)
+        list_destroy (script_option_list);
+    if (script_stamp_list)
+        list_destroy (script_stamp_list);
+    free (resident_args);
+    if (global_L)
+        lua_close (global_L);
+    spank_handle_ref = LUA_NOREF;
+    spank_handle_fields_ref = LUA_NOREF;
+    lua_script_list = NULL;
+    script_option_list = NULL;
+    script_stamp_list = NULL;
+    resident_args = NULL;
+    global_L = NULL;
+}
+
+/*
+ *  Returns 1 if an already loaded lua State was reused (resident mode),
+ *   0 if scripts were (re)loaded, or -1 on failure.
+ */
 int spank_lua_init (spank_t sp, int ac, char *av[])
 {
     struct spank_lua_options opt;
     ListIterator i;
     struct lua_script *script;
+    int all_ac = ac;
+    char **all_av = av;
     int rc = 0;
 
     if (ac == 0) {
@@ -1218,6 +3218,17 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
      */
     spank_lua_process_args (&ac, &av, &opt);
 
+    if (ac == 0) {
+        slurm_error ("spank/lua: Requires at least 1 script or glob");
+        return (-1);
+    }
+
+    if (global_L) {
+        if (opt.resident && spank_lua_resident_valid (all_ac, all_av, av[0]))
+            return (1);
+        spank_lua_fini ();
+    }
+
     /*
      *  dlopen liblua to ensure that symbols from that lib are
      *   available globally (so lua doesn't fail to dlopen its
@@ -1228,14 +3239,29 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
         return (-1);
     }
 
-    global_L = luaL_newstate ();
+    memset (&lua_limits, 0, sizeof (lua_limits));
+    lua_limits.mem_max = opt.maxmem;
+    lua_limits.instr_max = opt.maxinstr;
+
+    global_L = lua_newstate (lua_limit_alloc, &lua_limits);
     luaL_openlibs (global_L);
 
+    lua_kvs_dir = opt.kvdir ? opt.kvdir : LUA_KVS_DIR;
+
     /*
      *  Create the global SPANK table
      */
     SPANK_table_create (global_L);
 
+    lua_profile = opt.profile;
+    lua_profile_file = opt.profile_file;
+
+    if (opt.resident) {
+        script_stamp_list = lua_script_stamp_list_create (av[0]);
+        resident_args = lua_args_join (all_ac, all_av, &resident_args_len);
+        resident_context = spank_context ();
+    }
+
     lua_script_list = lua_script_list_create (global_L, av[0]);
     if (lua_script_list == NULL) {
         slurm_verbose ("spank/lua: No files found in %s", av[0]);
@@ -1264,10 +3290,10 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
         script->fail_on_error = opt.fail_on_error;
 
         /*
-         *  Load script (luaL_loadfile) and compile it (lua_pcall).
+         *  Load script (lua_script_load) and run it (lua_pcall).
          */
-        if (luaL_loadfile (script->L, script->path) ||
-            lua_pcall (script->L, 0, 0, 0)) {
+        if (lua_script_load (script->L, script->path, opt.cachedir) ||
+            lua_script_pcall (script, "main", 0, 0)) {
             print_lua_script_error (script);
             if (opt.fail_on_error)
                 return (-1);
@@ -1276,6 +3302,8 @@ int spank_lua_init (spank_t sp, int ac, char *av[])
             continue;
         }
 
+        script->callbacks = lua_script_callbacks (script->L);
+
         /*
          *  Don't keep script loaded if the script doesn't have any
          *   callbacks in the current context.
@@ -1300,6 +3328,7 @@ static int call_foreach (List l, spank_t sp, const char *name,
     struct lua_script *script;
     struct spank_lua_options opt;
     ListIterator i;
+    int cb;
 
     if (l == NULL)
         return (0);
@@ -1309,9 +3338,11 @@ static int call_foreach (List l, spank_t sp, const char *name,
      */
     spank_lua_process_args (&ac, &av, &opt);
 
+    cb = spank_callback_index (name);
+
     i = list_iterator_create (l);
     while ((script = list_next (i))) {
-        if (lua_spank_call (script, sp, name, ac, av) < 0)
+        if (lua_spank_call (script, sp, name, cb, ac, av) < 0)
             rc = -1;
     }
 
@@ -1336,9 +3367,33 @@ int slurm_spank_init (spank_t sp, int ac, char *av[])
     return call_foreach (lua_script_list, sp, "slurm_spank_init", ac, av);
 }
 
+/*
+ *  Initialize lua State for slurmd and job_script context callbacks.
+ *   If the plugin is in resident mode and the State loaded earlier in
+ *   this process (normally by slurm_spank_init) was reused, call the
+ *   optional slurm_spank_lua_reset hook in each script so per-job
+ *   globals may be cleared. slurmd runs job_prolog and job_epilog in
+ *   a fresh slurmstepd process, so a State is never reused by them
+ *   across jobs.
+ */
+static int spank_lua_resident_init (spank_t sp, int ac, char *av[])
+{
+    int rc = spank_lua_init (sp, ac, av);
+
+    /*
+     *  Never reuse a State that failed to load.
+     */
+    if (rc < 0)
+        spank_lua_fini ();
+    else if (rc == 1)
+        rc = call_foreach (lua_script_list, sp,
+                "slurm_spank_lua_reset", ac, av);
+    return (rc);
+}
+
 int slurm_spank_slurmd_init (spank_t sp, int ac, char *av[])
 {
-    if (spank_lua_init (sp, ac, av) < 0)
+    if (spank_lua_resident_init (sp, ac, av) < 0)
         return (-1);
     return call_foreach (lua_script_list, sp,
             "slurm_spank_slurmd_init", ac, av);
@@ -1346,7 +3401,7 @@ int slurm_spank_slurmd_init (spank_t sp, int ac, char *av[])
 
 int slurm_spank_job_prolog (spank_t sp, int ac, char *av[])
 {
-    if (spank_lua_init (sp, ac, av) < 0)
+    if (spank_lua_resident_init (sp, ac, av) < 0)
         return (-1);
     return call_foreach (lua_script_list, sp,
             "slurm_spank_job_prolog", ac, av);
@@ -1395,21 +3450,23 @@ int slurm_spank_task_exit (spank_t sp, int ac, char *av[])
 
 int slurm_spank_job_epilog (spank_t sp, int ac, char *av[])
 {
-    if (spank_lua_init (sp, ac, av) < 0)
+    int rc;
+
+    if (spank_lua_resident_init (sp, ac, av) < 0)
         return (-1);
-    return call_foreach (lua_script_list, sp,
+    rc = call_foreach (lua_script_list, sp,
             "slurm_spank_job_epilog", ac, av);
+
+    lua_kvs_job_remove (sp);
+    return (rc);
 }
 
 int slurm_spank_exit (spank_t sp, int ac, char *av[])
 {
     int rc = call_foreach (lua_script_list, sp, "slurm_spank_exit", ac, av);
 
-    if (lua_script_list)
-        list_destroy (lua_script_list);
-    if (script_option_list)
-        list_destroy (script_option_list);
-    lua_close (global_L);
+    lua_prof_dump (lua_script_list, sp);
+    spank_lua_fini ();
     return (rc);
 }
 
@@ -1418,11 +3475,8 @@ int slurm_spank_slurmd_exit (spank_t sp, int ac, char *av[])
     int rc = call_foreach (lua_script_list, sp,
             "slurm_spank_slurmd_exit", ac, av);
 
-    if (lua_script_list)
-        list_destroy (lua_script_list);
-    if (script_option_list)
-        list_destroy (script_option_list);
-    lua_close (global_L);
+    lua_prof_dump (lua_script_list, sp);
+    spank_lua_fini ();
     return (rc);
 }
 
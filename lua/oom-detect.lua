@@ -36,6 +36,19 @@
 
 local posix = require 'posix'
 
+--  Use the native /dev/kmsg reader from lua-schedutils if available,
+--   otherwise fall back to running dmesg(1) for each task exit.
+local have_schedutils, schedutils = pcall (require, 'schedutils')
+local kmsg = nil
+
+--  OOM kills read from /dev/kmsg but not yet matched to an exiting
+--   task, indexed by pid. Since each kmsg record is only read once,
+--   a task exit that reads records for other tasks of the step must
+--   keep them for those tasks' own exit callbacks.
+local oom_pending = {}
+local oom_pending_pids = {}
+local oom_pending_max = 1024
+
 --- Log an error with SLURM's log facility
 local function log_err (...)
     SPANK.log_error (...)
@@ -165,6 +178,107 @@ function kill_all_step_tasks (job)
     f:close()
 end
 
+--- Return an iterator over kernel log messages, and true if only
+--   messages not returned by a previous call are included.
+--
+-- With lua-schedutils, /dev/kmsg is opened once per process and only
+--  messages newer than those seen by a previous call are returned.
+--
+function kernel_messages ()
+    if have_schedutils and not kmsg then
+        kmsg = schedutils.kmsg_open ()
+    end
+
+    if kmsg then
+        local records, err = kmsg:read ()
+        if records then
+            local i = 0
+            return function ()
+                i = i + 1
+                return records[i] and records[i].msg
+            end, true
+        end
+        log_err ("oom-detect: /dev/kmsg: %s", err)
+    end
+
+    --  Read all of dmesg's output up front, so the pipe is closed even
+    --   if the caller stops at the first match.
+    local f, err = io.popen ("/bin/dmesg")
+    if f == nil then
+        log_err ("oom-detect: /bin/dmesg: %s", err)
+        return function () return nil end
+    end
+    local lines = {}
+    for line in f:lines () do
+        table.insert (lines, line)
+    end
+    f:close ()
+
+    local i = 0
+    return function ()
+        i = i + 1
+        return lines[i]
+    end, false
+end
+
+--- Remember OOM kill `oom' of process `pid' for a later task exit.
+--   Only the most recent oom_pending_max entries are kept.
+--
+local function oom_pending_add (pid, oom)
+    if not oom_pending[pid] then
+        table.insert (oom_pending_pids, pid)
+    end
+    oom_pending[pid] = oom
+    while #oom_pending_pids > oom_pending_max do
+        oom_pending[table.remove (oom_pending_pids, 1)] = nil
+    end
+end
+
+--- Return and forget the remembered OOM kill of process `pid', if any
+--
+local function oom_pending_take (pid)
+    local oom = oom_pending[pid]
+    if oom then
+        oom_pending[pid] = nil
+        for i, p in ipairs (oom_pending_pids) do
+            if p == pid then
+                table.remove (oom_pending_pids, i)
+                break
+            end
+        end
+    end
+    return oom
+end
+
+--- Find the OOM kill of process `pid' in the kernel log
+--
+-- Records for other processes read from /dev/kmsg are kept in
+--  oom_pending, which is checked before reading any new messages.
+--
+local function find_oom_kill (pid)
+    local oom = oom_pending_take (pid)
+    if oom then
+        return oom
+    end
+
+    local lines, incremental = kernel_messages ()
+    for line in lines do
+        local p, comm, vsz, rss, file_rss = check_oom_kill (line)
+        if p then
+            p = tonumber (p)
+            oom = { comm = comm, vsz = vsz, rss = rss, file_rss = file_rss }
+            if not incremental then
+                if p == pid then
+                    return oom
+                end
+            else
+                oom_pending_add (p, oom)
+            end
+        end
+    end
+    return oom_pending_take (pid)
+end
+
 --- Plugin hook called for each task exit event in the current job step
 --
 -- Check eack task exit to see if it was killed by the OOM killer, and print
@@ -181,22 +295,11 @@ function slurm_spank_task_exit (spank)
         return SPANK.SUCCESS
     end
 
-    local f, err = io.popen ("/bin/dmesg")
-    if f == nil then
-        log ("/bin/dmesg: %s", err)
-        return SPANK.FAILURE
-    end
-
-    for line in f:lines () do
-        local pid, comm, vsz, rss, file_rss = check_oom_kill (line)
-        if job.task.pid == tonumber (pid) then
-            log_oom_kill (job, comm, vsz, rss, file_rss)
-            kill_all_step_tasks (job)
-            break
-        end
+    local oom = find_oom_kill (job.task.pid)
+    if oom then
+        log_oom_kill (job, oom.comm, oom.vsz, oom.rss, oom.file_rss)
+        kill_all_step_tasks (job)
     end
 
-    f:close()
-
     return SPANK.SUCCESS
 end
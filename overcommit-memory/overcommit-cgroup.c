@@ -0,0 +1,336 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ *  Per-job overcommit control through the cgroup memory controller.
+ *
+ *  Instead of changing the node-wide vm.overcommit_memory sysctl, the
+ *   requested mode is approximated with limits on the job step's own
+ *   memory cgroup, so jobs sharing a node may choose independently:
+ *
+ *   mode 2 (off):    memory limit set to ratio percent of the limit
+ *                    inherited from the enclosing cgroup (or MemTotal
+ *                    if unlimited), or left alone if the step's own
+ *                    limit is already lower, and swap disabled.
+ *   mode 1 (always): limits left as configured by slurm.
+ *   mode 0 (on):     limits left as configured by slurm.
+ *
+ *  The limit is derived from the parent cgroup and only ever lowers
+ *   the step's current limit, so applying it once per task is
+ *   idempotent. No mode raises a memory or swap limit set by slurm,
+ *   which would let users escape site policy such as
+ *   ConstrainSwapSpace, so `always' is no different from `on' here.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "overcommit.h"
+
+static const char proc_cgroup_file [] = "/proc/self/cgroup";
+static const char meminfo_file [] = "/proc/meminfo";
+
+#define CG_UNLIMITED ((unsigned long long) -1)
+
+struct cgroup_info {
+    int v2;                     /* 1 if unified hierarchy               */
+    char dir [PATH_MAX];        /* Step (or job) cgroup directory       */
+    char top [PATH_MAX];        /* Root of the memory hierarchy         */
+};
+
+static unsigned long long meminfo_total (void)
+{
+    unsigned long long kb = 0;
+    char line [256];
+    FILE *fp;
+
+    if (!(fp = fopen (meminfo_file, "r")))
+        return (0);
+
+    while (fgets (line, sizeof (line), fp)) {
+        if (sscanf (line, "MemTotal: %llu kB", &kb) == 1)
+            break;
+    }
+    fclose (fp);
+
+    return (kb * 1024);
+}
+
+/*
+ *  Return the cgroup path of the current process in the memory
+ *   hierarchy, preferring a v1 memory controller over the unified
+ *   hierarchy. Sets *v2 accordingly.
+ */
+static int self_cgroup_path (char *path, size_t len, int *v2)
+{
+    char line [PATH_MAX + 256];
+    int found = 0;
+    FILE *fp;
+
+    if (!(fp = fopen (proc_cgroup_file, "r"))) {
+        fprintf (stderr, "open (%s): %s\n", proc_cgroup_file, strerror (errno));
+        return (-1);
+    }
+
+    while (!found && fgets (line, sizeof (line), fp)) {
+        char *ctl, *p, *tok, *save;
+
+        line [strcspn (line, "\n")] = '\0';
+        if (!(ctl = strchr (line, ':')) || !(p = strchr (ctl + 1, ':')))
+            continue;
+        *ctl++ = '\0';
+        *p++ = '\0';
+
+        if (strcmp (line, "0") == 0 && *ctl == '\0') {
+            /*  Unified hierarchy, keep looking for a v1 memory controller
+             */
+            snprintf (path, len, "%s", p);
+            *v2 = 1;
+            continue;
+        }
+
+        for (tok = strtok_r (ctl, ",", &save); tok && !found;
+             tok = strtok_r (NULL, ",", &save)) {
+            if (strcmp (tok, "memory") == 0) {
+                snprintf (path, len, "%s", p);
+                *v2 = 0;
+                found = 1;
+            }
+        }
+    }
+    fclose (fp);
+
+    if (!found && !*v2) {
+        fprintf (stderr, "overcommit: no memory cgroup in %s\n",
+                 proc_cgroup_file);
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ *  Return a pointer just past path component [name] in [path], or NULL.
+ */
+static char * path_component (char *path, const char *name)
+{
+    size_t len = strlen (name);
+    char *p;
+
+    for (p = path; (p = strchr (p, '/')); p++) {
+        if (strncmp (p + 1, name, len) == 0
+            && (p [len + 1] == '/' || p [len + 1] == '\0'))
+            return (p + len + 1);
+    }
+    return (NULL);
+}
+
+/*
+ *  Find the memory cgroup directory of job [jobid] step [stepid] above
+ *   the current process: the "step_<stepid>" component below
+ *   "job_<jobid>", or the job cgroup itself if there is no step cgroup.
+ */
+static int cgroup_info_init (struct cgroup_info *cg, const char *root,
+                             int jobid, int stepid)
+{
+    char path [PATH_MAX];
+    char name [64];
+    char *end, *step;
+    int n;
+
+    cg->v2 = 0;
+    if (self_cgroup_path (path, sizeof (path), &cg->v2) < 0)
+        return (-1);
+
+    snprintf (name, sizeof (name), "job_%d", jobid);
+    if (!(end = path_component (path, name))) {
+        fprintf (stderr, "overcommit: no cgroup for job %d in %s\n",
+                 jobid, path);
+        return (-1);
+    }
+    snprintf (name, sizeof (name), "step_%d", stepid);
+    if ((step = path_component (end, name)))
+        end = step;
+    *end = '\0';
+
+    n = snprintf (cg->top, sizeof (cg->top), "%s%s", root,
+                  cg->v2 ? "" : "/memory");
+    if (n < 0 || (size_t) n >= sizeof (cg->top))
+        return (-1);
+    n = snprintf (cg->dir, sizeof (cg->dir), "%s%s", cg->top, path);
+    if (n < 0 || (size_t) n >= sizeof (cg->dir))
+        return (-1);
+
+    return (0);
+}
+
+static int cgroup_read (const char *dir, const char *name,
+                        unsigned long long *valp)
+{
+    char file [PATH_MAX];
+    char buf [64];
+    FILE *fp;
+
+    snprintf (file, sizeof (file), "%s/%s", dir, name);
+    if (!(fp = fopen (file, "r")))
+        return (-1);
+
+    if (!fgets (buf, sizeof (buf), fp)) {
+        fclose (fp);
+        return (-1);
+    }
+    fclose (fp);
+
+    if (strncmp (buf, "max", 3) == 0)
+        *valp = CG_UNLIMITED;
+    else
+        *valp = strtoull (buf, NULL, 10);
+
+    return (0);
+}
+
+static int cgroup_write (const char *dir, const char *name, const char *val)
+{
+    char file [PATH_MAX];
+    FILE *fp;
+    int rc = 0;
+
+    snprintf (file, sizeof (file), "%s/%s", dir, name);
+    if (!(fp = fopen (file, "w")))
+        return (-1);
+
+    if (fprintf (fp, "%s\n", val) < 0)
+        rc = -1;
+    if (fclose (fp) < 0)
+        rc = -1;
+
+    return (rc);
+}
+
+static int cgroup_write_ull (const char *dir, const char *name,
+                             unsigned long long val)
+{
+    char buf [64];
+    snprintf (buf, sizeof (buf), "%llu", val);
+    return (cgroup_write (dir, name, buf));
+}
+
+/*
+ *  Return the memory limit inherited by [cg]: the smallest limit set on
+ *   any ancestor of the step cgroup, or MemTotal if there is none.
+ *   v1 reports "unlimited" as a very large page-aligned value.
+ */
+static unsigned long long inherited_limit (struct cgroup_info *cg)
+{
+    const char *name = cg->v2 ? "memory.max" : "memory.limit_in_bytes";
+    unsigned long long total = meminfo_total ();
+    unsigned long long limit = CG_UNLIMITED;
+    char dir [PATH_MAX];
+    char *p;
+
+    snprintf (dir, sizeof (dir), "%s", cg->dir);
+
+    while ((p = strrchr (dir, '/')) && (p - dir) > strlen (cg->top)) {
+        unsigned long long val;
+        *p = '\0';
+        if (cgroup_read (dir, name, &val) == 0 && val < limit)
+            limit = val;
+    }
+
+    if (total && (limit == CG_UNLIMITED || limit > total))
+        limit = total;
+
+    return (limit);
+}
+
+static int set_limit (struct cgroup_info *cg, const char *name,
+                      unsigned long long val)
+{
+    int rc;
+
+    if (val == CG_UNLIMITED)
+        rc = cgroup_write (cg->dir, name, cg->v2 ? "max" : "-1");
+    else
+        rc = cgroup_write_ull (cg->dir, name, val);
+
+    if (rc < 0)
+        fprintf (stderr, "overcommit: %s/%s: %s\n",
+                 cg->dir, name, strerror (errno));
+    return (rc);
+}
+
+int overcommit_cgroup_set (const char *root, int jobid, int stepid,
+                           int mode, int ratio)
+{
+    struct cgroup_info cg;
+    unsigned long long limit, current;
+
+    if (mode == 0 || mode == 1)
+        return (0);
+
+    if (mode != 2 || ratio <= 0)
+        return (-1);
+
+    if (cgroup_info_init (&cg, root, jobid, stepid) < 0)
+        return (-1);
+
+    if ((limit = inherited_limit (&cg)) == CG_UNLIMITED) {
+        fprintf (stderr, "overcommit: unable to determine memory limit\n");
+        return (-1);
+    }
+    limit = limit / 100 * ratio;
+
+    /*
+     *  Never raise a limit already set on the step cgroup itself
+     *   (e.g. by slurm), only tighten it.
+     */
+    if (cgroup_read (cg.dir, cg.v2 ? "memory.max" : "memory.limit_in_bytes",
+                     &current) == 0 && current < limit)
+        limit = current;
+
+    if (cg.v2) {
+        if (set_limit (&cg, "memory.max", limit) < 0)
+            return (-1);
+        return (set_limit (&cg, "memory.swap.max", 0));
+    }
+
+    /*
+     *  With v1, memsw.limit_in_bytes may never be lower than
+     *   limit_in_bytes. The limit is never raised, so lower
+     *   limit_in_bytes first.
+     */
+    if (set_limit (&cg, "memory.limit_in_bytes", limit) < 0)
+        return (-1);
+    cgroup_write_ull (cg.dir, "memory.memsw.limit_in_bytes", limit);
+    return (0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
@@ -46,6 +46,29 @@ static int stepid;
 static int overcommit_ratio = 100;
 static overcommit_shared_ctx_t ctx = NULL;
 
+/*
+ *  In cgroup mode the requested policy is applied to the step's memory
+ *   cgroup from task_init_privileged, once the tasks have been placed
+ *   in their cgroups, and the global sysctls are never touched.
+ */
+static int use_cgroup = 0;
+static char *cgroup_root = NULL;
+static int cgroup_mode = -1;
+
+/*
+ *  Optional Committed_AS monitor, started from local task 0 when the
+ *   job selects strict overcommit accounting on the node.
+ */
+static int monitor = 0;
+static int overcommit_mode = -1;
+static struct overcommit_monitor_conf monitor_conf = {
+    .interval = 10,
+    .nthresholds = 3,
+    .thresholds = { 80, 90, 95 },
+};
+static char *monitor_log = NULL;
+static char *proc_root = NULL;
+
 static int overcommit_opt_process (int val, const char *arg, int remote);
 
 struct spank_option spank_options [] = 
@@ -60,20 +83,33 @@ struct spank_option spank_options [] =
 
 static int set_overcommit_policy (int val)
 {
+    int rc;
+
+    if (use_cgroup) {
+        cgroup_mode = val;
+        return (0);
+    }
+
     ctx = overcommit_shared_ctx_create (jobid, stepid);
 
     if (ctx == NULL)
         return (-1);
 
-    if (overcommit_in_use (ctx, val)) {
-        slurm_error ("overcommit-memory: Cannot set desired mode on this node");
+    if ((rc = overcommit_in_use (ctx, val))) {
+        if (rc < 0)
+            slurm_error ("overcommit-memory: Failed to register job");
+        else
+            slurm_error ("overcommit-memory: Cannot set desired mode on this node");
         overcommit_shared_ctx_destroy (ctx);
+        ctx = NULL;
     }
     else if (overcommit_memory_set_current_state (val) < 0)
         slurm_error ("overcommit-memory: Failed to set overcommit = %d", val);
     else if (overcommit_ratio_set (overcommit_ratio) < 0)
         slurm_error ("overcommit-memory: Failed to set overcommit_ratio to %d\n",
                      overcommit_ratio);
+    else
+        overcommit_mode = val;
 
     return (0);
 }
@@ -156,6 +192,46 @@ static int str2int (const char *str)
     return ((int) l);
 }
 
+/*
+ *  Parse a comma separated, increasing list of percentages into
+ *   the monitor thresholds.
+ */
+static int parse_thresholds (const char *str)
+{
+    char *copy = strdup (str);
+    char *tok, *save;
+    int n = 0;
+    int rc = 0;
+
+    if (!copy)
+        return (-1);
+
+    for (tok = strtok_r (copy, ",", &save); tok;
+         tok = strtok_r (NULL, ",", &save)) {
+        int pct = str2int (tok);
+        if (pct <= 0 || n == OVERCOMMIT_MAX_THRESHOLDS
+            || (n && pct <= monitor_conf.thresholds [n-1])) {
+            rc = -1;
+            break;
+        }
+        monitor_conf.thresholds [n++] = pct;
+    }
+    free (copy);
+
+    if (n == 0)
+        rc = -1;
+    if (rc == 0)
+        monitor_conf.nthresholds = n;
+
+    return (rc);
+}
+
+static void set_string (char **dst, const char *src)
+{
+    free (*dst);
+    *dst = strdup (src);
+}
+
 int parse_options (int ac, char **av)
 {
     int i;
@@ -169,6 +245,34 @@ int parse_options (int ac, char **av)
                 retval = -1;
             }
         }
+        else if (strcmp ("cgroup", av[i]) == 0)
+            use_cgroup = 1;
+        else if (strncmp ("cgroup_root=", av[i], 12) == 0) {
+            set_string (&cgroup_root, av[i] + 12);
+            use_cgroup = 1;
+        }
+        else if (strcmp ("monitor", av[i]) == 0)
+            monitor = 1;
+        else if (strncmp ("monitor_interval=", av[i], 17) == 0) {
+            if ((monitor_conf.interval = str2int (av[i] + 17)) <= 0) {
+                slurm_error ("overcommit-memory: Invalid %s\n", av[i]);
+                retval = -1;
+            }
+            monitor = 1;
+        }
+        else if (strncmp ("monitor_thresholds=", av[i], 19) == 0) {
+            if (parse_thresholds (av[i] + 19) < 0) {
+                slurm_error ("overcommit-memory: Invalid %s\n", av[i]);
+                retval = -1;
+            }
+            monitor = 1;
+        }
+        else if (strncmp ("monitor_log=", av[i], 12) == 0) {
+            set_string (&monitor_log, av[i] + 12);
+            monitor = 1;
+        }
+        else if (strncmp ("proc_root=", av[i], 10) == 0)
+            set_string (&proc_root, av[i] + 10);
         else  {
             slurm_error ("overcommit-memory: Invalid option %s\n", av[i]);
             retval = -1;
@@ -204,8 +308,56 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
 }
 
 
+static int monitor_start (spank_t sp)
+{
+    int taskid;
+    uid_t uid;
+    gid_t gid;
+
+    if (spank_get_item (sp, S_TASK_ID, &taskid) != ESPANK_SUCCESS
+        || taskid != 0)
+        return (0);
+
+    if (spank_get_item (sp, S_JOB_UID, &uid) != ESPANK_SUCCESS
+        || spank_get_item (sp, S_JOB_GID, &gid) != ESPANK_SUCCESS)
+        return (-1);
+
+    monitor_conf.proc_root = proc_root ? proc_root : "/proc";
+    monitor_conf.logfile = monitor_log;
+    monitor_conf.jobid = jobid;
+    monitor_conf.stepid = stepid;
+    monitor_conf.root_pid = getppid ();     /* slurmstepd */
+    monitor_conf.uid = uid;
+    monitor_conf.gid = gid;
+
+    return (overcommit_monitor_start (&monitor_conf));
+}
+
+int slurm_spank_task_init_privileged (spank_t sp, int ac, char **av)
+{
+    const char *root = cgroup_root ? cgroup_root : "/sys/fs/cgroup";
+
+    if (monitor && overcommit_mode == 2 && monitor_start (sp) < 0)
+        slurm_error ("overcommit-memory: Failed to start monitor");
+
+    if (!use_cgroup || cgroup_mode <= 0)
+        return (0);
+
+    if (overcommit_cgroup_set (root, jobid, stepid, cgroup_mode,
+                               overcommit_ratio) < 0)
+        slurm_error ("overcommit-memory: Failed to set overcommit = %d "
+                     "for job %d.%d cgroup", cgroup_mode, jobid, stepid);
+
+    return (0);
+}
+
 int slurm_spank_exit (spank_t sp, int ac, char **av)
 {
+    free (cgroup_root);
+    free (monitor_log);
+    free (proc_root);
+    cgroup_root = monitor_log = proc_root = NULL;
+
     if (!spank_remote (sp) || !ctx)
         return (0);
 
@@ -0,0 +1,399 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+/*
+ *  Committed_AS monitor.
+ *
+ *  With strict overcommit accounting, allocations start to fail once
+ *   the node's Committed_AS reaches CommitLimit. The monitor samples
+ *   /proc/meminfo, and the memory committed by the processes of one
+ *   job step, every few seconds and warns the job on its stderr (and
+ *   optionally appends a line to a telemetry file) whenever node
+ *   usage crosses one of a set of soft thresholds.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "overcommit.h"
+
+static int meminfo_read (const char *proc_root, struct overcommit_sample *s)
+{
+    char path [PATH_MAX];
+    char line [256];
+    int n = 0;
+    FILE *fp;
+
+    snprintf (path, sizeof (path), "%s/meminfo", proc_root);
+    if (!(fp = fopen (path, "r")))
+        return (-1);
+
+    while (n < 2 && fgets (line, sizeof (line), fp)) {
+        if (sscanf (line, "CommitLimit: %llu kB", &s->commit_limit) == 1)
+            n++;
+        else if (sscanf (line, "Committed_AS: %llu kB", &s->committed) == 1)
+            n++;
+    }
+    fclose (fp);
+
+    return (n == 2 ? 0 : -1);
+}
+
+/*
+ *  Read parent pid and committed memory (private writable data and
+ *   stack, in kB) of [pid] from /proc/[pid]/status.
+ */
+static int proc_status_read (const char *proc_root, const char *pid,
+                             pid_t *ppid, unsigned long long *kb)
+{
+    char path [PATH_MAX];
+    char line [256];
+    unsigned long long val;
+    FILE *fp;
+
+    snprintf (path, sizeof (path), "%s/%s/status", proc_root, pid);
+    if (!(fp = fopen (path, "r")))
+        return (-1);
+
+    *ppid = 0;
+    *kb = 0;
+    while (fgets (line, sizeof (line), fp)) {
+        int p;
+        if (sscanf (line, "PPid: %d", &p) == 1)
+            *ppid = p;
+        else if (sscanf (line, "VmData: %llu kB", &val) == 1)
+            *kb += val;
+        else if (sscanf (line, "VmStk: %llu kB", &val) == 1)
+            *kb += val;
+    }
+    fclose (fp);
+
+    return (0);
+}
+
+struct proc_ent {
+    pid_t pid;
+    pid_t ppid;
+    unsigned long long kb;
+};
+
+static int proc_ent_cmp (const void *x, const void *y)
+{
+    const struct proc_ent *a = x, *b = y;
+    return ((a->pid > b->pid) - (a->pid < b->pid));
+}
+
+/*
+ *  Return total committed memory in kB of all descendants of [root].
+ *   Processes are collected in one pass over [proc_root] and sorted by
+ *   pid; descendants are then marked by repeatedly looking up parents
+ *   until no more are found.
+ */
+static unsigned long long job_committed (const char *proc_root, pid_t root)
+{
+    struct proc_ent *procs = NULL;
+    unsigned char *mark;
+    unsigned long long total = 0;
+    struct dirent *d;
+    int n = 0, size = 0;
+    int i, changed;
+    DIR *dir;
+
+    if (!(dir = opendir (proc_root)))
+        return (0);
+
+    while ((d = readdir (dir))) {
+        struct proc_ent *e;
+
+        if (d->d_name[0] < '0' || d->d_name[0] > '9')
+            continue;
+        if (n == size) {
+            size = size ? size * 2 : 256;
+            if (!(e = realloc (procs, size * sizeof (*procs))))
+                break;
+            procs = e;
+        }
+        e = &procs[n];
+        e->pid = atoi (d->d_name);
+        if (proc_status_read (proc_root, d->d_name, &e->ppid, &e->kb) == 0)
+            n++;
+    }
+    closedir (dir);
+
+    if (n == 0 || !(mark = calloc (n, 1))) {
+        free (procs);
+        return (0);
+    }
+    qsort (procs, n, sizeof (*procs), proc_ent_cmp);
+
+    do {
+        changed = 0;
+        for (i = 0; i < n; i++) {
+            struct proc_ent key, *parent;
+
+            if (mark[i])
+                continue;
+            if (procs[i].ppid == root)
+                parent = NULL;
+            else {
+                key.pid = procs[i].ppid;
+                parent = bsearch (&key, procs, n, sizeof (*procs),
+                                  proc_ent_cmp);
+                if (!parent || !mark[parent - procs])
+                    continue;
+            }
+            mark[i] = 1;
+            total += procs[i].kb;
+            changed = 1;
+        }
+    } while (changed);
+
+    free (mark);
+    free (procs);
+    return (total);
+}
+
+int overcommit_sample (const char *proc_root, pid_t root,
+                       struct overcommit_sample *s)
+{
+    memset (s, 0, sizeof (*s));
+
+    if (meminfo_read (proc_root, s) < 0)
+        return (-1);
+
+    if (root > 0)
+        s->job_committed = job_committed (proc_root, root);
+
+    return (0);
+}
+
+static int sample_level (struct overcommit_monitor_conf *conf,
+                         struct overcommit_sample *s)
+{
+    unsigned long long pct;
+    int i, level = 0;
+
+    if (s->commit_limit == 0)
+        return (0);
+
+    pct = s->committed * 100 / s->commit_limit;
+    for (i = 0; i < conf->nthresholds; i++) {
+        if (pct >= conf->thresholds[i])
+            level = i + 1;
+    }
+    return (level);
+}
+
+static void monitor_report (struct overcommit_monitor_conf *conf, int logfd,
+                            struct overcommit_sample *s, int level, int prev)
+{
+    char host [256];
+    char buf [512];
+    int pct = s->commit_limit ? s->committed * 100 / s->commit_limit : 0;
+    int n;
+
+    if (gethostname (host, sizeof (host)) < 0)
+        strcpy (host, "unknown");
+    host [sizeof (host) - 1] = '\0';
+
+    if (level > prev)
+        fprintf (stderr, "overcommit-memory: %s: Committed_AS at %d%% "
+                 "of CommitLimit (%llu of %llu MB), this job has %llu MB "
+                 "committed. Further allocations may fail.\n",
+                 host, pct, s->committed / 1024, s->commit_limit / 1024,
+                 s->job_committed / 1024);
+
+    if (logfd < 0)
+        return;
+
+    n = snprintf (buf, sizeof (buf), "%ld %s %d.%d threshold=%d pct=%d "
+                  "committed_as=%llu commit_limit=%llu job_committed=%llu\n",
+                  (long) time (NULL), host, conf->jobid, conf->stepid,
+                  level ? conf->thresholds[level - 1] : 0, pct,
+                  s->committed, s->commit_limit, s->job_committed);
+    if (n > 0 && (size_t) n < sizeof (buf) && write (logfd, buf, n) != n)
+        fprintf (stderr, "overcommit: write (%s): %s\n",
+                 conf->logfile, strerror (errno));
+}
+
+/*
+ *  Return a pidfd for [pid], or -1 if not supported by the kernel.
+ */
+static int task_pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (syscall (SYS_pidfd_open, pid, 0));
+#else
+    errno = ENOSYS;
+    return (-1);
+#endif
+}
+
+/*
+ *  Wait up to [secs] seconds for [task] to exit. Returns 1 if it has
+ *   exited, or if that can no longer be determined.
+ */
+static int task_wait_exit (pid_t task, int pidfd, int secs)
+{
+    int t;
+
+    if (pidfd >= 0) {
+        struct pollfd pfd = { pidfd, POLLIN, 0 };
+        int rc = poll (&pfd, 1, secs * 1000);
+        return (rc != 0 && !(rc < 0 && errno == EINTR));
+    }
+
+    /*
+     *  Without a pidfd, poll with kill(2) in one second ticks. Any
+     *   error means the task is gone: after pid reuse by another user
+     *   kill fails with EPERM rather than ESRCH.
+     */
+    for (t = 0; t < secs; t++) {
+        if (kill (task, 0) < 0)
+            return (1);
+        sleep (1);
+    }
+    return (0);
+}
+
+/*
+ *  Close every fd inherited from the task and slurmstepd except
+ *   stdio, [logfd] and [pidfd].
+ */
+static void monitor_close_fds (const char *proc_root, int logfd, int pidfd)
+{
+    char path [PATH_MAX];
+    struct dirent *d;
+    DIR *dir;
+
+    snprintf (path, sizeof (path), "%s/self/fd", proc_root);
+    if (!(dir = opendir (path)))
+        return;
+    while ((d = readdir (dir))) {
+        int fd = atoi (d->d_name);
+        if (d->d_name[0] >= '0' && d->d_name[0] <= '9'
+            && fd > STDERR_FILENO && fd != logfd && fd != pidfd
+            && fd != dirfd (dir))
+            close (fd);
+    }
+    closedir (dir);
+}
+
+static void monitor_run (struct overcommit_monitor_conf *conf, pid_t task,
+                         int pidfd, int logfd)
+{
+    struct overcommit_sample s;
+    int prev = 0;
+
+    for (;;) {
+        if (overcommit_sample (conf->proc_root, conf->root_pid, &s) == 0) {
+            int level = sample_level (conf, &s);
+            if (level != prev)
+                monitor_report (conf, logfd, &s, level, prev);
+            prev = level;
+        }
+
+        /*  Wait on the task rather than sleeping, so the monitor goes
+         *   away promptly once the task that started it has exited.
+         */
+        if (task_wait_exit (task, pidfd, conf->interval))
+            return;
+    }
+}
+
+int overcommit_monitor_start (struct overcommit_monitor_conf *conf)
+{
+    pid_t task = getpid ();
+    pid_t pid;
+    int status;
+
+    /*
+     *  Double fork so that the monitor is not a child of the task, which
+     *   might otherwise end up waiting for it.
+     */
+    if ((pid = fork ()) < 0) {
+        fprintf (stderr, "overcommit: fork: %s\n", strerror (errno));
+        return (-1);
+    }
+
+    if (pid == 0) {
+        int logfd = -1;
+        int pidfd;
+        int fd;
+
+        /*  The task is still blocked in waitpid() below, so the pidfd
+         *   refers to it and not to a later process reusing its pid.
+         */
+        pidfd = task_pidfd_open (task);
+
+        if (fork () != 0)
+            _exit (0);
+
+        if (conf->logfile &&
+            (logfd = open (conf->logfile, O_WRONLY|O_CREAT|O_APPEND, 0644)) < 0)
+            fprintf (stderr, "overcommit: open (%s): %s\n",
+                     conf->logfile, strerror (errno));
+
+        if ((fd = open ("/dev/null", O_RDWR)) >= 0) {
+            dup2 (fd, STDIN_FILENO);
+            dup2 (fd, STDOUT_FILENO);
+            if (fd > STDERR_FILENO)
+                close (fd);
+        }
+        monitor_close_fds (conf->proc_root, logfd, pidfd);
+
+        if ((conf->gid != (gid_t) -1
+             && (setgroups (0, NULL) < 0 || setgid (conf->gid) < 0))
+            || (conf->uid != (uid_t) -1 && setuid (conf->uid) < 0))
+            _exit (1);
+
+        signal (SIGTERM, SIG_DFL);
+        signal (SIGINT, SIG_DFL);
+        signal (SIGHUP, SIG_IGN);
+
+        monitor_run (conf, task, pidfd, logfd);
+        _exit (0);
+    }
+
+    while (waitpid (pid, &status, 0) < 0 && errno == EINTR) {;}
+
+    return (0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
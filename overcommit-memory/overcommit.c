@@ -27,7 +27,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,67 +42,352 @@ static const char shared_filename [] = "/tmp/spank-overcommit-memory";
 static const char overcommit_file [] = "/proc/sys/vm/overcommit_memory";
 static const char overcommit_ratio_file [] = "/proc/sys/vm/overcommit_ratio";
 
+#define OVERCOMMIT_MAGIC 0x6f636d32     /* "ocm2" */
+#define MIN_SLOTS        64
+
+/*
+ *  The shared file holds a header page followed by an open addressing
+ *   hash table of registered job steps, keyed on jobid and stepid. The
+ *   table is kept at most half full and doubles in size as needed.
+ *   Processes map the header once and remap the table whenever they
+ *   find that it has grown.
+ */
 struct overcommit_job_info {
     int jobid;
     int stepid;
     int  used;
+    pid_t pid;                  /* slurmstepd which registered the step */
+    unsigned long long start;   /* Start time of pid, 0 if unknown      */
 };
 
 struct overcommit_shared_info {
-    sem_t sem;
+    int magic;
+    pthread_mutex_t mutex;      /* Robust, process shared               */
     int initialized;
     int overcommit_value;
     int previous_overcommit_ratio;
     int nusers;
-    struct overcommit_job_info users [64];
+    int nslots;                 /* Size of table, a power of 2          */
 };
 
 struct overcommit_shared_context {
     int fd;
     int jobid;
     int stepid;
+    int locked;
     struct overcommit_shared_info *shared;
+    struct overcommit_job_info *slots;
+    int nslots;                 /* Slots currently mapped               */
 };
 
-static int 
-unregister_job (overcommit_shared_ctx_t ctx)
+static size_t header_size (void)
 {
-    int i;
-    int maxn = sizeof (ctx->shared->users) / sizeof (int);
+    size_t pagesize = sysconf (_SC_PAGESIZE);
+    size_t len = sizeof (struct overcommit_shared_info);
 
-    for (i = 0; i < maxn; i++) {
-        struct overcommit_job_info *j = &ctx->shared->users[i];
+    return ((len + pagesize - 1) / pagesize * pagesize);
+}
 
-        if ((j->jobid == ctx->jobid)
-           && ((ctx->stepid < 0) || (j->stepid == ctx->stepid))) {
-            memset (j, 0, sizeof (*j));
-            ctx->shared->nusers--;
-            return (0);
+static size_t shared_file_size (int nslots)
+{
+    return (header_size () + nslots * sizeof (struct overcommit_job_info));
+}
+
+/****************************************************************************
+ *  Stale entries
+ ****************************************************************************/
+
+/*
+ *  Return the start time of process [pid] from /proc/[pid]/stat, so
+ *   that a registration isn't kept alive by an unrelated process that
+ *   has reused the pid. Returns 0 if it can't be read.
+ */
+static unsigned long long pid_start_time (pid_t pid)
+{
+    unsigned long long start = 0;
+    char buf [4096];
+    char *p;
+    int fd, n, i;
+
+    snprintf (buf, sizeof (buf), "/proc/%d/stat", (int) pid);
+    if ((fd = open (buf, O_RDONLY)) < 0)
+        return (0);
+    n = read (fd, buf, sizeof (buf) - 1);
+    close (fd);
+    if (n <= 0)
+        return (0);
+    buf [n] = '\0';
+
+    /*
+     *  starttime is field 22. Skip "pid (comm)", which may contain
+     *   spaces, then fields 3 through 21.
+     */
+    if (!(p = strrchr (buf, ')')))
+        return (0);
+    for (i = 2; i < 22 && p; i++)
+        p = strchr (p + 1, ' ');
+    if (p)
+        start = strtoull (p + 1, NULL, 10);
+
+    return (start);
+}
+
+static int job_is_stale (struct overcommit_job_info *j)
+{
+    if (j->pid <= 0)
+        return (0);
+
+    if ((kill (j->pid, 0) < 0) && (errno == ESRCH))
+        return (1);
+
+    return (j->start && (pid_start_time (j->pid) != j->start));
+}
+
+/****************************************************************************
+ *  Hash table
+ ****************************************************************************/
+
+static unsigned int job_hash (int jobid, int stepid)
+{
+    uint32_t h = (uint32_t) jobid * 2654435761U;
+    return (h ^ ((uint32_t) stepid * 40503U));
+}
+
+static void slot_insert (struct overcommit_job_info *slots, int nslots,
+        struct overcommit_job_info *j)
+{
+    unsigned int i = job_hash (j->jobid, j->stepid) & (nslots - 1);
+
+    while (slots[i].used)
+        i = (i + 1) & (nslots - 1);
+
+    slots[i] = *j;
+}
+
+/*
+ *  Remove slot [i], moving later entries of its probe sequence back
+ *   so that no lookup has to step over a hole.
+ */
+static void slot_remove (struct overcommit_job_info *slots, int nslots,
+        unsigned int i)
+{
+    unsigned int mask = nslots - 1;
+    unsigned int j = i;
+
+    for (;;) {
+        unsigned int k;
+
+        j = (j + 1) & mask;
+        if (!slots[j].used)
+            break;
+
+        /*  Leave entry j if its home slot k lies cyclically in (i, j]
+         */
+        k = job_hash (slots[j].jobid, slots[j].stepid) & mask;
+        if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            continue;
+
+        slots[i] = slots[j];
+        i = j;
+    }
+
+    memset (&slots[i], 0, sizeof (slots[i]));
+}
+
+static int map_slots (overcommit_shared_ctx_t ctx)
+{
+    int n = ctx->shared->nslots;
+    void *p;
+
+    if (ctx->slots && ctx->nslots == n)
+        return (0);
+
+    if (ctx->slots)
+        munmap (ctx->slots, ctx->nslots * sizeof (*ctx->slots));
+    ctx->slots = NULL;
+    ctx->nslots = 0;
+
+    p = mmap (0, n * sizeof (*ctx->slots), PROT_READ|PROT_WRITE, MAP_SHARED,
+              ctx->fd, header_size ());
+    if (p == MAP_FAILED) {
+        fprintf (stderr, "mmap (%s): %s\n", shared_filename, strerror (errno));
+        return (-1);
+    }
+
+    ctx->slots = p;
+    ctx->nslots = n;
+    return (0);
+}
+
+/*
+ *  Rebuild the table with [nslots] slots, dropping stale entries if
+ *   [reap] is set. Entries are collected before the table is rewritten,
+ *   so this also repairs a table left inconsistent by a process that
+ *   died while holding the lock.
+ */
+static int rehash (overcommit_shared_ctx_t ctx, int nslots, int reap)
+{
+    struct overcommit_job_info *jobs;
+    int i, n = 0;
+
+    if (!(jobs = malloc (ctx->nslots * sizeof (*jobs))))
+        return (-1);
+
+    for (i = 0; i < ctx->nslots; i++) {
+        struct overcommit_job_info *j = &ctx->slots[i];
+        if (!j->used)
+            continue;
+        if (reap && job_is_stale (j)) {
+            fprintf (stderr, "overcommit: removing stale job %d.%d (pid %d)\n",
+                     j->jobid, j->stepid, (int) j->pid);
+            continue;
         }
+        jobs[n++] = *j;
+    }
+
+    while (nslots < 2 * n || nslots < MIN_SLOTS)
+        nslots *= 2;
+
+    if (nslots > ctx->nslots) {
+        if (ftruncate (ctx->fd, shared_file_size (nslots)) < 0) {
+            fprintf (stderr, "ftruncate (%s): %s\n", 
+                     shared_filename, strerror (errno));
+            free (jobs);
+            return (-1);
+        }
+        ctx->shared->nslots = nslots;
+        if (map_slots (ctx) < 0) {
+            free (jobs);
+            return (-1);
+        }
+    }
+
+    memset (ctx->slots, 0, ctx->nslots * sizeof (*ctx->slots));
+    for (i = 0; i < n; i++)
+        slot_insert (ctx->slots, ctx->nslots, &jobs[i]);
+    ctx->shared->nusers = n;
+
+    free (jobs);
+    return (0);
+}
+
+/*
+ *  Find the slot of the current job step, or any step of the job if
+ *   stepid < 0.
+ */
+static int find_job (overcommit_shared_ctx_t ctx)
+{
+    unsigned int mask = ctx->nslots - 1;
+    unsigned int i;
+
+    if (ctx->stepid < 0) {
+        for (i = 0; i < ctx->nslots; i++)
+            if (ctx->slots[i].used && ctx->slots[i].jobid == ctx->jobid)
+                return (i);
+        return (-1);
+    }
+
+    i = job_hash (ctx->jobid, ctx->stepid) & mask;
+    while (ctx->slots[i].used) {
+        if (  (ctx->slots[i].jobid == ctx->jobid) 
+           && (ctx->slots[i].stepid == ctx->stepid))
+            return (i);
+        i = (i + 1) & mask;
     }
 
     return (-1);
 }
 
-static int register_job (overcommit_shared_ctx_t ctx)
+static int 
+unregister_job (overcommit_shared_ctx_t ctx)
 {
     int i;
-    int maxn = sizeof (ctx->shared->users) / sizeof (int);
-
-    for (i = 0; i < maxn; i++) {
-        struct overcommit_job_info *j = &ctx->shared->users[i];
-        if (!j->used) {
-            j->used = 1;
-            j->jobid = ctx->jobid;
-            j->stepid = ctx->stepid;
-            ctx->shared->nusers++;
-            return (0);
-        }
+
+    if ((i = find_job (ctx)) < 0)
+        return (-1);
+
+    slot_remove (ctx->slots, ctx->nslots, i);
+    ctx->shared->nusers--;
+    return (0);
+}
+
+static int register_job (overcommit_shared_ctx_t ctx)
+{
+    struct overcommit_job_info j;
+
+    /*
+     *  Before growing the table, make room by dropping registrations
+     *   of job steps whose slurmstepd has gone away.
+     */
+    if (2 * (ctx->shared->nusers + 1) > ctx->nslots) {
+        if (rehash (ctx, ctx->nslots, 1) < 0)
+            return (-1);
+        if (  (2 * (ctx->shared->nusers + 1) > ctx->nslots)
+           && (rehash (ctx, 2 * ctx->nslots, 0) < 0))
+            return (-1);
     }
 
-    return (-1);
+    memset (&j, 0, sizeof (j));
+    j.used = 1;
+    j.jobid = ctx->jobid;
+    j.stepid = ctx->stepid;
+    j.pid = getpid ();
+    j.start = pid_start_time (j.pid);
+
+    slot_insert (ctx->slots, ctx->nslots, &j);
+    ctx->shared->nusers++;
+    return (0);
 }
 
+/****************************************************************************
+ *  Locking
+ ****************************************************************************/
+
+static void shared_unlock (overcommit_shared_ctx_t ctx)
+{
+    if (ctx->locked)
+        pthread_mutex_unlock (&ctx->shared->mutex);
+    ctx->locked = 0;
+}
+
+static int shared_lock (overcommit_shared_ctx_t ctx)
+{
+    int recovered = 0;
+    int e;
+
+    if ((e = pthread_mutex_lock (&ctx->shared->mutex)) == EOWNERDEAD) {
+        /*
+         *  Previous holder died with the lock held. Repair the table
+         *   below before anyone else sees it.
+         */
+        pthread_mutex_consistent (&ctx->shared->mutex);
+        recovered = 1;
+    }
+    else if (e != 0) {
+        fprintf (stderr, "overcommit: pthread_mutex_lock: %s\n", strerror (e));
+        return (-1);
+    }
+
+    ctx->locked = 1;
+
+    if (map_slots (ctx) < 0) {
+        shared_unlock (ctx);
+        return (-1);
+    }
+
+    if (recovered) {
+        fprintf (stderr, "overcommit: recovering shared state\n");
+        if (rehash (ctx, ctx->nslots, 1) < 0)
+            return (-1);
+    }
+
+    return (0);
+}
+
+/****************************************************************************
+ *  Shared file
+ ****************************************************************************/
+
 static int overcommit_shared_file_initialized (overcommit_shared_ctx_t ctx)
 {
     struct stat st;
@@ -116,80 +403,166 @@ static int overcommit_shared_file_initialized (overcommit_shared_ctx_t ctx)
         return (-1);
     }
 
-    if (st.st_size == sizeof (*ctx->shared))
-        return (1);
+    if (st.st_size < shared_file_size (MIN_SLOTS))
+        return (0);
 
-    return (0);
+    if (  (ctx->shared->magic != OVERCOMMIT_MAGIC)
+       || (ctx->shared->nslots < MIN_SLOTS)
+       || (ctx->shared->nslots & (ctx->shared->nslots - 1))
+       || (st.st_size < shared_file_size (ctx->shared->nslots)))
+        return (0);
+
+    return (1);
+}
+
+static int shared_mutex_init (pthread_mutex_t *m)
+{
+    pthread_mutexattr_t attr;
+    int e;
+
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+
+    if ((e = pthread_mutex_init (m, &attr)) != 0)
+        fprintf (stderr, "pthread_mutex_init: %s\n", strerror (e));
+
+    pthread_mutexattr_destroy (&attr);
+
+    return (e ? -1 : 0);
 }
 
 static int overcommit_shared_info_init (overcommit_shared_ctx_t ctx)
 {
-    int len = sizeof (*ctx->shared);
+    size_t len = header_size ();
+    struct stat st;
     int initialized;
+    int rc = -1;
 
     if (ctx->fd < 0) {
         fprintf (stderr, "ctx->fd < 0!\n");
         return (-1);
     }
-    if (fd_get_write_lock (ctx->fd) < 0)
+    if (fd_get_writew_lock (ctx->fd) < 0)
         fprintf (stderr, "Failed to get write lock: %s\n", strerror (errno));
 
     if (fd_set_close_on_exec (ctx->fd))
         fprintf (stderr, "fd_set_close_on_exec(): %s\n", strerror (errno));
 
-    if ((initialized = overcommit_shared_file_initialized (ctx)) < 0)
-        return (-1);
+    /*
+     *  Make sure the header can be mapped before checking its contents
+     */
+    if (fstat (ctx->fd, &st) < 0) {
+        fprintf (stderr, "fstat (%s): %s\n", shared_filename, strerror (errno));
+        goto out;
+    }
 
-    if (!initialized) 
-        ftruncate (ctx->fd, len);
+    if (  (st.st_size < shared_file_size (MIN_SLOTS))
+       && (ftruncate (ctx->fd, shared_file_size (MIN_SLOTS)) < 0)) {
+        fprintf (stderr, "ftruncate (%s): %s\n", 
+                 shared_filename, strerror (errno));
+        goto out;
+    }
 
     ctx->shared = mmap (0, len, PROT_READ|PROT_WRITE, MAP_SHARED, ctx->fd, 0);
 
     if (ctx->shared == MAP_FAILED) {
         fprintf (stderr, "mmap (%s): %s\n", shared_filename, strerror (errno));
-        return (-1);
+        ctx->shared = NULL;
+        goto out;
     }
 
+    if ((initialized = overcommit_shared_file_initialized (ctx)) < 0)
+        goto out;
+
     if (!initialized) {
         memset (ctx->shared, 0, len);
 
-        if (sem_init (&ctx->shared->sem, 1, 1) < 0) {
-            fprintf (stderr, "sem_init: %s\n", strerror (errno));
-            return (-1);
+        if (ftruncate (ctx->fd, 0) < 0 
+           || ftruncate (ctx->fd, shared_file_size (MIN_SLOTS)) < 0) {
+            fprintf (stderr, "ftruncate (%s): %s\n", 
+                     shared_filename, strerror (errno));
+            goto out;
         }
+
+        if (shared_mutex_init (&ctx->shared->mutex) < 0)
+            goto out;
+
+        ctx->shared->nslots = MIN_SLOTS;
+        ctx->shared->magic = OVERCOMMIT_MAGIC;
     }
 
+    rc = 0;
+out:
     if (fd_release_lock (ctx->fd) < 0)
         fprintf (stderr, "Failed to release file lock: %s\n", strerror (errno));
 
-    return (0);
+    return (rc);
+}
+
+/*
+ *  Open the shared file, creating it if [create] is set, and return
+ *   with its lock held. The last user removes the file, so retry if
+ *   that happened while we were waiting for the lock.
+ */
+static int shared_file_open (overcommit_shared_ctx_t ctx, int create)
+{
+    int flags = O_RDWR | O_CREAT | O_EXCL;
+    struct stat st;
+
+    for (;;) {
+        if (!create)
+            ctx->fd = open (shared_filename, O_RDWR);
+        else if ((ctx->fd = open (shared_filename, flags, 0600)) < 0) {
+            if (errno == EEXIST)
+                ctx->fd = open (shared_filename, O_RDWR);
+        }
+        if (ctx->fd < 0) {
+            if (create || errno != ENOENT)
+                fprintf (stderr, "Failed to open overcommit shared info: %s\n",
+                         strerror (errno));
+            return (-1);
+        }
+
+        if (  (overcommit_shared_info_init (ctx) < 0)
+           || (shared_lock (ctx) < 0))
+            return (-1);
+
+        if ((fstat (ctx->fd, &st) == 0) && (st.st_nlink > 0))
+            return (0);
+
+        shared_unlock (ctx);
+        if (ctx->slots)
+            munmap (ctx->slots, ctx->nslots * sizeof (*ctx->slots));
+        munmap (ctx->shared, header_size ());
+        close (ctx->fd);
+        ctx->slots = NULL;
+        ctx->nslots = 0;
+        ctx->shared = NULL;
+    }
 }
 
 overcommit_shared_ctx_t overcommit_shared_ctx_attach ()
 {
     overcommit_shared_ctx_t ctx = malloc (sizeof (*ctx));
 
+    if (!ctx)
+        return (NULL);
+
     memset (ctx, 0, sizeof (*ctx));
     ctx->jobid = ctx->stepid = -1;
 
-    if ((ctx->fd = open (shared_filename, O_RDWR)) < 0) 
-        return (NULL);
-
-    if (overcommit_shared_info_init (ctx) < 0) {
+    if (shared_file_open (ctx, 0) < 0) {
         overcommit_shared_ctx_destroy (ctx);
         return (NULL);
     }
 
-    sem_wait (&ctx->shared->sem);
-
     return (ctx);
 }
 
 overcommit_shared_ctx_t 
 overcommit_shared_ctx_create (int jobid, int stepid)
 {
-    int flags = O_RDWR | O_CREAT | O_EXCL;
-
     overcommit_shared_ctx_t ctx = malloc (sizeof (*ctx));
 
     if (!ctx)
@@ -199,24 +572,11 @@ overcommit_shared_ctx_create (int jobid, int stepid)
     ctx->jobid = jobid;
     ctx->stepid = stepid;
 
-    if ((ctx->fd = open (shared_filename, flags, 0600)) < 0) {
-        if ((errno != EEXIST) 
-            || ((ctx->fd = open (shared_filename, O_RDWR)) < 0)) {
-            fprintf (stderr, "Failed to open overcommit shared info: %s",
-                    strerror (errno));
-            overcommit_shared_ctx_destroy (ctx);
-            return (NULL);
-        }
-    }
-
-
-    if (overcommit_shared_info_init (ctx) < 0) {
+    if (shared_file_open (ctx, 1) < 0) {
         overcommit_shared_ctx_destroy (ctx);
-        return (0);
+        return (NULL);
     }
 
-    sem_wait (&ctx->shared->sem);
-
     return (ctx);
 }
 
@@ -228,6 +588,7 @@ int overcommit_shared_cleanup (int jobid, int stepid)
 
     if ((ctx = overcommit_shared_ctx_create (jobid, stepid))) {
         rc = unregister_job (ctx);
+        rehash (ctx, ctx->nslots, 1);
         overcommit_shared_ctx_destroy (ctx);
     } else if (overcommit_memory_get_current_state () != 0) {
         overcommit_memory_set_current_state (0);
@@ -249,22 +610,26 @@ int overcommit_force_cleanup ()
 
 void overcommit_shared_ctx_destroy (overcommit_shared_ctx_t ctx)
 {
-    if (ctx->shared->nusers == 0) {
+    if (ctx->shared && ctx->locked && ctx->shared->nusers == 0) {
         unlink (shared_filename);
         if (overcommit_memory_get_current_state () != 0)
            overcommit_memory_set_current_state (0);
         overcommit_ratio_set (ctx->shared->previous_overcommit_ratio);
     }
-    sem_post (&ctx->shared->sem);
-    munmap (ctx->shared, sizeof (*ctx->shared));
-    close (ctx->fd);
+    shared_unlock (ctx);
+    if (ctx->slots)
+        munmap (ctx->slots, ctx->nslots * sizeof (*ctx->slots));
+    if (ctx->shared)
+        munmap (ctx->shared, header_size ());
+    if (ctx->fd >= 0)
+        close (ctx->fd);
     free (ctx);
 }
 
 void overcommit_shared_ctx_unregister (overcommit_shared_ctx_t ctx)
 {
-    sem_wait (&ctx->shared->sem);
-    unregister_job (ctx);
+    if (shared_lock (ctx) == 0)
+        unregister_job (ctx);
     overcommit_shared_ctx_destroy (ctx);
 }
 
@@ -272,18 +637,25 @@ int overcommit_shared_list_users ()
 {
     overcommit_shared_ctx_t ctx;
     int i;
-    int maxn = sizeof (ctx->shared->users) / sizeof (int);
 
-    if (!(ctx = overcommit_shared_ctx_attach ()) || ctx->shared->nusers == 0) {
+    if (!(ctx = overcommit_shared_ctx_attach ())) {
+        fprintf (stdout, "No users currently using overcommit-memory\n");
+        return (0);
+    }
+
+    rehash (ctx, ctx->nslots, 1);
+
+    if (ctx->shared->nusers == 0) {
         fprintf (stdout, "No users currently using overcommit-memory\n");
+        overcommit_shared_ctx_destroy (ctx);
         return (0);
     }
 
     fprintf (stdout, "%d users of overcommit-memory on this node:\n", 
             ctx->shared->nusers);
 
-    for (i = 0; i < maxn; i++) {
-        struct overcommit_job_info *j = &ctx->shared->users[i];
+    for (i = 0; i < ctx->nslots; i++) {
+        struct overcommit_job_info *j = &ctx->slots[i];
         if (j->used)
             fprintf (stdout, "%d.%d\n", j->jobid, j->stepid);
     }
@@ -308,9 +680,10 @@ int overcommit_in_use (overcommit_shared_ctx_t ctx, int value)
             ctx->shared->overcommit_value = value;
             ctx->shared->previous_overcommit_ratio = overcommit_ratio_get ();
         }
-        register_job (ctx);
+        if (register_job (ctx) < 0)
+            rc = -1;
     }
-    sem_post (&ctx->shared->sem);
+    shared_unlock (ctx);
 
     return (rc);
 }
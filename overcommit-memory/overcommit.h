@@ -25,6 +25,8 @@
 #ifndef _HAVE_OVERCOMMIT_H
 #define _HAVE_OVERCOMMIT_H
 
+#include <sys/types.h>
+
 typedef struct overcommit_shared_context * overcommit_shared_ctx_t;
 
 overcommit_shared_ctx_t overcommit_shared_ctx_create (int jobid, int stepid);
@@ -44,4 +46,49 @@ int overcommit_memory_set_current_state (int value);
 int overcommit_ratio_get ();
 int overcommit_ratio_set (int value);
 
+/*
+ *  Apply overcommit [mode] and [ratio] to the memory cgroup of job
+ *   [jobid] step [stepid] found under cgroup mount [root], instead of
+ *   the node-wide sysctls.
+ */
+int overcommit_cgroup_set (const char *root, int jobid, int stepid,
+                           int mode, int ratio);
+
+/*
+ *  Committed_AS monitor:
+ */
+struct overcommit_sample {
+    unsigned long long committed;     /* Node Committed_AS in kB          */
+    unsigned long long commit_limit;  /* Node CommitLimit in kB           */
+    unsigned long long job_committed; /* kB committed by job processes    */
+};
+
+#define OVERCOMMIT_MAX_THRESHOLDS 8
+
+struct overcommit_monitor_conf {
+    const char *proc_root;      /* Where proc is mounted, e.g. "/proc"  */
+    const char *logfile;        /* Telemetry file, or NULL              */
+    int jobid;
+    int stepid;
+    pid_t root_pid;             /* Job processes are descendants of pid */
+    uid_t uid;                  /* Run monitor as uid/gid if not -1     */
+    gid_t gid;
+    int interval;               /* Seconds between samples              */
+    int nthresholds;            /* Soft thresholds, percent of          */
+    int thresholds [OVERCOMMIT_MAX_THRESHOLDS]; /*  CommitLimit, sorted */
+};
+
+/*
+ *  Fill in [s] from [proc_root]/meminfo and, if [root] > 0, from the
+ *   status of every process descended from [root].
+ */
+int overcommit_sample (const char *proc_root, pid_t root,
+                       struct overcommit_sample *s);
+
+/*
+ *  Start a background monitor that runs until the calling process
+ *   exits and reports on stderr whenever usage crosses a threshold.
+ */
+int overcommit_monitor_start (struct overcommit_monitor_conf *conf);
+
 #endif /* !_HAVE_OVERCOMMIT_H */
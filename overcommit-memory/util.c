@@ -35,6 +35,9 @@ static int cleanup = 0;
 static int list_users = 0;
 static int force_reset = 0;
 static int jobid = -1;
+static int sample = 0;
+static int sample_pid = 0;
+static const char *proc_root = "/proc";
 
 #define __GNU_SOURCE
 #include <getopt.h>
@@ -45,10 +48,13 @@ struct option opt_table [] = {
     { "list-users",   0, NULL, 'l' },
     { "force-reset",  0, NULL, 'f' },
     { "jobid",        1, NULL, 'j' },
+    { "sample",       0, NULL, 's' },
+    { "pid",          1, NULL, 'p' },
+    { "proc-root",    1, NULL, 'P' },
     { NULL,           0, NULL,  0  }
 };
 
-const char opt_string[] = "hclfj:";
+const char opt_string[] = "hclfj:sp:P:";
 
 #define USAGE "\
 Usage: %s [OPTONS]\n\
@@ -63,7 +69,12 @@ Usage: %s [OPTONS]\n\
                        overcommit_memory setting to default and remove\n\
                        overcommit shared file.\n\
  -j, --jobid=ID       Specify SLURM jobid to clean up after if SLURM_JOBID\n\
-                       not set in environment\n"
+                       not set in environment\n\
+ -s, --sample         Print current Committed_AS and CommitLimit, as seen\n\
+                       by the overcommit-memory monitor.\n\
+ -p, --pid=PID        With --sample, also print memory committed by all\n\
+                       descendants of PID (e.g. a slurmstepd).\n\
+ -P, --proc-root=DIR  Read proc files from DIR instead of /proc.\n"
 
 static int get_env_int (const char *var);
 static int str2int (const char *str);
@@ -84,8 +95,20 @@ int main (int ac, char *av[])
     if (cleanup && jobid < 0)
         log_fatal ("--cleanup requires SLURM_JOBID in environment\n");
 
-    if (!cleanup && !list_users && !force_reset) 
-        log_fatal ("Specify one of --cleanup, --force-reset, or --list-users.\n");
+    if (!cleanup && !list_users && !force_reset && !sample) 
+        log_fatal ("Specify one of --cleanup, --force-reset, --list-users, "
+                   "or --sample.\n");
+
+    if (sample) {
+        struct overcommit_sample s;
+        if (overcommit_sample (proc_root, sample_pid, &s) < 0)
+            log_fatal ("Failed to read %s/meminfo\n", proc_root);
+        printf ("Committed_AS: %llu kB\n", s.committed);
+        printf ("CommitLimit:  %llu kB\n", s.commit_limit);
+        if (sample_pid > 0)
+            printf ("Committed by descendants of %d: %llu kB\n",
+                    sample_pid, s.job_committed);
+    }
 
     if (list_users)
         overcommit_shared_list_users ();
@@ -142,6 +165,16 @@ static int parse_cmdline (int ac, char **av)
                 if ((jobid = str2int (optarg)) < 0)
                     log_fatal ("Invalid argument: --jobid=%s\n", optarg);
                 break;
+            case 's':
+                sample = 1;
+                break;
+            case 'p':
+                if ((sample_pid = str2int (optarg)) <= 0)
+                    log_fatal ("Invalid argument: --pid=%s\n", optarg);
+                break;
+            case 'P':
+                proc_root = optarg;
+                break;
             case '?':
                 if (optopt > 0)
                     fprintf (stderr, "%s: Invalid option \"-%c\"\n", 
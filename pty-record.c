@@ -0,0 +1,477 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pty-record.h"
+
+/*
+ *  Each entry in the ring is a struct rec_hdr followed by [len] bytes
+ *   of data, and may wrap around the end of the buffer. [head] and
+ *   [tail] count bytes ever written and consumed. The relay is the
+ *   only producer and the writer thread the only consumer, so each
+ *   index is only ever stored by one side.
+ */
+enum { REC_OUTPUT = 'o', REC_RESIZE = 'r', REC_MARKER = 'm' };
+
+#define REC_MIN_BUFSIZE (128 * 1024)
+#define REC_MAX_DATA    65536
+
+struct rec_hdr {
+	uint64_t usec;          /* Time since start of recording          */
+	uint32_t len;
+	uint32_t type;
+};
+
+struct pty_record {
+	enum pty_record_format fmt;
+	FILE *fp;
+	size_t maxsize;
+	size_t written;
+	int full;
+
+	struct timespec start;
+
+	char *ring;
+	size_t size;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t dropped;       /* Bytes of output not recorded          */
+	int done;
+	int efd;                /* Wakes the writer                       */
+
+	uint64_t reported;      /* Writer: dropped bytes already noted    */
+	unsigned char partial[4]; /* Writer: incomplete UTF-8 sequence    */
+	size_t npartial;
+
+	pthread_t thread;
+};
+
+static uint64_t rec_usec (struct pty_record *r)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((uint64_t) (now.tv_sec - r->start.tv_sec) * 1000000
+	        + (now.tv_nsec - r->start.tv_nsec) / 1000);
+}
+
+static void ring_copy_in (struct pty_record *r, uint64_t pos,
+                          const void *src, size_t len)
+{
+	size_t off = pos % r->size;
+	size_t n = len < r->size - off ? len : r->size - off;
+
+	memcpy (r->ring + off, src, n);
+	memcpy (r->ring, (const char *) src + n, len - n);
+}
+
+static void ring_copy_out (struct pty_record *r, uint64_t pos,
+                           void *dst, size_t len)
+{
+	size_t off = pos % r->size;
+	size_t n = len < r->size - off ? len : r->size - off;
+
+	memcpy (dst, r->ring + off, n);
+	memcpy ((char *) dst + n, r->ring, len - n);
+}
+
+static void rec_push (struct pty_record *r, int type,
+                      const void *data, size_t len)
+{
+	struct rec_hdr h;
+	uint64_t head = r->head;
+	uint64_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (len > REC_MAX_DATA
+	    || sizeof (h) + len > r->size - (head - tail)) {
+		__atomic_add_fetch (&r->dropped, len, __ATOMIC_RELAXED);
+		return;
+	}
+
+	h.usec = rec_usec (r);
+	h.len = len;
+	h.type = type;
+	ring_copy_in (r, head, &h, sizeof (h));
+	ring_copy_in (r, head + sizeof (h), data, len);
+	__atomic_store_n (&r->head, head + sizeof (h) + len, __ATOMIC_SEQ_CST);
+
+	/*
+	 *  Only wake the writer if it may have found the ring empty.
+	 */
+	if (__atomic_load_n (&r->tail, __ATOMIC_SEQ_CST) == head)
+		while (write (r->efd, &one, sizeof (one)) < 0 && errno == EINTR)
+			;
+}
+
+/*
+ *  A single read may exceed REC_MAX_DATA where pipes are larger
+ *   (e.g. 1M on 64K page kernels), so record it in pieces.
+ */
+void pty_record_output (struct pty_record *r, const void *data, size_t len)
+{
+	const char *p = data;
+
+	if (!r)
+		return;
+	while (len > 0) {
+		size_t n = len < REC_MAX_DATA ? len : REC_MAX_DATA;
+		rec_push (r, REC_OUTPUT, p, n);
+		p += n;
+		len -= n;
+	}
+}
+
+void pty_record_resize (struct pty_record *r, int rows, int cols)
+{
+	char buf [32];
+	int n;
+
+	if (!r)
+		return;
+	n = snprintf (buf, sizeof (buf), "%dx%d", cols, rows);
+	rec_push (r, REC_RESIZE, buf, n);
+}
+
+/****************************************************************************
+ *  Writer
+ ****************************************************************************/
+
+static void rec_write (struct pty_record *r, const void *p, size_t len)
+{
+	if (r->full)
+		return;
+	if (r->maxsize && r->written + len > r->maxsize) {
+		r->full = 1;
+		return;
+	}
+	if (fwrite (p, 1, len, r->fp) == len)
+		r->written += len;
+	else
+		r->full = 1;
+}
+
+/*
+ *  Length of the UTF-8 sequence at [p], or 0 if invalid, or -1 if it's
+ *   valid so far but continues beyond [len] bytes.
+ */
+static int utf8_seqlen (const unsigned char *p, size_t len)
+{
+	int n, i;
+
+	if (p[0] < 0x80)
+		return (1);
+	else if ((p[0] & 0xe0) == 0xc0 && p[0] >= 0xc2)
+		n = 2;
+	else if ((p[0] & 0xf0) == 0xe0)
+		n = 3;
+	else if ((p[0] & 0xf8) == 0xf0 && p[0] <= 0xf4)
+		n = 4;
+	else
+		return (0);
+
+	for (i = 1; i < n; i++) {
+		if ((size_t) i >= len)
+			return (-1);
+		if ((p[i] & 0xc0) != 0x80)
+			return (0);
+	}
+	return (n);
+}
+
+/*
+ *  Append [p] to [out] as the body of a JSON string, carrying an
+ *   incomplete UTF-8 sequence at the end over to the next event.
+ *   [out] must have room for 6 * len bytes.
+ */
+static size_t json_escape (struct pty_record *r, char *out,
+                           const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *o = out;
+	size_t i = 0;
+
+	while (i < len) {
+		int n = utf8_seqlen (p + i, len - i);
+
+		if (n < 0) {
+			memcpy (r->partial, p + i, len - i);
+			r->npartial = len - i;
+			break;
+		}
+		if (n == 0) {
+			memcpy (o, "\\ufffd", 6);
+			o += 6;
+			i++;
+			continue;
+		}
+		if (n > 1) {
+			memcpy (o, p + i, n);
+			o += n;
+			i += n;
+			continue;
+		}
+
+		switch (p[i]) {
+		case '"':  *o++ = '\\'; *o++ = '"';  break;
+		case '\\': *o++ = '\\'; *o++ = '\\'; break;
+		case '\n': *o++ = '\\'; *o++ = 'n';  break;
+		case '\r': *o++ = '\\'; *o++ = 'r';  break;
+		case '\t': *o++ = '\\'; *o++ = 't';  break;
+		default:
+			if (p[i] < 0x20 || p[i] == 0x7f) {
+				memcpy (o, "\\u00", 4);
+				o[4] = hex[p[i] >> 4];
+				o[5] = hex[p[i] & 0xf];
+				o += 6;
+			}
+			else
+				*o++ = p[i];
+		}
+		i++;
+	}
+	return (o - out);
+}
+
+static void rec_write_asciicast (struct pty_record *r, struct rec_hdr *h,
+                                 const unsigned char *data, char *out)
+{
+	unsigned char joined [REC_MAX_DATA + 4];
+	char prefix [64];
+	size_t len = h->len;
+	size_t n;
+	int plen;
+
+	/*
+	 *  Prepend the tail of a UTF-8 sequence split across events.
+	 */
+	if (h->type == REC_OUTPUT && r->npartial) {
+		memcpy (joined, r->partial, r->npartial);
+		memcpy (joined + r->npartial, data, len);
+		len += r->npartial;
+		data = joined;
+	}
+	if (h->type == REC_OUTPUT)
+		r->npartial = 0;
+
+	plen = snprintf (prefix, sizeof (prefix), "[%llu.%06llu, \"%c\", \"",
+	                 (unsigned long long) (h->usec / 1000000),
+	                 (unsigned long long) (h->usec % 1000000), h->type);
+	n = json_escape (r, out, data, len);
+	if (h->type == REC_OUTPUT && n == 0)
+		return;
+
+	memcpy (out + n, "\"]\n", 3);
+	n += 3;
+
+	/*  Keep events whole when the size limit is reached */
+	if (r->maxsize && r->written + plen + n > r->maxsize)
+		r->full = 1;
+	rec_write (r, prefix, plen);
+	rec_write (r, out, n);
+}
+
+static void put32 (unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ *  Binary records: 32 bit seconds, microseconds and length in network
+ *   byte order and a one byte type, then the data.
+ */
+static void rec_write_binary (struct pty_record *r, struct rec_hdr *h,
+                              const unsigned char *data)
+{
+	unsigned char hdr [13];
+
+	put32 (hdr, h->usec / 1000000);
+	put32 (hdr + 4, h->usec % 1000000);
+	put32 (hdr + 8, h->len);
+	hdr[12] = h->type;
+
+	if (r->maxsize && r->written + sizeof (hdr) + h->len > r->maxsize)
+		r->full = 1;
+	rec_write (r, hdr, sizeof (hdr));
+	rec_write (r, data, h->len);
+}
+
+static void rec_write_entry (struct pty_record *r, struct rec_hdr *h,
+                             const unsigned char *data, char *out)
+{
+	if (r->fmt == PTY_RECORD_BINARY)
+		rec_write_binary (r, h, data);
+	else
+		rec_write_asciicast (r, h, data, out);
+}
+
+static void rec_note_dropped (struct pty_record *r, char *out)
+{
+	uint64_t dropped = __atomic_load_n (&r->dropped, __ATOMIC_RELAXED);
+	struct rec_hdr h;
+	char msg [64];
+
+	if (dropped == r->reported)
+		return;
+
+	h.usec = rec_usec (r);
+	h.type = REC_MARKER;
+	h.len = snprintf (msg, sizeof (msg), "%llu bytes not recorded",
+	                  (unsigned long long) (dropped - r->reported));
+	r->reported = dropped;
+	rec_write_entry (r, &h, (unsigned char *) msg, out);
+}
+
+static void * rec_writer (void *arg)
+{
+	struct pty_record *r = arg;
+	unsigned char *data = malloc (REC_MAX_DATA);
+	char *out = malloc (6 * (REC_MAX_DATA + 4) + 4);
+	uint64_t tail = r->tail;
+
+	if (!data || !out)
+		goto done;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n (&r->head, __ATOMIC_SEQ_CST);
+		struct rec_hdr h;
+
+		if (head == tail) {
+			uint64_t val;
+
+			rec_note_dropped (r, out);
+			fflush (r->fp);
+			if (__atomic_load_n (&r->done, __ATOMIC_SEQ_CST)
+			    && __atomic_load_n (&r->head, __ATOMIC_SEQ_CST) == tail)
+				break;
+			while (read (r->efd, &val, sizeof (val)) < 0
+			       && errno == EINTR)
+				;
+			continue;
+		}
+
+		ring_copy_out (r, tail, &h, sizeof (h));
+		ring_copy_out (r, tail + sizeof (h), data, h.len);
+		tail += sizeof (h) + h.len;
+		__atomic_store_n (&r->tail, tail, __ATOMIC_SEQ_CST);
+
+		rec_write_entry (r, &h, data, out);
+	}
+
+done:
+	free (data);
+	free (out);
+	return (NULL);
+}
+
+static void rec_write_header (struct pty_record *r, int rows, int cols)
+{
+	char buf [256];
+	int n;
+
+	if (r->fmt == PTY_RECORD_BINARY) {
+		unsigned char hdr [16];
+		memcpy (hdr, "PTYREC1\n", 8);
+		put32 (hdr + 8, rows);
+		put32 (hdr + 12, cols);
+		rec_write (r, hdr, sizeof (hdr));
+		return;
+	}
+
+	n = snprintf (buf, sizeof (buf),
+	              "{\"version\": 2, \"width\": %d, \"height\": %d, "
+	              "\"timestamp\": %ld}\n",
+	              cols > 0 ? cols : 80, rows > 0 ? rows : 24,
+	              (long) time (NULL));
+	rec_write (r, buf, n);
+}
+
+struct pty_record * pty_record_create (int fd, enum pty_record_format fmt,
+                                       size_t bufsize, size_t maxsize,
+                                       int rows, int cols)
+{
+	struct pty_record *r;
+
+	if (!(r = calloc (1, sizeof (*r))))
+		return (NULL);
+
+	r->fmt = fmt;
+	r->maxsize = maxsize;
+	r->size = bufsize < REC_MIN_BUFSIZE ? REC_MIN_BUFSIZE : bufsize;
+	r->efd = -1;
+	clock_gettime (CLOCK_MONOTONIC, &r->start);
+
+	if (!(r->ring = malloc (r->size))
+	    || (r->efd = eventfd (0, EFD_CLOEXEC)) < 0
+	    || !(r->fp = fdopen (fd, "w")))
+		goto fail;
+
+	rec_write_header (r, rows, cols);
+
+	if (pthread_create (&r->thread, NULL, rec_writer, r) != 0)
+		goto fail;
+
+	return (r);
+
+fail:
+	if (r->fp)
+		fclose (r->fp);
+	else
+		close (fd);
+	if (r->efd >= 0)
+		close (r->efd);
+	free (r->ring);
+	free (r);
+	return (NULL);
+}
+
+void pty_record_destroy (struct pty_record *r)
+{
+	uint64_t one = 1;
+
+	if (!r)
+		return;
+
+	__atomic_store_n (&r->done, 1, __ATOMIC_SEQ_CST);
+	while (write (r->efd, &one, sizeof (one)) < 0 && errno == EINTR)
+		;
+	pthread_join (r->thread, NULL);
+
+	fclose (r->fp);
+	close (r->efd);
+	free (r->ring);
+	free (r);
+}
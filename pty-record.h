@@ -0,0 +1,69 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ * 
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ * 
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#ifndef _PTY_RECORD_H
+#define _PTY_RECORD_H
+
+#include <sys/types.h>
+
+/*
+ *  Session recording for the pty plugin.
+ *
+ *  Data handed to the recorder is copied, with a timestamp, into a
+ *   preallocated ring buffer and written out to the recording file by a
+ *   background thread, so recording never blocks the caller. If the
+ *   writer falls behind and the ring fills, data is dropped and a
+ *   marker noting the loss is written instead. Nothing more is written
+ *   once the file reaches its size limit.
+ */
+enum pty_record_format {
+	PTY_RECORD_ASCIICAST,   /* asciicast v2, as used by asciinema     */
+	PTY_RECORD_BINARY,      /* "PTYREC1\n" then binary records        */
+};
+
+struct pty_record;
+
+/*
+ *  Start recording to open file [fd], which the recorder takes over.
+ *   [bufsize] is the size of the ring buffer, [maxsize] the limit on
+ *   the size of the file (0 for none), and [rows] x [cols] the
+ *   initial terminal size. Returns NULL on failure.
+ */
+struct pty_record * pty_record_create (int fd, enum pty_record_format fmt,
+                                       size_t bufsize, size_t maxsize,
+                                       int rows, int cols);
+
+/*
+ *  Record terminal output, or a change of terminal size.
+ */
+void pty_record_output (struct pty_record *r, const void *data, size_t len);
+void pty_record_resize (struct pty_record *r, int rows, int cols);
+
+/*
+ *  Write out anything still buffered, stop the writer, and close
+ *   the file.
+ */
+void pty_record_destroy (struct pty_record *r);
+
+#endif /* !_PTY_RECORD_H */
@@ -25,6 +25,7 @@
 /*
  *   Hack to run task 0 under a pty for a slurm job.
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <pty.h>
 #include <utmp.h>
@@ -38,6 +39,13 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <dirent.h>
+#include <grp.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <termios.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -50,6 +58,8 @@
 
 #include <slurm/spank.h>
 
+#include "pty-record.h"
+
 SPANK_PLUGIN (pty, 1)
 
 /*
@@ -60,15 +70,20 @@ static int master = -1;
 static int listenfd = -1;
 static pid_t pid;
 static struct termios termdefaults;
+static struct winsize winsz_initial;    /* srun's size at startup   */
+static struct winsize winsz_sent;       /* Last size sent to nodes  */
+static char pty_token [33];             /* Per-step connection key  */
 
 static int pty_opt_process (int val, const char *optarg, int remote);
 
 struct spank_option spank_options[] =
 {
-	{ "pty", NULL, 
-          "Allocate a pty for rank 0. Must also specify -u."
+	{ "pty", "[tasks]", 
+          "Allocate a pty for rank 0, or for each of [tasks] (e.g. 0,4-7"
+          " or `all'). Must also specify -u. Output of ranks other than 0"
+          " is labelled and written to srun's stdout."
           " (Use of --pty implies --output=0)", 
-	  0, 0, (spank_opt_cb_f) pty_opt_process
+	  2, 0, (spank_opt_cb_f) pty_opt_process
 	},
 	SPANK_OPTIONS_TABLE_END
 };
@@ -91,62 +106,186 @@ static void pty_winsz_unpack (struct pty_winsz *w)
 	w->cols = ntohl (w->cols);
 }
 
-static int pty_opt_process (int val, const char *optarg, int remote) 
+/*
+ *  The connect-back socket carries framed messages, a struct pty_msg
+ *   header in network byte order followed by [len] bytes of payload.
+ *   Each node running selected tasks opens a single connection to
+ *   srun, over which the output of all of its ptys is multiplexed.
+ */
+enum {
+	PTY_MSG_DATA  = 1,          /* node -> srun: output from task's pty */
+	PTY_MSG_EOF   = 2,          /* node -> srun: task's pty closed      */
+	PTY_MSG_WINSZ = 3,          /* srun -> node: struct pty_winsz       */
+	PTY_MSG_AUTH  = 4,          /* node -> srun: SLURM_PTY_TOKEN, first */
+};
+
+#define PTY_ALL_TASKS 0xffffffffU
+#define PTY_MSG_MAX   65536
+
+struct pty_msg {
+	uint32_t type;
+	uint32_t task;
+	uint32_t len;
+};
+
+struct pty_msg_reader {
+	int fd;
+	size_t len;
+	unsigned char buf [sizeof (struct pty_msg) + PTY_MSG_MAX];
+};
+
+typedef void (*pty_msg_f) (struct pty_msg *msg, void *data, void *arg);
+
+static int write_all (int fd, const void *buf, size_t len)
 {
-	do_pty = 1;
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write (fd, p, len);
+		if (n < 0) {
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && poll (&pfd, 1, -1) >= 0)
+				continue;
+			return (-1);
+		}
+		p += n;
+		len -= n;
+	}
 	return (0);
 }
 
-void process_pty ()
+static int pty_msg_send (int fd, uint32_t type, uint32_t task,
+                         const void *data, size_t len)
 {
-	unsigned char buf [4096];
-	int len;
+	struct pty_msg msg;
 
-	if ((len = read (master, buf, sizeof (buf))) < 0) {
-		if (errno == EAGAIN)
-			return;
-		if (errno == EIO) /* Why do we get this sometimes */
-			return;
-		slurm_error ("read (pty master): %m\n");
-		exit (1);
-	}
-	else if (len == 0) {
-		close (STDOUT_FILENO);
-		close (master);
-		master = -1;
-		return;
-	}
+	msg.type = htonl (type);
+	msg.task = htonl (task);
+	msg.len = htonl (len);
 
-	write (STDOUT_FILENO, buf, len);
+	if (write_all (fd, &msg, sizeof (msg)) < 0
+	    || (len && write_all (fd, data, len) < 0))
+		return (-1);
+	return (0);
 }
 
-void process_stdin ()
+/*
+ *  Read what is available on [r->fd] and call [fn] for each complete
+ *   message. Returns -1 on EOF, error, or a malformed message.
+ */
+static int pty_msg_read (struct pty_msg_reader *r, pty_msg_f fn, void *arg)
 {
-	unsigned char buf [4096];
-	int len;
+	size_t off = 0;
+	ssize_t n;
+
+	n = read (r->fd, r->buf + r->len, sizeof (r->buf) - r->len);
+	if (n < 0)
+		return ((errno == EINTR || errno == EAGAIN) ? 0 : -1);
+	if (n == 0)
+		return (-1);
+	r->len += n;
+
+	while (r->len - off >= sizeof (struct pty_msg)) {
+		struct pty_msg msg;
 
-	if ((len = read (STDIN_FILENO, buf, sizeof (buf))) < 0) {
-		slurm_error ("stdin read: %m\n");
-		exit (1);
+		memcpy (&msg, r->buf + off, sizeof (msg));
+		msg.type = ntohl (msg.type);
+		msg.task = ntohl (msg.task);
+		msg.len = ntohl (msg.len);
+
+		if (msg.len > PTY_MSG_MAX)
+			return (-1);
+		if (r->len - off < sizeof (msg) + msg.len)
+			break;
+
+		(*fn) (&msg, r->buf + off + sizeof (msg), arg);
+		off += sizeof (msg) + msg.len;
 	}
-	else if (len == 0) {
-		close (STDOUT_FILENO);
-		master = -1;
-		return;
+
+	if (off) {
+		r->len -= off;
+		memmove (r->buf, r->buf + off, r->len);
 	}
+	return (0);
+}
+
+/*
+ *  Tasks selected with --pty=[tasks], as a list of ranges.
+ */
+#define PTY_MAX_RANGES 64
+
+struct pty_range {
+	int lo;
+	int hi;
+};
 
-	write (master, buf, len);
-} 
+static struct pty_range pty_ranges [PTY_MAX_RANGES] = { { 0, 0 } };
+static int pty_nranges = 1;
 
-void check_for_slave_exit ()
+static int parse_tasks (const char *str)
 {
-	int status = 0;
+	char *copy, *tok, *save;
+	int n = 0;
+	int rc = 0;
+
+	if (strcmp (str, "all") == 0) {
+		pty_ranges[0].lo = 0;
+		pty_ranges[0].hi = INT_MAX;
+		pty_nranges = 1;
+		return (0);
+	}
 
-	if (waitpid (pid, &status, WNOHANG) <= 0)
-		return;
+	if (!(copy = strdup (str)))
+		return (-1);
+
+	for (tok = strtok_r (copy, ",", &save); tok && !rc;
+	     tok = strtok_r (NULL, ",", &save)) {
+		struct pty_range r;
+		char *p;
+
+		r.lo = r.hi = strtol (tok, &p, 10);
+		if (*p == '-') {
+			char *q = p + 1;
+			r.hi = strtol (q, &p, 10);
+			if (p == q)
+				p = q - 1;
+		}
+
+		if (p == tok || *p != '\0' || r.lo < 0 || r.hi < r.lo
+		    || n == PTY_MAX_RANGES)
+			rc = -1;
+		else
+			pty_ranges[n++] = r;
+	}
+	free (copy);
 
-	if (WIFEXITED (status)) 
-		exit (status);
+	if (rc < 0 || n == 0)
+		return (-1);
+
+	pty_nranges = n;
+	return (0);
+}
+
+static int task_selected (int taskid)
+{
+	int i;
+	for (i = 0; i < pty_nranges; i++) {
+		if (taskid >= pty_ranges[i].lo && taskid <= pty_ranges[i].hi)
+			return (1);
+	}
+	return (0);
+}
+
+static int pty_opt_process (int val, const char *optarg, int remote) 
+{
+	if (optarg && parse_tasks (optarg) < 0) {
+		slurm_error ("--pty: Invalid task list: %s", optarg);
+		return (-1);
+	}
+	do_pty = 1;
+	return (0);
 }
 
 static int fd_set_nonblocking (int fd)
@@ -200,6 +339,11 @@ int pty_connect_back (spank_t sp)
 		return (-1);
 	}
 
+	if (pty_token[0] == '\0') {
+		slurm_error ("failed to read SLURM_PTY_TOKEN in env!");
+		return (-1);
+	}
+
 	addr.sin_family = AF_INET;
 	inet_aton (ip, &addr.sin_addr);
 	addr.sin_port = htons (atoi (port));
@@ -217,61 +361,15 @@ int pty_connect_back (spank_t sp)
 		return (-1);
 	}
 
-	return (s);
-}
-
-static int write_pty_winsize (int fd, struct winsize *ws)
-{
-	int len;
-	struct pty_winsz winsz;
-
-	winsz.rows = ws->ws_row;
-	winsz.cols = ws->ws_col;
-
-	pty_winsz_pack (&winsz);
-
-	if ((len = write (fd, &winsz, sizeof (winsz))) < 0) {
-		slurm_error ("write_pty_winsz: %m");
-		return (-1);
-	}
-
-	return (len);
-}
-
-static int read_pty_winsize (int fd, struct winsize *ws)
-{
-	struct pty_winsz winsz;
-	int len;
-
-	if ((len = read (fd, &winsz, sizeof (winsz))) < 0) {
-		slurm_error ("read_pty_winsz: %m");
-		return (-1);
-	}
-
-	if (len == 0) {
-		slurm_error ("read_pty_winsz: Remote closed connection.");
+	/*  srun drops connections that don't present the step's token */
+	if (pty_msg_send (s, PTY_MSG_AUTH, PTY_ALL_TASKS,
+	                  pty_token, strlen (pty_token)) < 0) {
+		slurm_error ("pty: send: %m");
+		close (s);
 		return (-1);
 	}
 
-	pty_winsz_unpack (&winsz);
-
-	memset (ws, 0, sizeof (*ws));
-
-	ws->ws_col = winsz.cols;
-	ws->ws_row = winsz.rows;
-
-	return (0);
-}
-
-static void process_winsz_event (int fd, int master)
-{
-	struct winsize ws;
-
-	if (read_pty_winsize (fd, &ws) < 0)
-		return;
-
-	ioctl (master, TIOCSWINSZ, &ws);
-	kill (0, SIGWINCH);
+	return (s);
 }
 
 static int no_close_stdio (spank_t sp)
@@ -299,213 +397,1500 @@ static void close_stdio (void)
 	}
 }
 
-int slurm_spank_task_init (spank_t sp, int ac, char **av)
+/*
+ *  Window size updates arrive from the node's pty mux as packed
+ *   struct pty_winsz. The socket is non-blocking, so a record may
+ *   arrive in pieces.
+ */
+struct winsz_reader {
+	int fd;
+	struct pty_winsz winsz;
+	size_t len;
+	struct pty_record *rec;
+};
+
+static int process_winsz_event (struct winsz_reader *r, int master)
 {
-	int taskid;
-	int rfd;
 	struct winsize ws;
-	struct winsize *wsp = NULL;
+	ssize_t n;
 
-	if (!do_pty)
-		return (0);
+	for (;;) {
+		n = read (r->fd, (char *) &r->winsz + r->len,
+		          sizeof (r->winsz) - r->len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return (0);
+			slurm_error ("read_pty_winsz: %m");
+			return (-1);
+		}
+		if (n == 0)
+			return (-1);
 
-	spank_get_item (sp, S_TASK_GLOBAL_ID, &taskid);
+		if ((r->len += n) < sizeof (r->winsz))
+			continue;
+		r->len = 0;
 
-	if (taskid != 0) {
-		if (!no_close_stdio (sp))
-			close_stdio ();
-		return (0);
-	}
+		pty_winsz_unpack (&r->winsz);
+		memset (&ws, 0, sizeof (ws));
+		ws.ws_col = r->winsz.cols;
+		ws.ws_row = r->winsz.rows;
 
-	if ((rfd = pty_connect_back (sp)) < 0) {
-		slurm_error ("Failed to connect back to pty server");
+		ioctl (master, TIOCSWINSZ, &ws);
+		kill (0, SIGWINCH);
+		pty_record_resize (r->rec, ws.ws_row, ws.ws_col);
 	}
+}
 
-	if (get_winsize (sp, &ws)) 
-		wsp = &ws;
-
-	if ((pid = forkpty (&master, NULL, NULL, wsp)) < 0) {
-		slurm_error ("Failed to allocate a pty for rank 0: %m\n");
-		return (0);
-	}
-	else if (pid == 0) {
-		/* Child. Continue with SLURM code */
-		return (0);
-	} 
+/*
+ *  Relay between the pty master and the task's stdio (for rank 0) or
+ *   its channel to the node's pty mux.
+ *
+ *  Each direction is a channel which moves data from an input fd to
+ *   an output fd through a pipe with splice(2), so the data is never
+ *   copied into user space, or through a buffer of the same size if
+ *   either end can't be spliced. A channel stops reading its input
+ *   while its pipe or buffer is full, so a slow reader on stdout
+ *   pushes back on the program in the pty instead of losing output.
+ */
+#define RELAY_BUFSIZE 65536
 
-	/* Parent: process data from client */
+struct relay_chan;
 
-	while (1) {
-		struct pollfd fds[3];
-		int rc;
-		int nfds = 2;
+struct relay_fd {
+	int fd;
+	uint32_t events;            /* Events currently registered       */
+	int nopoll;                 /* fd can't be used with epoll       */
+	struct relay_chan *rd;      /* Channel reading from fd, or NULL  */
+	struct relay_chan *wr;      /* Channel writing to fd, or NULL    */
+};
 
-		fd_set_nonblocking (master);
-		fd_set_nonblocking (STDIN_FILENO);
+struct relay_chan {
+	struct relay_fd *in;
+	struct relay_fd *out;
+	int pipe[2];                /* Splice pipe, -1 if using buf      */
+	char *buf;
+	size_t off;
+	size_t len;                 /* Bytes held in pipe or buf         */
+	size_t size;                /* Capacity of pipe or buf           */
+	int stalled;                /* Pipe may be full, wait for drain  */
+	int idle;                   /* Last fill found no input          */
+	int eof;                    /* No more input                     */
+	int closed;                 /* Output is gone, discard data      */
+	struct pty_record *rec;     /* Record data read, or NULL         */
+};
 
-		fds[0].fd = master;
-		fds[1].fd = STDIN_FILENO;
-		fds[0].events = POLLIN | POLLERR;
-		fds[1].events = POLLIN | POLLERR;
+static void relay_chan_init (struct relay_chan *c,
+                             struct relay_fd *in, struct relay_fd *out)
+{
+	memset (c, 0, sizeof (*c));
+	c->in = in;
+	c->out = out;
+	in->rd = c;
+	out->wr = c;
+	c->size = RELAY_BUFSIZE;
+
+	if (pipe2 (c->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		c->pipe[0] = c->pipe[1] = -1;
+		return;
+	}
+#ifdef F_GETPIPE_SZ
+	{
+		int size = fcntl (c->pipe[1], F_GETPIPE_SZ);
+		if (size > 0)
+			c->size = size;
+	}
+#endif
+}
 
-		if (rfd >= 0) {
-			fd_set_nonblocking (rfd);
-			fds[2].fd = rfd;
-			fds[2].events = POLLIN | POLLERR;
-			nfds++;
-		}
+static void relay_chan_fini (struct relay_chan *c)
+{
+	if (c->pipe[0] >= 0) {
+		close (c->pipe[0]);
+		close (c->pipe[1]);
+	}
+	free (c->buf);
+}
 
+/*
+ *  Stop splicing: move anything left in the pipe into the buffer.
+ */
+static int relay_chan_unsplice (struct relay_chan *c)
+{
+	size_t len = 0;
+	ssize_t n;
 
-		if ((rc = poll (fds, 3, -1)) < 0) {
-			slurm_error ("poll: %m\n");
-			exit (1);
-		}
+	if (c->pipe[0] < 0 || (!c->buf && !(c->buf = malloc (c->size))))
+		return (-1);
 
-		if (fds[0].revents & POLLERR) {
-			check_for_slave_exit ();
-			continue;
+	while (len < c->len) {
+		if ((n = read (c->pipe[0], c->buf + len, c->len - len)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return (-1);
 		}
-
-		if (fds[0].revents & POLLIN) 
-			process_pty ();
-
-		if (fds[1].revents & POLLIN)
-			process_stdin ();
-
-		if (fds[2].revents & POLLIN)
-			process_winsz_event (rfd, master);
-
-		check_for_slave_exit ();
+		len += n;
 	}
 
+	close (c->pipe[0]);
+	close (c->pipe[1]);
+	c->pipe[0] = c->pipe[1] = -1;
+	c->off = 0;
 	return (0);
 }
 
-static void pty_restore (void)
+static void relay_chan_discard (struct relay_chan *c)
 {
-	/* STDIN is probably closed by now */
-	if (tcsetattr (STDOUT_FILENO, TCSANOW, &termdefaults) < 0)
-		fprintf (stderr, "tcsetattr: %s\n", strerror (errno));
+	if (c->pipe[0] >= 0)
+		relay_chan_unsplice (c);
+	c->off = c->len = 0;
 }
 
-static int set_winsize (spank_t sp)
+static int relay_chan_drain (struct relay_chan *c)
 {
-	struct winsize ws;
-	char buf[64];
-	ioctl (STDIN_FILENO, TIOCGWINSZ, &ws);
+	ssize_t n;
 
-	snprintf (buf, sizeof (buf), "%d", ws.ws_row);
-	setenv ("SLURM_PTY_WIN_ROW", buf, 1);
+	if (c->closed)
+		relay_chan_discard (c);
 
-	snprintf (buf, sizeof (buf), "%d", ws.ws_col);
-	setenv ("SLURM_PTY_WIN_COL", buf, 1);
+	while (c->len > 0) {
+		if (c->pipe[0] >= 0) {
+			n = splice (c->pipe[0], NULL, c->out->fd, NULL, c->len,
+			            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL && !relay_chan_unsplice (c))
+				continue;
+		}
+		else
+			n = write (c->out->fd, c->buf + c->off, c->len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return (0);
+			if (errno != EPIPE && errno != EIO)
+				slurm_error ("pty: write: %m");
+			c->closed = 1;
+			relay_chan_discard (c);
+			return (-1);
+		}
 
+		c->len -= n;
+		c->off = c->len ? c->off + n : 0;
+		c->stalled = 0;
+	}
 	return (0);
 }
 
-static void sigset_sigwinch (sigset_t *pset)
+static int relay_chan_fill (struct relay_chan *c)
 {
-	sigemptyset (pset);
-	sigaddset (pset, SIGWINCH);
+	ssize_t n;
+
+	c->idle = 0;
+	while (!c->eof && !c->stalled && c->len < c->size) {
+		if (c->pipe[0] >= 0) {
+			n = splice (c->in->fd, NULL, c->pipe[1], NULL,
+			            c->size - c->len,
+			            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0 && errno == EINVAL && !relay_chan_unsplice (c))
+				continue;
+		}
+		else {
+			if (!c->buf && !(c->buf = malloc (c->size)))
+				return (-1);
+			if (c->off + c->len == c->size) {
+				memmove (c->buf, c->buf + c->off, c->len);
+				c->off = 0;
+			}
+			n = read (c->in->fd, c->buf + c->off + c->len,
+			          c->size - c->off - c->len);
+			if (n > 0 && c->rec)
+				pty_record_output (c->rec, c->buf + c->off + c->len, n);
+		}
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/*
+				 *  Pipe capacity is counted in pages, not bytes,
+				 *   so EAGAIN with data pending may mean the pipe
+				 *   is full rather than that the input is empty.
+				 */
+				if (c->pipe[0] >= 0 && c->len > 0)
+					c->stalled = 1;
+				else
+					c->idle = 1;
+				break;
+			}
+			if (errno != EIO) /* EIO: pty slave has been closed */
+				slurm_error ("pty: read: %m");
+			c->eof = 1;
+			break;
+		}
+		if (n == 0) {
+			c->eof = 1;
+			break;
+		}
+		c->len += n;
+	}
+
+	return (relay_chan_drain (c));
 }
 
-static int notify_winsize_change (int fd)
+static int relay_fd_update (int epfd, struct relay_fd *r)
 {
-	struct winsize ws;
-	ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws);
-	write_pty_winsize (fd, &ws);
+	struct epoll_event ev;
+	uint32_t events = 0;
+	int op;
+
+	if (r->rd && !r->rd->eof && !r->rd->stalled && r->rd->len < r->rd->size)
+		events |= EPOLLIN;
+	if (r->wr && r->wr->len > 0 && !r->wr->closed)
+		events |= EPOLLOUT;
+
+	if (r->nopoll || events == r->events)
+		return (events && r->nopoll);
+
+	/*
+	 *  Remove fds with nothing to wait for, since EPOLLHUP can't be
+	 *   masked and would otherwise wake us up continually.
+	 */
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = r->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+	ev.events = events;
+	ev.data.ptr = r;
+	if (epoll_ctl (epfd, op, r->fd, &ev) < 0) {
+		/*  Regular files and /dev/null are always ready */
+		if (errno == EPERM) {
+			r->nopoll = 1;
+			return (1);
+		}
+		slurm_error ("pty: epoll_ctl: %m");
+		return (-1);
+	}
+	r->events = events;
 	return (0);
 }
 
-/*
- *  Detect when a window size change event occurs.
- */
-static int winch = 0;
-static void handle_sigwinch (int sig)
+static void relay_fd_process (struct relay_fd *r, uint32_t events)
 {
-	winch = 1;
-	signal (SIGWINCH, handle_sigwinch);
+	if (r->wr && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		relay_chan_drain (r->wr);
+	if (r->rd && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		relay_chan_fill (r->rd);
 }
 
-static void * pty_thread (void *arg)
+/*
+ *  Pass EOF on stdin to the program in the pty, once everything
+ *   read before it has been written.
+ */
+static void send_eof (int master)
 {
-	int fd;
-	sigset_t set;
+	struct termios tio;
+	char c = 4; /* ^D */
 
-	sigset_sigwinch (&set);
-	pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+	if (tcgetattr (master, &tio) == 0 && tio.c_cc[VEOF] != _POSIX_VDISABLE)
+		c = tio.c_cc[VEOF];
+	while (write (master, &c, 1) < 0 && errno == EINTR)
+		;
+}
 
-	signal (SIGWINCH, handle_sigwinch);
+static int exit_status (int status)
+{
+	if (WIFSIGNALED (status))
+		return (128 + WTERMSIG (status));
+	return (WEXITSTATUS (status));
+}
 
-	if ((fd = accept (listenfd, NULL, NULL)) < 0) {
-		slurm_error ("pty: accept: %m");
-		return NULL;
+static int pty_relay (int master, int in, int out, int rfd, pid_t child,
+                      struct pty_record *rec)
+{
+	struct relay_fd fds[3];
+	struct relay_chan output, input;
+	struct winsz_reader winsz;
+	struct epoll_event ev, events[8];
+	sigset_t mask;
+	int sfd, epfd;
+	int eof_sent = 0;
+	int exited = 0;
+	int status = 0;
+	int i, n;
+
+	memset (fds, 0, sizeof (fds));
+	fds[0].fd = master;
+	fds[1].fd = in;
+	fds[2].fd = out;
+	for (i = 0; i < 3; i++)
+		fd_set_nonblocking (fds[i].fd);
+
+	relay_chan_init (&output, &fds[0], &fds[2]);
+	relay_chan_init (&input, &fds[1], &fds[0]);
+
+	/*
+	 *  Recorded output has to pass through user space, so don't splice
+	 */
+	if (rec && (output.pipe[0] < 0 || relay_chan_unsplice (&output) == 0))
+		output.rec = rec;
+
+	if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+		slurm_error ("pty: epoll_create: %m");
+		return (1);
 	}
 
-	for (;;) {
-		poll (NULL, 0, -1);
-		if (winch && notify_winsize_change (fd) < 0)
-			return NULL;
-		winch = 0;
+	/*
+	 *  Child exit is noticed through a signalfd for SIGCHLD, so that
+	 *   the relay can still finish if some other process holds the
+	 *   pty slave open.
+	 */
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGCHLD);
+	sigprocmask (SIG_BLOCK, &mask, NULL);
+	if ((sfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		slurm_error ("pty: signalfd: %m");
+		return (1);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &sfd;
+	epoll_ctl (epfd, EPOLL_CTL_ADD, sfd, &ev);
+
+	winsz.fd = rfd;
+	winsz.len = 0;
+	winsz.rec = output.rec;
+	if (rfd >= 0) {
+		fd_set_nonblocking (rfd);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &winsz;
+		epoll_ctl (epfd, EPOLL_CTL_ADD, rfd, &ev);
 	}
 
-	return (NULL);
-}
+	if (waitpid (child, &status, WNOHANG) == child)
+		exited = 1;
 
-static int bind_wild (int sockfd)
-{
-	socklen_t len;
-	struct sockaddr_in sin;
+	for (;;) {
+		int ready = 0;
 
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = htonl(INADDR_ANY);
-	sin.sin_port = htons(0);        /* bind ephemeral port */
+		if (input.eof && input.len == 0 && !eof_sent) {
+			send_eof (master);
+			eof_sent = 1;
+		}
 
-	if (bind (sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
-		slurm_error ("bind: %m\n");
-		return (-1);
-	}
-	len = sizeof(sin);
-	if (getsockname(sockfd, (struct sockaddr *) &sin, &len) < 0)
-		return (-1);
-	return ntohs(sin.sin_port);
+		/*
+		 *  Once the child has exited, finish up as soon as there's
+		 *   no more output immediately available from the pty.
+		 */
+		if (exited && !output.eof) {
+			relay_chan_fill (&output);
+			if (output.idle)
+				output.eof = 1;
+		}
+		if (output.eof && (output.len == 0 || output.closed)) {
+			if (exited)
+				break;
+			if (waitpid (child, &status, 0) == child)
+				break;
+		}
 
-}
+		for (i = 0; i < 3; i++)
+			if (relay_fd_update (epfd, &fds[i]) > 0)
+				ready = 1;
 
-static int do_listen (int *fd, short *port)
-{
-	int rc, val;
+		if ((n = epoll_wait (epfd, events, 8, ready ? 0 : -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			slurm_error ("pty: epoll_wait: %m");
+			break;
+		}
 
-	if ((*fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-		return -1;
+		for (i = 0; i < n; i++) {
+			void *p = events[i].data.ptr;
+
+			if (p == &sfd) {
+				struct signalfd_siginfo si;
+				while (read (sfd, &si, sizeof (si)) > 0)
+					;
+				if (!exited && waitpid (child, &status, WNOHANG) == child)
+					exited = 1;
+			}
+			else if (p == &winsz) {
+				if (process_winsz_event (&winsz, master) < 0) {
+					epoll_ctl (epfd, EPOLL_CTL_DEL, rfd, NULL);
+					winsz.fd = -1;
+				}
+			}
+			else
+				relay_fd_process (p, events[i].events);
+		}
 
-	val = 1;
-	rc = setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int));
-	if (rc > 0) {
-		goto cleanup;
+		for (i = 0; i < 3; i++)
+			if (fds[i].nopoll)
+				relay_fd_process (&fds[i], EPOLLIN | EPOLLOUT);
 	}
 
-	*port = bind_wild (*fd);
+	relay_chan_fini (&output);
+	relay_chan_fini (&input);
+	close (epfd);
+	close (sfd);
+	pty_record_destroy (rec);
 
-	if ((rc = listen(*fd, 16)) < 0) {
-		slurm_error ("listen: %m");
-		goto cleanup;
-	}
+	return (exit_status (status));
+}
 
-	return (0);
+/*
+ *  Selected tasks on this node. Each gets a socketpair over which its
+ *   relay sends pty output to the node's mux process ([0] is the mux
+ *   end, [1] the task end), except rank 0, whose pty is relayed
+ *   through its own stdio. Each also gets a socketpair on which the
+ *   mux passes on window size changes.
+ */
+struct pty_task {
+	int taskid;
+	int data[2];
+	int ctl[2];
+};
 
-cleanup:
-	close (*fd);
-	return (-1);
-}
+static struct pty_task *pty_tasks = NULL;
+static int pty_ntasks = 0;
 
-static void set_pty_env (short port)
+static void close_fd (int *fdp)
 {
-	char buf [64];
-
-	snprintf (buf, sizeof (buf), "%hu", port);
-	setenv ("SLURM_PTY_PORT", buf, 1);
+	if (*fdp >= 0)
+		close (*fdp);
+	*fdp = -1;
+}
+
+static void pty_tasks_destroy (void)
+{
+	int i;
+	for (i = 0; i < pty_ntasks; i++) {
+		close_fd (&pty_tasks[i].data[0]);
+		close_fd (&pty_tasks[i].data[1]);
+		close_fd (&pty_tasks[i].ctl[0]);
+		close_fd (&pty_tasks[i].ctl[1]);
+	}
+	free (pty_tasks);
+	pty_tasks = NULL;
+	pty_ntasks = 0;
+}
+
+/*
+ *  Close the mux end of every socketpair, and the task end of all but
+ *   local task [keep]'s. Returns the entry for [keep], or NULL if it
+ *   wasn't selected.
+ */
+static struct pty_task * pty_tasks_close_others (int keep)
+{
+	struct pty_task *t = NULL;
+	int i;
+
+	for (i = 0; i < pty_ntasks; i++) {
+		close_fd (&pty_tasks[i].data[0]);
+		close_fd (&pty_tasks[i].ctl[0]);
+		if (i == keep && pty_tasks[i].ctl[1] >= 0)
+			t = &pty_tasks[i];
+		else {
+			close_fd (&pty_tasks[i].data[1]);
+			close_fd (&pty_tasks[i].ctl[1]);
+		}
+	}
+	return (t);
+}
+
+static void mux_winsz (struct pty_msg *msg, void *data, void *arg)
+{
+	int i;
+
+	if (msg->type != PTY_MSG_WINSZ || msg->len != sizeof (struct pty_winsz))
+		return;
+
+	/*
+	 *  The ctl sockets are non-blocking. If a task hasn't consumed the
+	 *   previous update there's no point in queueing more.
+	 */
+	for (i = 0; i < pty_ntasks; i++) {
+		struct pty_task *t = &pty_tasks[i];
+		if (t->ctl[0] >= 0
+		    && (msg->task == PTY_ALL_TASKS || msg->task == t->taskid))
+			send (t->ctl[0], data, msg->len, MSG_DONTWAIT);
+	}
+}
+
+/*
+ *  Node-side multiplexer: forward output of each task's pty to srun as
+ *   PTY_MSG_DATA messages, and window size changes from srun to the
+ *   tasks. Returns when all tasks have gone or srun hangs up.
+ */
+static void pty_mux (int sock)
+{
+	struct pty_msg_reader *r;
+	struct pollfd *fds;
+	unsigned char *buf;
+	int i, nopen;
+
+	fds = calloc (2 * pty_ntasks + 1, sizeof (*fds));
+	buf = malloc (PTY_MSG_MAX);
+	r = malloc (sizeof (*r));
+	if (!fds || !buf || !r)
+		return;
+	r->fd = sock;
+	r->len = 0;
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+
+	for (;;) {
+		nopen = 0;
+		for (i = 0; i < pty_ntasks; i++) {
+			struct pty_task *t = &pty_tasks[i];
+			fds[2*i+1].fd = t->data[0];
+			fds[2*i+1].events = POLLIN;
+			/*  Only interested in hangup when the task exits */
+			fds[2*i+2].fd = t->ctl[0];
+			fds[2*i+2].events = 0;
+			if (t->data[0] >= 0 || t->ctl[0] >= 0)
+				nopen++;
+		}
+		if (nopen == 0)
+			break;
+
+		if (poll (fds, 2 * pty_ntasks + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents && pty_msg_read (r, mux_winsz, NULL) < 0)
+			break;
+
+		for (i = 0; i < pty_ntasks; i++) {
+			struct pty_task *t = &pty_tasks[i];
+			ssize_t n;
+
+			if (fds[2*i+2].revents & (POLLHUP | POLLERR))
+				close_fd (&t->ctl[0]);
+
+			if (!fds[2*i+1].revents)
+				continue;
+
+			if ((n = read (t->data[0], buf, PTY_MSG_MAX)) < 0
+			    && (errno == EINTR || errno == EAGAIN))
+				continue;
+
+			if (n > 0) {
+				if (pty_msg_send (sock, PTY_MSG_DATA, t->taskid, buf, n) < 0)
+					goto out;
+			}
+			else {
+				pty_msg_send (sock, PTY_MSG_EOF, t->taskid, NULL, 0);
+				close_fd (&t->data[0]);
+			}
+		}
+	}
+out:
+	free (r);
+	free (buf);
+	free (fds);
+}
+
+static int mux_keep_fd (int fd, int sock)
+{
+	int i;
+
+	if (fd <= STDERR_FILENO || fd == sock)
+		return (1);
+	for (i = 0; i < pty_ntasks; i++) {
+		if (fd == pty_tasks[i].data[0] || fd == pty_tasks[i].ctl[0])
+			return (1);
+	}
+	return (0);
+}
+
+/*
+ *  Close everything inherited from slurmstepd that the mux doesn't
+ *   need. In particular it mustn't hold task stdio pipes open.
+ */
+static void mux_close_fds (int sock)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if (!(dir = opendir ("/proc/self/fd")))
+		return;
+	while ((d = readdir (dir))) {
+		int fd = atoi (d->d_name);
+		if (d->d_name[0] >= '0' && d->d_name[0] <= '9'
+		    && fd != dirfd (dir) && !mux_keep_fd (fd, sock))
+			close (fd);
+	}
+	closedir (dir);
+}
+
+/*
+ *  Start the mux in a grandchild of slurmstepd, so that slurmstepd
+ *   never sees it as one of its own children.
+ */
+/*
+ *  slurmstepd has only dropped its effective ids when user_init runs.
+ *   The long-lived mux parses bytes from the network, so drop to the
+ *   job user for good, keeping the user's supplementary groups.
+ */
+static int mux_drop_privileges (void)
+{
+	uid_t uid = geteuid ();
+	gid_t gid = getegid ();
+	gid_t *groups = NULL;
+	int n, rc = -1;
+
+	if (uid == 0)
+		return (0);
+
+	if ((n = getgroups (0, NULL)) < 0
+	    || (n && !(groups = malloc (n * sizeof (gid_t))))
+	    || (n && (n = getgroups (n, groups)) < 0))
+		goto out;
+
+	if (seteuid (0) < 0
+	    || setgroups (n, groups) < 0
+	    || setresgid (gid, gid, gid) < 0
+	    || setresuid (uid, uid, uid) < 0)
+		goto out;
+
+	/*  Make sure root can't be regained */
+	if (setuid (0) == 0)
+		goto out;
+	rc = 0;
+out:
+	free (groups);
+	return (rc);
+}
+
+static int pty_mux_start (int sock)
+{
+	pid_t cpid;
+	int status;
+	int i;
+
+	if ((cpid = fork ()) < 0) {
+		slurm_error ("pty: fork: %m");
+		return (-1);
+	}
+
+	if (cpid == 0) {
+		if (fork () != 0)
+			_exit (0);
+		if (mux_drop_privileges () < 0) {
+			slurm_error ("pty: failed to drop privileges: %m");
+			_exit (1);
+		}
+		signal (SIGPIPE, SIG_IGN);
+		for (i = 0; i < pty_ntasks; i++) {
+			close_fd (&pty_tasks[i].data[1]);
+			close_fd (&pty_tasks[i].ctl[1]);
+		}
+		mux_close_fds (sock);
+		pty_mux (sock);
+		_exit (0);
+	}
+
+	while (waitpid (cpid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	for (i = 0; i < pty_ntasks; i++) {
+		close_fd (&pty_tasks[i].data[0]);
+		close_fd (&pty_tasks[i].ctl[0]);
+	}
+	return (0);
+}
+
+/*
+ *  In slurmstepd, before the tasks are started: set up a channel for
+ *   each selected local task and connect back to srun once for all of
+ *   them.
+ */
+int slurm_spank_user_init (spank_t sp, int ac, char **av)
+{
+	int ntasks, nselected = 0;
+	int i, sock;
+
+	if (!do_pty || !spank_remote (sp))
+		return (0);
+
+	/*
+	 *  Keep the token out of the tasks' environment, whether or not
+	 *   this node has selected tasks and connects back.
+	 */
+	if (spank_getenv (sp, "SLURM_PTY_TOKEN", pty_token, sizeof (pty_token))
+	    != ESPANK_SUCCESS)
+		pty_token[0] = '\0';
+	spank_unsetenv (sp, "SLURM_PTY_TOKEN");
+
+	if (spank_get_item (sp, S_JOB_LOCAL_TASK_COUNT, &ntasks) != ESPANK_SUCCESS
+	    || !(pty_tasks = calloc (ntasks, sizeof (*pty_tasks))))
+		return (0);
+	pty_ntasks = ntasks;
+
+	for (i = 0; i < ntasks; i++) {
+		struct pty_task *t = &pty_tasks[i];
+
+		t->data[0] = t->data[1] = t->ctl[0] = t->ctl[1] = -1;
+
+		if (spank_get_item (sp, S_JOB_LOCAL_TO_GLOBAL_ID, i, &t->taskid)
+		    != ESPANK_SUCCESS || !task_selected (t->taskid))
+			continue;
+
+		if ((t->taskid != 0
+		     && socketpair (AF_UNIX, SOCK_STREAM, 0, t->data) < 0)
+		    || socketpair (AF_UNIX, SOCK_STREAM, 0, t->ctl) < 0) {
+			slurm_error ("pty: socketpair: %m");
+			pty_tasks_destroy ();
+			return (0);
+		}
+		fd_set_nonblocking (t->ctl[0]);
+		nselected++;
+	}
+
+	if (nselected == 0 || (sock = pty_connect_back (sp)) < 0) {
+		if (nselected)
+			slurm_error ("Failed to connect back to pty server");
+		pty_tasks_destroy ();
+		return (0);
+	}
+
+	if (pty_mux_start (sock) < 0)
+		pty_tasks_destroy ();
+	close (sock);
+
+	return (0);
+}
+
+int slurm_spank_task_post_fork (spank_t sp, int ac, char **av)
+{
+	int localid;
+
+	if (!pty_tasks || spank_get_item (sp, S_TASK_ID, &localid)
+	    != ESPANK_SUCCESS || localid < 0 || localid >= pty_ntasks)
+		return (0);
+
+	/*  The task has its own copies now */
+	close_fd (&pty_tasks[localid].data[1]);
+	close_fd (&pty_tasks[localid].ctl[1]);
+	return (0);
+}
+
+int slurm_spank_exit (spank_t sp, int ac, char **av)
+{
+	pty_tasks_destroy ();
+	return (0);
+}
+
+/*
+ *  Recording of rank 0's session, configured by plugin options:
+ *
+ *   record=PATH          Record to PATH, in which %j, %s, %u and %h
+ *                        are replaced by jobid, stepid, uid and hostname
+ *   record_format=FMT    `asciicast' (default) or `binary'
+ *   record_max=SIZE      Stop recording at SIZE bytes (default 64M)
+ *   record_buffer=SIZE   Size of the in-memory ring buffer (default 1M)
+ *
+ *  The file is opened as root in task_init_privileged. PATH must be
+ *   absolute and every directory in it owned by root and not writable
+ *   by group or others, so the job user can't redirect or pre-create
+ *   the file. The recording is not protected from the job's own output.
+ */
+static char *record_path = NULL;
+static enum pty_record_format record_format = PTY_RECORD_ASCIICAST;
+static size_t record_max = 64 << 20;
+static size_t record_buffer = 1 << 20;
+static int record_fd = -1;
+
+static int str2size (const char *str, size_t *sizep)
+{
+	unsigned long long val;
+	char *p;
+
+	val = strtoull (str, &p, 10);
+	if (p == str)
+		return (-1);
+
+	switch (*p) {
+	case 'G': case 'g': val <<= 10;   /* fall through */
+	case 'M': case 'm': val <<= 10;   /* fall through */
+	case 'K': case 'k': val <<= 10;
+		p++;
+	}
+	if (*p != '\0')
+		return (-1);
+
+	*sizep = val;
+	return (0);
+}
+
+static int parse_options (int ac, char **av)
+{
+	int i;
+
+	for (i = 0; i < ac; i++) {
+		if (strncmp (av[i], "record=", 7) == 0) {
+			free (record_path);
+			record_path = strdup (av[i] + 7);
+		}
+		else if (strcmp (av[i], "record_format=asciicast") == 0)
+			record_format = PTY_RECORD_ASCIICAST;
+		else if (strcmp (av[i], "record_format=binary") == 0)
+			record_format = PTY_RECORD_BINARY;
+		else if (strncmp (av[i], "record_max=", 11) == 0) {
+			if (str2size (av[i] + 11, &record_max) < 0)
+				goto invalid;
+		}
+		else if (strncmp (av[i], "record_buffer=", 14) == 0) {
+			if (str2size (av[i] + 14, &record_buffer) < 0)
+				goto invalid;
+		}
+		else
+			goto invalid;
+	}
+	return (0);
+
+invalid:
+	slurm_error ("pty: Invalid option: %s", av[i]);
+	return (-1);
+}
+
+static int record_path_expand (spank_t sp, char *buf, size_t len)
+{
+	const char *p;
+	size_t n = 0;
+
+	for (p = record_path; *p && n < len; p++) {
+		char val [256];
+		int id = -1;
+
+		if (*p != '%' || !p[1]) {
+			buf[n++] = *p;
+			continue;
+		}
+
+		switch (*++p) {
+		case 'j':
+			spank_get_item (sp, S_JOB_ID, &id);
+			break;
+		case 's':
+			spank_get_item (sp, S_JOB_STEPID, &id);
+			break;
+		case 'u': {
+			uid_t uid = -1;
+			spank_get_item (sp, S_JOB_UID, &uid);
+			id = uid;
+			break;
+		}
+		case 'h':
+			if (gethostname (val, sizeof (val)) < 0)
+				strcpy (val, "unknown");
+			val [sizeof (val) - 1] = '\0';
+			n += snprintf (buf + n, len - n, "%s", val);
+			continue;
+		default:
+			buf[n++] = *p;
+			continue;
+		}
+		n += snprintf (buf + n, len - n, "%d", id);
+	}
+
+	if (n >= len)
+		return (-1);
+	buf[n] = '\0';
+	return (0);
+}
+
+/*
+ *  Open each directory of absolute [path] in turn without following
+ *   symlinks, checking that only root may modify it. Returns an fd for
+ *   the last directory, with [*basep] set to the final component.
+ */
+static int record_dir_open (char *path, char **basep)
+{
+	char *p, *next;
+	int fd;
+
+	if (path[0] != '/' || !(*basep = strrchr (path, '/'))[1]) {
+		errno = EINVAL;
+		return (-1);
+	}
+	*(*basep)++ = '\0';
+
+	if ((fd = open ("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return (-1);
+
+	for (p = *path ? path + 1 : NULL; ; p = next) {
+		struct stat st;
+		int dfd;
+
+		if (fstat (fd, &st) < 0)
+			goto fail;
+		if (st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+			errno = EPERM;
+			goto fail;
+		}
+		if (!p)
+			return (fd);
+
+		if ((next = strchr (p, '/')))
+			*next++ = '\0';
+		if (*p == '\0')
+			continue;
+
+		dfd = openat (fd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		close (fd);
+		if ((fd = dfd) < 0)
+			return (-1);
+	}
+fail:
+	close (fd);
+	return (-1);
+}
+
+/*
+ *  Create the recording exclusively. A file left from an earlier step
+ *   is replaced only if it is a regular root-owned file with no other
+ *   links.
+ */
+static int record_open (const char *path)
+{
+	char buf [4096];
+	struct stat st;
+	char *base;
+	int dfd, fd;
+
+	if (snprintf (buf, sizeof (buf), "%s", path) >= (int) sizeof (buf)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	if ((dfd = record_dir_open (buf, &base)) < 0)
+		return (-1);
+
+	fd = openat (dfd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+	                        | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST
+	    && fstatat (dfd, base, &st, AT_SYMLINK_NOFOLLOW) == 0
+	    && S_ISREG (st.st_mode) && st.st_uid == 0 && st.st_nlink == 1
+	    && unlinkat (dfd, base, 0) == 0)
+		fd = openat (dfd, base, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+		                        | O_CLOEXEC, 0600);
+
+	close (dfd);
+	return (fd);
+}
+
+int slurm_spank_task_init_privileged (spank_t sp, int ac, char **av)
+{
+	char path [4096];
+	int taskid;
+
+	if (!do_pty || parse_options (ac, av) < 0 || !record_path)
+		return (0);
+
+	spank_get_item (sp, S_TASK_GLOBAL_ID, &taskid);
+	if (taskid != 0)
+		return (0);
+
+	if (record_path_expand (sp, path, sizeof (path)) < 0) {
+		slurm_error ("pty: record path too long");
+		return (0);
+	}
+
+	if ((record_fd = record_open (path)) < 0)
+		slurm_error ("pty: Failed to create %s: %m", path);
+
+	return (0);
+}
+
+int slurm_spank_task_init (spank_t sp, int ac, char **av)
+{
+	int taskid, localid;
+	int in, out, rfd;
+	struct pty_task *t;
+	struct pty_record *rec = NULL;
+	struct winsize ws;
+	struct winsize *wsp = NULL;
+
+	if (!do_pty)
+		return (0);
+
+	spank_get_item (sp, S_TASK_GLOBAL_ID, &taskid);
+	spank_get_item (sp, S_TASK_ID, &localid);
+
+	t = pty_tasks_close_others (localid);
+
+	if (taskid != 0 && !no_close_stdio (sp))
+		close_stdio ();
+
+	if (!task_selected (taskid) || (taskid != 0 && !t))
+		return (0);
+
+	rfd = t ? t->ctl[1] : -1;
+
+	if (taskid == 0) {
+		in = STDIN_FILENO;
+		out = STDOUT_FILENO;
+	}
+	else {
+		/*  Separate fds for each direction, as epoll needs */
+		out = t->data[1];
+		if ((in = dup (out)) < 0) {
+			slurm_error ("pty: dup: %m");
+			return (0);
+		}
+	}
+
+	if (get_winsize (sp, &ws)) 
+		wsp = &ws;
+
+	if ((pid = forkpty (&master, NULL, NULL, wsp)) < 0) {
+		slurm_error ("Failed to allocate a pty for rank %d: %m\n", taskid);
+		return (0);
+	}
+	else if (pid == 0) {
+		/* Child. Continue with SLURM code */
+		if (record_fd >= 0)
+			close (record_fd);
+		if (t) {
+			close_fd (&t->data[1]);
+			close_fd (&t->ctl[1]);
+			if (in != STDIN_FILENO)
+				close (in);
+		}
+		return (0);
+	} 
+
+	/* Parent: relay data between the pty and the task's stdio or mux */
+	signal (SIGPIPE, SIG_IGN);
+
+	if (record_fd >= 0) {
+		rec = pty_record_create (record_fd, record_format, record_buffer,
+		                         record_max, ws.ws_row, ws.ws_col);
+		if (!rec)
+			slurm_error ("pty: Failed to start recording");
+		record_fd = -1;
+	}
+
+	exit (pty_relay (master, in, out, rfd, pid, rec));
+}
+
+static void pty_restore (void)
+{
+	/* STDIN is probably closed by now */
+	if (tcsetattr (STDOUT_FILENO, TCSANOW, &termdefaults) < 0)
+		fprintf (stderr, "tcsetattr: %s\n", strerror (errno));
+}
+
+static int set_winsize (spank_t sp)
+{
+	struct winsize ws;
+	char buf[64];
+
+	if (ioctl (STDIN_FILENO, TIOCGWINSZ, &ws) < 0)
+		memset (&ws, 0, sizeof (ws));
+	winsz_initial = winsz_sent = ws;
+
+	snprintf (buf, sizeof (buf), "%d", ws.ws_row);
+	setenv ("SLURM_PTY_WIN_ROW", buf, 1);
+
+	snprintf (buf, sizeof (buf), "%d", ws.ws_col);
+	setenv ("SLURM_PTY_WIN_COL", buf, 1);
+
+	return (0);
+}
+
+static void sigset_sigwinch (sigset_t *pset)
+{
+	sigemptyset (pset);
+	sigaddset (pset, SIGWINCH);
+}
+
+/*
+ *  Window size changes: SIGWINCH is blocked in srun's main thread, and
+ *   so in the pty thread it creates, which reads it from a signalfd in
+ *   the same event loop as the node connections. If a thread started
+ *   before SIGWINCH was blocked catches it anyway, the handler forwards
+ *   it to the pty thread, where it is blocked and so appears on the
+ *   signalfd as well.
+ *
+ *  Resizing a terminal generates a burst of SIGWINCH. The new size is
+ *   sent once no signal has arrived for PTY_WINCH_DELAY_MS (but at
+ *   most PTY_WINCH_MAX_MS after the first), and only if it changed.
+ */
+#define PTY_WINCH_DELAY_MS 50
+#define PTY_WINCH_MAX_MS   250
+
+static pthread_t pty_tid;
+static volatile sig_atomic_t pty_thread_running = 0;
+static void handle_sigwinch (int sig)
+{
+	if (pty_thread_running)
+		pthread_kill (pty_tid, SIGWINCH);
+}
+
+/*
+ *  srun side: one connection from each node running selected tasks.
+ */
+struct pty_conn {
+	struct pty_msg_reader r;
+	int auth;                   /* 1 if token matched, -1 if not */
+	struct pty_conn *next;
+};
+
+static struct pty_conn *pty_conns = NULL;
+
+/*
+ *  Output of tasks other than rank 0 is written to stdout with each
+ *   line labelled by task id. Remember which tasks are mid-line.
+ */
+static unsigned char *midline = NULL;
+static uint32_t nmidline = 0;
+
+static int task_midline (uint32_t task, int set)
+{
+	if (task >= nmidline) {
+		uint32_t n = task + 64;
+		unsigned char *p;
+		if (set < 0 || !(p = realloc (midline, n)))
+			return (0);
+		memset (p + nmidline, 0, n - nmidline);
+		midline = p;
+		nmidline = n;
+	}
+	if (set >= 0)
+		midline[task] = set;
+	return (midline[task]);
+}
+
+/*
+ *  Compare [len] bytes of [data] against the token, in time independent
+ *   of where they differ.
+ */
+static int token_match (const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	unsigned char diff = 0;
+	size_t i;
+
+	if (len != strlen (pty_token))
+		return (0);
+	for (i = 0; i < len; i++)
+		diff |= p[i] ^ (unsigned char) pty_token[i];
+	return (diff == 0);
+}
+
+static int winsize_send (int fd, struct winsize *ws);
+
+static void demux_output (struct pty_msg *msg, void *data, void *arg)
+{
+	struct pty_conn *c = arg;
+	const char *p = data;
+	const char *end = p + msg->len;
+	char label [32];
+
+	/*
+	 *  Anyone can connect to the listening port. Nothing is written to
+	 *   the terminal until the first message presents the token.
+	 */
+	if (c->auth == 0) {
+		if (msg->type != PTY_MSG_AUTH || !token_match (data, msg->len)) {
+			slurm_error ("pty: dropping connection without valid token");
+			c->auth = -1;
+			return;
+		}
+		c->auth = 1;
+		/*  Node started with the initial size from the env */
+		if (winsz_sent.ws_row != winsz_initial.ws_row
+		    || winsz_sent.ws_col != winsz_initial.ws_col)
+			winsize_send (c->r.fd, &winsz_sent);
+		return;
+	}
+	if (c->auth < 0)
+		return;
+
+	if (msg->type == PTY_MSG_EOF) {
+		if (task_midline (msg->task, -1))
+			write_all (STDOUT_FILENO, "\r\n", 2);
+		task_midline (msg->task, 0);
+		return;
+	}
+	if (msg->type != PTY_MSG_DATA)
+		return;
+
+	while (p < end) {
+		const char *nl = memchr (p, '\n', end - p);
+		const char *q = nl ? nl + 1 : end;
+
+		if (!task_midline (msg->task, -1)) {
+			int n = snprintf (label, sizeof (label), "%u: ", msg->task);
+			write_all (STDOUT_FILENO, label, n);
+		}
+		write_all (STDOUT_FILENO, p, q - p);
+		task_midline (msg->task, nl == NULL);
+		p = q;
+	}
+}
+
+static struct pty_conn * pty_conn_accept (void)
+{
+	struct pty_conn *c;
+	int fd;
+
+	if ((fd = accept (listenfd, NULL, NULL)) < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			slurm_error ("pty: accept: %m");
+		return (NULL);
+	}
+	if (!(c = malloc (sizeof (*c)))) {
+		close (fd);
+		return (NULL);
+	}
+	c->r.fd = fd;
+	c->r.len = 0;
+	c->auth = 0;
+	c->next = pty_conns;
+	pty_conns = c;
+	return (c);
+}
+
+static void pty_conn_destroy (int epfd, struct pty_conn *conn)
+{
+	struct pty_conn **cp;
+
+	for (cp = &pty_conns; *cp; cp = &(*cp)->next) {
+		if (*cp == conn) {
+			*cp = conn->next;
+			break;
+		}
+	}
+	epoll_ctl (epfd, EPOLL_CTL_DEL, conn->r.fd, NULL);
+	close (conn->r.fd);
+	free (conn);
+}
+
+static int winsize_send (int fd, struct winsize *ws)
+{
+	struct pty_winsz winsz;
+
+	winsz.rows = ws->ws_row;
+	winsz.cols = ws->ws_col;
+	pty_winsz_pack (&winsz);
+
+	return (pty_msg_send (fd, PTY_MSG_WINSZ, PTY_ALL_TASKS,
+	                      &winsz, sizeof (winsz)));
+}
+
+static void notify_winsize_change (void)
+{
+	struct pty_conn *c;
+	struct winsize ws;
+
+	if (ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws) < 0)
+		return;
+	if (ws.ws_row == winsz_sent.ws_row && ws.ws_col == winsz_sent.ws_col)
+		return;
+	winsz_sent = ws;
+
+	for (c = pty_conns; c; c = c->next) {
+		if (c->auth > 0)
+			winsize_send (c->r.fd, &ws);
+	}
+}
+
+static long ms_since (struct timespec *t)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - t->tv_sec) * 1000
+	        + (now.tv_nsec - t->tv_nsec) / 1000000);
+}
+
+/*
+ *  Milliseconds until a pending size change should be sent.
+ */
+static int winch_timeout (struct timespec *first, struct timespec *last)
+{
+	long a = PTY_WINCH_DELAY_MS - ms_since (last);
+	long b = PTY_WINCH_MAX_MS - ms_since (first);
+	long t = a < b ? a : b;
+	return (t > 0 ? (int) t : 0);
+}
+
+static int epoll_add (int epfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	return (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev));
+}
+
+static void * pty_event_loop (int epfd, int sfd)
+{
+	struct epoll_event events [16];
+	struct timespec first, last;
+	int pending = 0;
+
+	if (epoll_add (epfd, listenfd, &listenfd) < 0
+	    || epoll_add (epfd, sfd, &sfd) < 0) {
+		slurm_error ("pty: epoll_ctl: %m");
+		return (NULL);
+	}
+
+	for (;;) {
+		int timeout = pending ? winch_timeout (&first, &last) : -1;
+		int i, n;
+
+		if ((n = epoll_wait (epfd, events, 16, timeout)) < 0) {
+			if (errno == EINTR)
+				continue;
+			slurm_error ("pty: epoll_wait: %m");
+			return (NULL);
+		}
+
+		for (i = 0; i < n; i++) {
+			void *p = events[i].data.ptr;
+
+			if (p == &sfd) {
+				struct signalfd_siginfo si;
+				while (read (sfd, &si, sizeof (si)) > 0)
+					;
+				clock_gettime (CLOCK_MONOTONIC, &last);
+				if (!pending)
+					first = last;
+				pending = 1;
+			}
+			else if (p == &listenfd) {
+				struct pty_conn *c = pty_conn_accept ();
+				if (!c)
+					continue;
+				if (epoll_add (epfd, c->r.fd, c) < 0)
+					pty_conn_destroy (epfd, c);
+			}
+			else {
+				struct pty_conn *c = p;
+				if (pty_msg_read (&c->r, demux_output, c) < 0
+				    || c->auth < 0)
+					pty_conn_destroy (epfd, c);
+			}
+		}
+
+		if (pending && winch_timeout (&first, &last) == 0) {
+			pending = 0;
+			notify_winsize_change ();
+		}
+	}
+}
+
+static void * pty_thread (void *arg)
+{
+	sigset_t set;
+	int epfd, sfd;
+
+	sigset_sigwinch (&set);
+	if ((sfd = signalfd (-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+		slurm_error ("pty: signalfd: %m");
+		goto out;
+	}
+	if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+		slurm_error ("pty: epoll_create: %m");
+		close (sfd);
+		goto out;
+	}
+
+	pty_event_loop (epfd, sfd);
+
+	close (epfd);
+	close (sfd);
+out:
+	pty_thread_running = 0;
+	return (NULL);
+}
+
+static int bind_wild (int sockfd)
+{
+	socklen_t len;
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(0);        /* bind ephemeral port */
+
+	if (bind (sockfd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+		slurm_error ("bind: %m\n");
+		return (-1);
+	}
+	len = sizeof(sin);
+	if (getsockname(sockfd, (struct sockaddr *) &sin, &len) < 0)
+		return (-1);
+	return ntohs(sin.sin_port);
+
+}
+
+static int do_listen (int *fd, short *port)
+{
+	int rc, val;
+
+	if ((*fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+		return -1;
+
+	val = 1;
+	rc = setsockopt(*fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int));
+	if (rc > 0) {
+		goto cleanup;
+	}
+
+	*port = bind_wild (*fd);
+
+	if ((rc = listen(*fd, 16)) < 0) {
+		slurm_error ("listen: %m");
+		goto cleanup;
+	}
+
+	return (0);
+
+cleanup:
+	close (*fd);
+	return (-1);
+}
+
+/*
+ *  Generate the random token nodes must present when connecting back.
+ */
+static int pty_token_create (void)
+{
+	unsigned char key [(sizeof (pty_token) - 1) / 2];
+	ssize_t n;
+	size_t i;
+	int fd;
+
+	if ((fd = open ("/dev/urandom", O_RDONLY | O_CLOEXEC)) < 0)
+		return (-1);
+	do
+		n = read (fd, key, sizeof (key));
+	while (n < 0 && errno == EINTR);
+	close (fd);
+	if (n != (ssize_t) sizeof (key))
+		return (-1);
+
+	for (i = 0; i < sizeof (key); i++)
+		snprintf (pty_token + 2*i, 3, "%02x", key[i]);
+	return (0);
+}
+
+static void set_pty_env (short port)
+{
+	char buf [64];
+
+	snprintf (buf, sizeof (buf), "%hu", port);
+	setenv ("SLURM_PTY_PORT", buf, 1);
+	setenv ("SLURM_PTY_TOKEN", pty_token, 1);
 }
 
 static int pty_thread_create (spank_t sp)
@@ -513,20 +1898,35 @@ static int pty_thread_create (spank_t sp)
 	short port;
 	int err;
 	pthread_attr_t attr;
-	pthread_t tid;
+	struct sigaction sa;
 
+	if (pty_token_create () < 0) {
+		slurm_error ("Unable to create pty token: %m");
+		return (-1);
+	}
 	if (do_listen (&listenfd, &port) < 0) {
 		slurm_error ("Unable to create pty listen port: %m");
 		return (-1);
 	}
 	set_pty_env (port);
 
+	/*  Thread inherits our signal mask, with SIGWINCH blocked */
+	pty_thread_running = 1;
 	pthread_attr_init (&attr);
 	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
-	err = pthread_create (&tid, &attr, &pty_thread, NULL);
+	err = pthread_create (&pty_tid, &attr, &pty_thread, NULL);
 	pthread_attr_destroy (&attr);
-	if (err)
+	if (err) {
+		pty_thread_running = 0;
 		return (-1);
+	}
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = handle_sigwinch;
+	sigemptyset (&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction (SIGWINCH, &sa, NULL);
+
 	return (0);
 }
 
@@ -0,0 +1,164 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+/*
+ *  libFuzzer entry point for the use-env parser. Each input is written
+ *   to a temporary file, compiled, and evaluated both as srun and as a
+ *   task would, and its task blocks are passed through pack and unpack
+ *   as they would be on the way from srun to remote tasks. Build with
+ *   `make fuzz' and run with, e.g.,
+ *
+ *    ./fuzz -max_len=4096 corpus/
+ *
+ *  after seeding corpus/ with some env files (e.g. test.conf).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "use-env.h"
+#include "log_msg.h"
+
+int LLVMFuzzerInitialize (int *ac, char ***av);
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size);
+
+static char path [] = "/tmp/use-env-fuzz.XXXXXX";
+
+/*
+ *  Don't let inputs change the environment of the fuzzer
+ */
+static char * fuzz_getenv (void *arg, const char *name)
+{
+    return (NULL);
+}
+
+static int fuzz_setenv (void *arg, const char *name, const char *value,
+                        int overwrite)
+{
+    return (0);
+}
+
+static int fuzz_unsetenv (void *arg, const char *name)
+{
+    return (0);
+}
+
+static struct use_env_ops fuzz_ops = {
+    fuzz_getenv,
+    fuzz_setenv,
+    fuzz_unsetenv
+};
+
+static void cleanup (void)
+{
+    unlink (path);
+}
+
+int LLVMFuzzerInitialize (int *ac, char ***av)
+{
+    int fd;
+
+    if ((fd = mkstemp (path)) < 0) {
+        perror ("mkstemp");
+        exit (1);
+    }
+    close (fd);
+    atexit (cleanup);
+
+    /*
+     *  Output of `print' and `dump' isn't interesting
+     */
+    if (!freopen ("/dev/null", "w", stdout)) {
+        perror ("/dev/null");
+        exit (1);
+    }
+
+    log_msg_init ("use-env-fuzz");
+    log_msg_set_quiet (1);
+    use_env_set_operations (&fuzz_ops, NULL);
+
+    return (0);
+}
+
+static void define_keywords (void)
+{
+    keyword_define ("SLURM_NNODES", "4");
+    keyword_define ("SLURM_NPROCS", "16");
+    keyword_define ("SLURM_JOBID", "1234");
+    keyword_define ("SLURM_STEPID", "0");
+    keyword_define ("SLURM_PROCID", "5");
+    keyword_define ("SLURM_LOCALID", "1");
+    keyword_define ("SLURM_NODEID", "1");
+    keyword_define ("SLURM_ARGC", "1");
+    keyword_define ("SLURM_ARGV0", "a.out");
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+    struct use_env_prog *prog, *task;
+    FILE *fp;
+    char *s;
+
+    if (!(fp = fopen (path, "w")))
+        return (0);
+    if (fwrite (data, 1, size, fp) != size) {
+        fclose (fp);
+        return (0);
+    }
+    fclose (fp);
+
+    define_keywords ();
+
+    if ((prog = use_env_compile (path))) {
+        use_env_parser_init (0);
+        use_env_eval (prog);
+
+        use_env_parser_init (1);
+        use_env_eval (prog);
+
+        if ((s = use_env_task_pack (prog)) && *s) {
+            if (!(task = use_env_task_unpack (s)))
+                abort ();
+            use_env_eval (task);
+            use_env_prog_destroy (task);
+        }
+        free (s);
+
+        use_env_prog_destroy (prog);
+    }
+
+    /*
+     *  Release all symbols and interned strings between inputs
+     */
+    use_env_parser_fini ();
+
+    return (0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
@@ -0,0 +1,330 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "hash.h"
+
+/*
+ *  Initial number of slots in a table. Tables are kept at most
+ *   half full, and are doubled in size when that limit is reached.
+ */
+#define HASH_MIN_SIZE 16
+
+/****************************************************************************
+ *  Interned strings
+ ****************************************************************************/
+
+struct istr {
+    unsigned int hash;
+    char         s[];
+};
+
+struct intern_pool {
+    struct istr **slots;
+    unsigned int  size;
+    unsigned int  count;
+};
+
+static struct intern_pool pool = { NULL, 0, 0 };
+
+/*
+ *  FNV-1a
+ */
+static unsigned int strhash (const char *s)
+{
+    unsigned int h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return (h);
+}
+
+static struct istr * istr (const char *s)
+{
+    return ((struct istr *) (s - offsetof (struct istr, s)));
+}
+
+static struct istr ** intern_slot (const char *s, unsigned int hash)
+{
+    unsigned int i = hash & (pool.size - 1);
+
+    while (pool.slots[i]) {
+        if (pool.slots[i]->hash == hash && strcmp (pool.slots[i]->s, s) == 0)
+            break;
+        i = (i + 1) & (pool.size - 1);
+    }
+    return (&pool.slots[i]);
+}
+
+static int intern_grow (void)
+{
+    struct istr **old = pool.slots;
+    unsigned int oldsize = pool.size;
+    unsigned int i;
+
+    pool.size = oldsize ? oldsize * 2 : HASH_MIN_SIZE;
+    if (!(pool.slots = calloc (pool.size, sizeof (*pool.slots)))) {
+        pool.slots = old;
+        pool.size = oldsize;
+        return (-1);
+    }
+
+    for (i = 0; i < oldsize; i++) {
+        if (old[i])
+            *intern_slot (old[i]->s, old[i]->hash) = old[i];
+    }
+    free (old);
+    return (0);
+}
+
+const char * intern_lookup (const char *s)
+{
+    struct istr **p;
+
+    if (pool.count == 0)
+        return (NULL);
+
+    p = intern_slot (s, strhash (s));
+    return (*p ? (*p)->s : NULL);
+}
+
+const char * intern (const char *s)
+{
+    unsigned int hash = strhash (s);
+    size_t len = strlen (s);
+    struct istr **p;
+
+    if ((2 * (pool.count + 1) > pool.size) && (intern_grow () < 0))
+        return (NULL);
+
+    if (*(p = intern_slot (s, hash)))
+        return ((*p)->s);
+
+    if (!(*p = malloc (sizeof (struct istr) + len + 1)))
+        return (NULL);
+
+    (*p)->hash = hash;
+    memcpy ((*p)->s, s, len + 1);
+    pool.count++;
+
+    return ((*p)->s);
+}
+
+void intern_fini (void)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool.size; i++)
+        free (pool.slots[i]);
+    free (pool.slots);
+
+    pool.slots = NULL;
+    pool.size = 0;
+    pool.count = 0;
+}
+
+/****************************************************************************
+ *  Hash tables
+ ****************************************************************************/
+
+struct hash_entry {
+    const char *key;
+    void *      data;
+};
+
+struct hash {
+    struct hash_entry *slots;
+    unsigned int       size;
+    unsigned int       count;
+    hash_del_f         del;
+};
+
+static unsigned int hash_index (hash_t h, const char *key)
+{
+    return (istr (key)->hash & (h->size - 1));
+}
+
+/*
+ *  Return slot for [key] in [h], or the empty slot where it would
+ *   be inserted.
+ */
+static struct hash_entry * hash_slot (hash_t h, const char *key)
+{
+    unsigned int i = hash_index (h, key);
+
+    while (h->slots[i].key && h->slots[i].key != key)
+        i = (i + 1) & (h->size - 1);
+
+    return (&h->slots[i]);
+}
+
+static int hash_resize (hash_t h, unsigned int size)
+{
+    struct hash_entry *old = h->slots;
+    unsigned int oldsize = h->size;
+    unsigned int i;
+
+    if (!(h->slots = calloc (size, sizeof (*h->slots)))) {
+        h->slots = old;
+        return (-1);
+    }
+    h->size = size;
+
+    for (i = 0; i < oldsize; i++) {
+        if (old[i].key)
+            *hash_slot (h, old[i].key) = old[i];
+    }
+    free (old);
+    return (0);
+}
+
+hash_t hash_create (hash_del_f del)
+{
+    hash_t h = malloc (sizeof (*h));
+
+    if (h == NULL)
+        return (NULL);
+
+    h->size = HASH_MIN_SIZE;
+    h->count = 0;
+    h->del = del;
+
+    if (!(h->slots = calloc (h->size, sizeof (*h->slots)))) {
+        free (h);
+        return (NULL);
+    }
+    return (h);
+}
+
+void hash_destroy (hash_t h)
+{
+    unsigned int i;
+
+    if (h == NULL)
+        return;
+
+    for (i = 0; i < h->size; i++) {
+        if (h->slots[i].key && h->del)
+            (*h->del) (h->slots[i].data);
+    }
+    free (h->slots);
+    free (h);
+}
+
+void * hash_find (hash_t h, const char *key)
+{
+    if (h == NULL || key == NULL || h->count == 0)
+        return (NULL);
+
+    return (hash_slot (h, key)->data);
+}
+
+void * hash_insert (hash_t h, const char *key, void *data)
+{
+    struct hash_entry *e;
+
+    if ((2 * (h->count + 1) > h->size) && (hash_resize (h, 2 * h->size) < 0))
+        return (NULL);
+
+    e = hash_slot (h, key);
+    if (e->key) {
+        if (h->del && e->data != data)
+            (*h->del) (e->data);
+    }
+    else
+        h->count++;
+
+    e->key = key;
+    e->data = data;
+
+    return (data);
+}
+
+int hash_delete (hash_t h, const char *key)
+{
+    struct hash_entry *e;
+    unsigned int i, j;
+
+    if (h == NULL || key == NULL || h->count == 0)
+        return (0);
+
+    if (!(e = hash_slot (h, key))->key)
+        return (0);
+
+    if (h->del)
+        (*h->del) (e->data);
+    h->count--;
+
+    /*
+     *  Backward shift deletion: move later entries of the probe
+     *   sequence into the hole so that no tombstones are needed.
+     */
+    i = e - h->slots;
+    j = i;
+    for (;;) {
+        unsigned int k;
+
+        h->slots[i].key = NULL;
+        h->slots[i].data = NULL;
+
+        do {
+            j = (j + 1) & (h->size - 1);
+            if (!h->slots[j].key)
+                return (1);
+            k = hash_index (h, h->slots[j].key);
+        } while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+
+        h->slots[i] = h->slots[j];
+        i = j;
+    }
+}
+
+int hash_for_each (hash_t h, hash_for_f f, void *arg)
+{
+    unsigned int i;
+    int n = 0;
+
+    if (h == NULL)
+        return (0);
+
+    for (i = 0; i < h->size; i++) {
+        if (!h->slots[i].key)
+            continue;
+        if ((*f) (h->slots[i].data, arg) < 0)
+            return (-1);
+        n++;
+    }
+    return (n);
+}
+
+int hash_count (hash_t h)
+{
+    return (h ? h->count : 0);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
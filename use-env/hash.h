@@ -0,0 +1,82 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+#ifndef _USE_ENV_HASH_H
+#define _USE_ENV_HASH_H
+
+/*
+ *  Interned strings:
+ *
+ *  intern() returns a unique copy of string [s], so that interned
+ *   strings may be compared by pointer. The hash value of an interned
+ *   string is computed once and kept with the string. Interned strings
+ *   remain valid until intern_fini().
+ *
+ *  intern_lookup() returns the interned copy of [s], or NULL if [s]
+ *   has never been interned. Since every key in a hash table is
+ *   interned, a NULL return means [s] is in no table.
+ */
+const char * intern (const char *s);
+const char * intern_lookup (const char *s);
+void intern_fini (void);
+
+/*
+ *  Open addressing hash tables keyed by interned strings:
+ */
+typedef struct hash * hash_t;
+typedef void (*hash_del_f) (void *data);
+typedef int  (*hash_for_f) (void *data, void *arg);
+
+hash_t hash_create (hash_del_f del);
+void hash_destroy (hash_t h);
+
+/*
+ *  Return data stored under interned [key], or NULL.
+ */
+void * hash_find (hash_t h, const char *key);
+
+/*
+ *  Store [data] under interned [key], destroying any existing
+ *   entry for [key]. Returns [data], or NULL if out of memory.
+ */
+void * hash_insert (hash_t h, const char *key, void *data);
+
+/*
+ *  Delete and destroy the entry for interned [key]. Returns 1 if
+ *   an entry was deleted, 0 otherwise.
+ */
+int hash_delete (hash_t h, const char *key);
+
+/*
+ *  Call [f] for every entry in [h] in unspecified order. Returns the
+ *   number of entries processed, or -1 if [f] returned < 0.
+ */
+int hash_for_each (hash_t h, hash_for_f f, void *arg);
+
+int hash_count (hash_t h);
+
+#endif /* !_USE_ENV_HASH_H */
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
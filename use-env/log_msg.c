@@ -66,6 +66,16 @@ int log_msg_quiet ()
 	return (log_ctx.quiet++);
 }
 
+/*
+ *  Set quiet flag to [quiet], returning the previous value.
+ */
+int log_msg_set_quiet (int quiet)
+{
+	int prev = log_ctx.quiet;
+	log_ctx.quiet = quiet;
+	return (prev);
+}
+
 
 static void 
 vlog_msg (const char *prefix, int use_basename, const char *format, va_list ap)
@@ -31,6 +31,7 @@ void log_msg_fini ();
 int log_msg_verbose ();
 int log_msg_set_verbose (int level);
 int log_msg_quiet ();
+int log_msg_set_quiet (int quiet);
 int log_err (const char *format, ...);
 void log_msg (const char *format, ...);
 void log_verbose (const char *format, ...);
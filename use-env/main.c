@@ -24,18 +24,112 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 
 #include "use-env.h"
 #include "log_msg.h"
+#include "hash.h"
 
+extern char **environ;
 extern int yydebug;
 static char *run_as_task = NULL;
+static int repeat = 1;
+static int nkeywords = 0;
+
+/*
+ *  Benchmark options:
+ */
+static int ntasks = 0;          /* Tasks per node to emulate (-T)         */
+static int gen_stmts = 0;       /* Statements in generated files (-G)     */
+static int gen_depth = 0;       /* Include depth of generated files (-I)  */
+static int gen_cond = 20;       /* Percent of conditional statements (-c) */
+static unsigned int gen_seed = 1;
+static char *gen_dir = NULL;    /* Keep generated files here (-D)         */
+
+/*
+ *  Count calls to the allocator, where it can be replaced (glibc
+ *   without a sanitizer that replaces it too).
+ */
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+#if defined (__GLIBC__) && !defined (__SANITIZE_ADDRESS__) \
+    && !__has_feature (address_sanitizer) && !__has_feature (memory_sanitizer)
+#define COUNT_ALLOCS 1
+
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+extern void __libc_free (void *);
+
+static unsigned long nallocs = 0;
+
+void * malloc (size_t n)
+{
+	nallocs++;
+	return (__libc_malloc (n));
+}
+
+void * calloc (size_t n, size_t size)
+{
+	nallocs++;
+	return (__libc_calloc (n, size));
+}
+
+void * realloc (void *p, size_t n)
+{
+	nallocs++;
+	return (__libc_realloc (p, n));
+}
+
+void free (void *p)
+{
+	__libc_free (p);
+}
+#endif /* COUNT_ALLOCS */
+
+static unsigned long alloc_count (void)
+{
+#ifdef COUNT_ALLOCS
+	return (nallocs);
+#else
+	return (0);
+#endif
+}
+
+static void usage (const char *prog)
+{
+	fprintf (stderr,
+"Usage: %s [OPTIONS]...\n"
+"  -f FILE    Read FILE (default stdin)\n"
+"  -n N       Set SLURM_NPROCS to N\n"
+"  -N N       Set SLURM_NNODES to N\n"
+"  -t ID      Evaluate as task ID\n"
+"  -k N       Define N SLURM_ARGV keywords\n"
+"  -v         Increase verbosity\n"
+"  -d         Enable parser debugging\n"
+"Benchmark options:\n"
+"  -r N       Repeat N times and report timing\n"
+"  -T N       Compile once per repeat and evaluate for N tasks\n"
+"  -G N       Generate files with N statements to read instead of -f\n"
+"  -I DEPTH   Nest generated files DEPTH includes deep\n"
+"  -c PCT     Make PCT%% of generated statements conditional (default 20)\n"
+"  -s SEED    Seed for generated files (default 1)\n"
+"  -D DIR     Write generated files to DIR and keep them\n",
+	prog);
+}
 
 int get_options (int ac, char **av, char **ppath, char **nnodes, char **nprocs)
 {
 	int c;
 
-	while ((c = getopt (ac, av, "dvt:f:n:N:")) >= 0) {
+	while ((c = getopt (ac, av, "dvt:f:n:N:r:k:T:G:I:c:s:D:h")) >= 0) {
 		switch (c) {
 		case 'd' :
 			yydebug = 1;
@@ -55,8 +149,36 @@ int get_options (int ac, char **av, char **ppath, char **nnodes, char **nprocs)
 		case 't':
 			run_as_task = optarg;
 			break;
+		case 'r':
+			repeat = atoi (optarg);
+			break;
+		case 'k':
+			nkeywords = atoi (optarg);
+			break;
+		case 'T':
+			ntasks = atoi (optarg);
+			break;
+		case 'G':
+			gen_stmts = atoi (optarg);
+			break;
+		case 'I':
+			gen_depth = atoi (optarg);
+			break;
+		case 'c':
+			gen_cond = atoi (optarg);
+			break;
+		case 's':
+			gen_seed = strtoul (optarg, NULL, 0);
+			break;
+		case 'D':
+			gen_dir = optarg;
+			break;
+		case 'h':
+			usage (av[0]);
+			exit (0);
 		case '?' :
 		default:
+			usage (av[0]);
 			exit (1);
 		}
 	}
@@ -64,12 +186,368 @@ int get_options (int ac, char **av, char **ppath, char **nnodes, char **nprocs)
 }
 
 
+/*
+ *  Define [n] SLURM_ARGV<i> keywords, as set_argv_keywords() in
+ *   use-env.c would for a job with a long command line.
+ */
+static void define_argv_keywords (int n)
+{
+	char name [64];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf (name, sizeof (name), "SLURM_ARGV%d", i);
+		keyword_define (name, name);
+	}
+}
+
+static double elapsed (struct timeval *t0)
+{
+	struct timeval t1;
+	gettimeofday (&t1, NULL);
+	return ((t1.tv_sec - t0->tv_sec) + (t1.tv_usec - t0->tv_usec) / 1e6);
+}
+
+/****************************************************************************
+ *  Synthetic env files
+ ****************************************************************************/
+
+struct gen {
+	FILE *fp;
+	unsigned int seed;
+	int n;              /* Statements written to this file */
+	long lines;         /* Total lines in all files        */
+	long bytes;         /* Total bytes in all files        */
+};
+
+static void gen_printf (struct gen *g, int indent, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+
+static void gen_printf (struct gen *g, int indent, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	g->bytes += fprintf (g->fp, "%*s", 2 * indent, "");
+	va_start (ap, fmt);
+	n = vfprintf (g->fp, fmt, ap);
+	va_end (ap);
+
+	g->bytes += n;
+	g->lines++;
+}
+
+static int gen_rand (struct gen *g, int n)
+{
+	return (n > 0 ? rand_r (&g->seed) % n : 0);
+}
+
+static void gen_test (struct gen *g, char *buf, size_t len)
+{
+	int i = gen_rand (g, g->n + 1);
+
+	switch (gen_rand (g, 5)) {
+	case 0:
+		snprintf (buf, len, "$SLURM_PROCID == %d", gen_rand (g, 8));
+		break;
+	case 1:
+		snprintf (buf, len, "defined $S%d", i);
+		break;
+	case 2:
+		snprintf (buf, len, "$V%d matches \"*%d*\"", i, gen_rand (g, 10));
+		break;
+	case 3:
+		snprintf (buf, len, "$SLURM_NNODES > %d && !defined $S%d",
+				  gen_rand (g, 4), i);
+		break;
+	default:
+		snprintf (buf, len, "($V%d != \"\") || ($SLURM_NPROCS <= %d)",
+				  i, gen_rand (g, 64));
+	}
+}
+
+static void gen_stmt (struct gen *g, int indent, int nest)
+{
+	int i = g->n++;
+	int j = gen_rand (g, i + 1);
+	char test [128];
+	int k;
+
+	if (nest < 4 && gen_rand (g, 100) < gen_cond) {
+		if (gen_rand (g, 8) == 0) {
+			gen_printf (g, indent, "in task {\n");
+			for (k = gen_rand (g, 3); k >= 0; k--)
+				gen_stmt (g, indent + 1, nest + 1);
+			gen_printf (g, indent, "}\n");
+			return;
+		}
+		gen_test (g, test, sizeof (test));
+		gen_printf (g, indent, "if (%s)\n", test);
+		for (k = gen_rand (g, 3); k >= 0; k--)
+			gen_stmt (g, indent + 1, nest + 1);
+		if (gen_rand (g, 2)) {
+			gen_test (g, test, sizeof (test));
+			gen_printf (g, indent, "else if (%s)\n", test);
+			gen_stmt (g, indent + 1, nest + 1);
+		}
+		if (gen_rand (g, 2)) {
+			gen_printf (g, indent, "else\n");
+			gen_stmt (g, indent + 1, nest + 1);
+		}
+		gen_printf (g, indent, "endif\n");
+		return;
+	}
+
+	switch (gen_rand (g, 7)) {
+	case 0:
+		gen_printf (g, indent, "define S%d = \"s%d$S%d\"\n", i, i, j);
+		break;
+	case 1:
+		gen_printf (g, indent, "V%d = \"$S%d:${SLURM_PROCID}:%d\"\n", i, j, i);
+		break;
+	case 2:
+		gen_printf (g, indent, "PATH_%d =+ /opt/pkg%d/bin\n", i % 16, i);
+		break;
+	case 3:
+		gen_printf (g, indent, "PATH_%d += ~/pkg%d/bin\n", i % 16, i);
+		break;
+	case 4:
+		gen_printf (g, indent, "V%d |= \"$V%d\"\n", j, i);
+		break;
+	case 5:
+		gen_printf (g, indent, "unset V%d\n", j);
+		break;
+	default:
+		gen_printf (g, indent, "V%d = %d\n", i, i);
+	}
+}
+
+static void gen_path (char *buf, size_t len, const char *dir, int level)
+{
+	snprintf (buf, len, "%s/env-%d.conf", dir, level);
+}
+
+/*
+ *  Write env-0.conf ... env-<depth>.conf in [dir], each including the
+ *   next, with gen_stmts statements spread over them. Returns 0 on
+ *   success with the size of all files in [g].
+ */
+static int generate_files (const char *dir, struct gen *g)
+{
+	char path [4096];
+	int level;
+
+	g->seed = gen_seed;
+	g->lines = g->bytes = 0;
+
+	for (level = 0; level <= gen_depth; level++) {
+		int n = gen_stmts / (gen_depth + 1);
+
+		gen_path (path, sizeof (path), dir, level);
+		if (!(g->fp = fopen (path, "w"))) {
+			log_err ("%s: %s\n", path, strerror (errno));
+			return (-1);
+		}
+
+		gen_printf (g, 0, "# Generated: level %d of %d, seed %u\n",
+				  level, gen_depth, gen_seed);
+		if (level < gen_depth)
+			gen_printf (g, 0, "include env-%d.conf\n", level + 1);
+
+		for (g->n = 0; g->n < n; )
+			gen_stmt (g, 0, 0);
+
+		if (fclose (g->fp) < 0) {
+			log_err ("%s: %s\n", path, strerror (errno));
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+static void remove_files (const char *dir)
+{
+	char path [4096];
+	int level;
+
+	for (level = 0; level <= gen_depth; level++) {
+		gen_path (path, sizeof (path), dir, level);
+		unlink (path);
+	}
+	rmdir (dir);
+}
+
+static int file_size (const char *path, struct gen *g)
+{
+	FILE *fp;
+	int c;
+
+	g->lines = g->bytes = 0;
+
+	if (!path)
+		return (0);
+
+	if (!(fp = fopen (path, "r")))
+		return (-1);
+
+	while ((c = getc (fp)) != EOF) {
+		g->bytes++;
+		if (c == '\n')
+			g->lines++;
+	}
+	fclose (fp);
+	return (0);
+}
+
+/****************************************************************************
+ *  Per-task environment
+ ****************************************************************************/
+
+/*
+ *  Each task starts with the environment of the job step, so tasks
+ *   emulated with -T evaluate into a private copy of the initial
+ *   environment, as slurmstepd does through the spank env functions.
+ */
+static hash_t task_env = NULL;
+
+static char * task_getenv (void *arg, const char *name)
+{
+	return (hash_find (task_env, intern_lookup (name)));
+}
+
+static int task_setenv (void *arg, const char *name, const char *value,
+                        int overwrite)
+{
+	char *s;
+
+	if (!overwrite && task_getenv (arg, name))
+		return (0);
+	if (!(s = strdup (value)) || !hash_insert (task_env, intern (name), s)) {
+		free (s);
+		return (-1);
+	}
+	return (0);
+}
+
+static int task_unsetenv (void *arg, const char *name)
+{
+	hash_delete (task_env, intern_lookup (name));
+	return (0);
+}
+
+static struct use_env_ops task_env_ops = {
+	task_getenv,
+	task_setenv,
+	task_unsetenv
+};
+
+static void task_env_reset (void)
+{
+	char **e;
+
+	hash_destroy (task_env);
+	task_env = hash_create ((hash_del_f) free);
+
+	for (e = environ; *e; e++) {
+		char name [1024];
+		char *eq = strchr (*e, '=');
+
+		if (!eq || eq - *e >= (int) sizeof (name))
+			continue;
+		memcpy (name, *e, eq - *e);
+		name [eq - *e] = '\0';
+		task_setenv (NULL, name, eq + 1, 1);
+	}
+}
+
+/****************************************************************************
+ *  Benchmark
+ ****************************************************************************/
+
+static void task_keywords (int task)
+{
+	char buf [64];
+
+	snprintf (buf, sizeof (buf), "%d", task);
+	keyword_define ("SLURM_PROCID", buf);
+	keyword_define ("SLURM_LOCALID", buf);
+}
+
+/*
+ *  Compile [filename] [repeat] times, evaluating each program once, or
+ *   once for each of [ntasks] tasks with -T, and report throughput
+ *   and allocations of each phase.
+ */
+static int bench (const char *filename, struct gen *g)
+{
+	const char *name = filename ? filename : "stdin";
+	struct use_env_prog *prog;
+	struct timeval t0;
+	double tcompile = 0.0, teval = 0.0;
+	unsigned long acompile = 0, aeval = 0, a0;
+	int nevals = 0;
+	int rc = 0;
+	int i, t;
+
+	if (ntasks > 0)
+		use_env_set_operations (&task_env_ops, NULL);
+
+	for (i = 0; i < repeat && rc == 0; i++) {
+		gettimeofday (&t0, NULL);
+		a0 = alloc_count ();
+		prog = use_env_compile (filename);
+		acompile += alloc_count () - a0;
+		tcompile += elapsed (&t0);
+
+		if (prog == NULL) {
+			log_err ("%s: Parser failed.\n", name);
+			return (-1);
+		}
+
+		for (t = 0; t < (ntasks > 0 ? ntasks : 1) && rc == 0; t++) {
+			if (ntasks > 0) {
+				task_env_reset ();
+				task_keywords (t);
+			}
+			gettimeofday (&t0, NULL);
+			a0 = alloc_count ();
+			rc = use_env_eval (prog);
+			aeval += alloc_count () - a0;
+			teval += elapsed (&t0);
+			nevals++;
+		}
+
+		use_env_prog_destroy (prog);
+	}
+
+	fprintf (stderr, "%s: %ld lines, %.1fKB\n", name, g->lines, g->bytes / 1024.0);
+	fprintf (stderr, "%s: %d compiles in %.3fs (%.1fus/compile, "
+			 "%.1fMB/s, %.0f lines/s)\n", name, i, tcompile, 
+			 1e6 * tcompile / i, g->bytes * i / tcompile / 1048576.0, 
+			 g->lines * i / tcompile);
+	fprintf (stderr, "%s: %d %s in %.3fs (%.1fus/eval)\n", name, nevals, 
+			 ntasks > 0 ? "task evals" : "evals", teval, 1e6 * teval / nevals);
+#ifdef COUNT_ALLOCS
+	fprintf (stderr, "%s: %.1f allocs/compile, %.1f allocs/eval\n", name,
+			 (double) acompile / i, (double) aeval / nevals);
+#endif
+
+	hash_destroy (task_env);
+	return (rc);
+}
+
 int main (int ac, char **av)
 {
 	int rc = 0;
+	int i;
 	char *filename = NULL;
 	char *nnodes = "0";
 	char *nprocs = "0";
+	char dir [] = "/tmp/use-env-bench.XXXXXX";
+	char path [4096];
+	struct timeval t0;
+	struct gen g;
 
 	log_msg_init ("use-env");
 
@@ -83,8 +561,43 @@ int main (int ac, char **av)
 		keyword_define ("SLURM_NODEID", "0");
 	}
 
-	use_env_parser_init (run_as_task != NULL);
-	rc = use_env_parse (filename);
+	define_argv_keywords (nkeywords);
+
+	use_env_parser_init (run_as_task != NULL || ntasks > 0);
+
+	if (gen_stmts > 0) {
+		if (gen_dir)
+			mkdir (gen_dir, 0755);
+		else if (!(gen_dir = mkdtemp (dir))) {
+			log_err ("mkdtemp: %s\n", strerror (errno));
+			exit (1);
+		}
+		if (generate_files (gen_dir, &g) < 0)
+			exit (1);
+		gen_path (path, sizeof (path), gen_dir, 0);
+		filename = path;
+	}
+	else
+		file_size (filename, &g);
+
+	if (ntasks > 0 || gen_stmts > 0)
+		rc = bench (filename, &g);
+	else {
+		gettimeofday (&t0, NULL);
+		for (i = 0; i < repeat && rc == 0; i++)
+			rc = use_env_parse (filename);
+
+		if (repeat > 1) {
+			double t = elapsed (&t0);
+			fprintf (stderr, "%s: %d parses in %.3fs (%.1fus/parse)\n",
+					 filename ? filename : "stdin", repeat, t, 
+					 1e6 * t / repeat);
+		}
+	}
+
+	if (gen_dir == dir)
+		remove_files (dir);
+
 	use_env_parser_fini ();
 	log_msg_fini ();
 
@@ -35,6 +35,8 @@
 #include "use-env.h"
 #include "log_msg.h"
 #include "list.h"
+#include "hash.h"
+#include "use-env-prog.h"
 
 #define YYDEBUG 1
 int yydebug = 0;
@@ -42,17 +44,27 @@ int yydebug = 0;
 extern int yylex ();
 void yyerror (const char *);
 
+/*
+ * Program construction
+ */
+static int emit (int op, int arg, struct lex_item *x, struct lex_item *y);
+static int emit_name (int op, int arg, struct lex_item *x, struct lex_item *y);
+static int branch_begin (int op);
+static int branch_next (int op);
+static int branch_end (int op);
+
 /*
  * Set parser options from config file
  */
 static int set_parser_option (const char *option, struct lex_item *x);
-static int define_symbol (char *name, struct lex_item *x);
+static int define_symbol (const char *name, struct lex_item *x);
 
 /*
  * Environment manipulation functions
  */
-static int env_var_set (char *name, char *val, int op);
-static int env_var_unset (char *name);
+static int env_var_set (const char *name, char *val, int op);
+static int env_var_unset (const char *name);
+static void dump_env_changes (void);
 
 /*
  * Condition functions
@@ -74,12 +86,11 @@ static int in_task_end ();
  * Item tests
  */
 static int do_fnmatch (struct lex_item *x, struct lex_item *y);
+static int item_check_defined (struct lex_item *i);
 static int item_defined (struct lex_item *i);
 static int cmp_items (int cmp, struct lex_item *x, struct lex_item *y);
 static int test_item (struct lex_item *i);
-static int include_file (char *name);
-static void dump_item (char *name);
-
+static void dump_item (const char *name);
 
 struct parser_ctx {
     int in_task;
@@ -118,7 +129,7 @@ static struct parser_ctx ctx = { 0, NULL, NULL };
 %token <item> ITEM
 %token <val>  EQ LT GT LE GE NE 
 
-%type <val> test tests cmp op
+%type <val> cmp op
 
 %left EQ LT GT LE GE NE AND OR '!' 
 
@@ -135,58 +146,60 @@ stmt    : stmt_end
         | in_task stmt_end
         | print stmt_end
         | error stmt_end
-        | INCLUDE ITEM '\n'  { if (include_file ($2->name) < 0)  YYABORT; }
+        | INCLUDE ITEM '\n'  { if (emit (OP_INCLUDE, 0, $2, NULL) < 0) YYABORT; }
         ;
 
 stmt_end: '\n'
         | ';'
         ;
 
-print   : PRINT ITEM         { if (condition()) printf ("%s\n", item_str ($2)); }
+print   : PRINT ITEM         { if (emit (OP_PRINT, 0, $2, NULL) < 0) YYABORT; }
         ;
 
-if_stmt : IF '(' tests ')'   { if (condition_push_if ($3) < 0) YYABORT; } 
+if_stmt : IF '(' tests ')'   { if (branch_begin (OP_IF) < 0) YYABORT; } 
           '\n' 
           stmts if_tail 
         ;
 
-if_tail : ENDIF              { condition_pop_endif (); }
+if_tail : ENDIF              { if (branch_end (OP_ENDIF) < 0) YYABORT; }
 
-        | ELSE  '\n'         { if (condition_push_else () < 0) YYABORT; }
-          stmts ENDIF        { condition_pop_endif (); }
+        | ELSE  '\n'         { if (branch_next (OP_ELSE) < 0) YYABORT; }
+          stmts ENDIF        { if (branch_end (OP_ENDIF) < 0) YYABORT; }
 
-        | ELSE IF            { condition_pop (); } 
-          '(' tests ')'      { if (condition_push_else_if ($5) < 0) YYABORT; }
+        | ELSE IF            { if (branch_end (OP_ELSE_IF_BEGIN) < 0) YYABORT; } 
+          '(' tests ')'      { if (branch_begin (OP_ELSE_IF) < 0) YYABORT; }
           '\n'
           stmts if_tail
         ;
 
-in_task : IN_TASK            { in_task_begin (); }
-          block              { in_task_end (); }
-        | IN_TASK '\n'       { in_task_begin (); }
-          block              { in_task_end (); }
+in_task : IN_TASK            { if (branch_begin (OP_IN_TASK_BEGIN) < 0) YYABORT; }
+          block              { if (branch_end (OP_IN_TASK_END) < 0) YYABORT; }
+        | IN_TASK '\n'       { if (branch_begin (OP_IN_TASK_BEGIN) < 0) YYABORT; }
+          block              { if (branch_end (OP_IN_TASK_END) < 0) YYABORT; }
 
 block   : '{' stmts '}'
 
-tests   : tests AND test     { $$ = ($1 && $3); }
-        | tests OR  test     { $$ = ($1 || $3); }
+tests   : tests AND test     { if (emit (OP_AND, 0, NULL, NULL) < 0) YYABORT; }
+        | tests OR  test     { if (emit (OP_OR, 0, NULL, NULL) < 0) YYABORT; }
         | test
         ;
 
-test    : ITEM cmp ITEM      { if (($$ = cmp_items ($2, $1, $3)) < 0) YYABORT; }
-        | DEFINED ITEM       { if (($$ = item_defined ($2)) < 0) YYABORT; }
-        | ITEM               { if (($$ = test_item ($1))    < 0) YYABORT; }
-        | '(' test ')'       { $$ = $2; }
-        | '!' test           { if (condition ()) $$ = !($2); else $$ = 0; }
-        | ITEM MATCH ITEM    { if (($$ = do_fnmatch ($3, $1)) < 0) YYABORT; }
-
-
-expr    : ITEM op ITEM       { env_var_set ($1->name, item_str ($3), $2); }
-        | UNSET ITEM         { env_var_unset ($2->name); }
-        | SET ITEM ITEM      { set_parser_option ($2->name, $3); }    
-        | DUMP ITEM          { dump_item ($2->name); }
-        | DEF ITEM '=' ITEM  { if (define_symbol ($2->name, $4) < 0) YYABORT; }
-        | UNDEF ITEM         { if (condition ()) sym_delete ($2->name); }
+test    : ITEM cmp ITEM      { if (emit (OP_CMP, $2, $1, $3) < 0) YYABORT; }
+        | DEFINED ITEM       { if (item_check_defined ($2) < 0 
+                                  || emit (OP_DEFINED, 0, $2, NULL) < 0) 
+                                   YYABORT; }
+        | ITEM               { if (emit (OP_TEST, 0, $1, NULL) < 0) YYABORT; }
+        | '(' test ')'
+        | '!' test           { if (emit (OP_NOT, 0, NULL, NULL) < 0) YYABORT; }
+        | ITEM MATCH ITEM    { if (emit (OP_MATCH, 0, $3, $1) < 0) YYABORT; }
+
+
+expr    : ITEM op ITEM       { if (emit_name (OP_SET, $2, $1, $3) < 0) YYABORT; }
+        | UNSET ITEM         { if (emit_name (OP_UNSET, 0, $2, NULL) < 0) YYABORT; }
+        | SET ITEM ITEM      { if (emit (OP_SETOPT, 0, $2, $3) < 0) YYABORT; }    
+        | DUMP ITEM          { if (emit (OP_DUMP, 0, $2, NULL) < 0) YYABORT; }
+        | DEF ITEM '=' ITEM  { if (emit_name (OP_DEFINE, 0, $2, $4) < 0) YYABORT; }
+        | UNDEF ITEM         { if (emit (OP_UNDEF, 0, $2, NULL) < 0) YYABORT; }
         ;
 
 op      : '='                { $$ = '='; }
@@ -205,11 +218,6 @@ cmp     : EQ                 { $$ = EQ; }
 
 %%
 
-void yyerror (const char *msg)
-{
-    log_err ("%s\n", msg);
-}
-
 /****************************************************************************
  *  Data Types
  ****************************************************************************/
@@ -225,14 +233,633 @@ struct cond {
 
 static List cond_stack = NULL;
 
+/*
+ *  Program being compiled, and the stack of unterminated blocks in it
+ */
+static struct use_env_prog *prog = NULL;
+static int blocks [MAX_BLOCK_DEPTH];
+static int nblocks = 0;
+static int nerrors = 0;
+
+/*
+ *  Interned paths of files currently being compiled or evaluated,
+ *   used to detect recursive includes
+ */
+static hash_t active = NULL;
+
+void yyerror (const char *msg)
+{
+    nerrors++;
+    log_err ("%s\n", msg);
+}
+
 /****************************************************************************
- *  Includes
+ *  Program construction
  ****************************************************************************/
 
-static int include_file (char *name)
+static int operand_set (struct operand *o, struct lex_item *i)
 {
-    if (condition ())
-        return (lex_include_push (name));
+    memset (o, 0, sizeof (*o));
+    o->str = -1;
+
+    if (i == NULL)
+        return (0);
+
+    o->type = i->type;
+    o->num  = (i->type == TYPE_INT) ? i->val.num : 0;
+    o->tmpl = (i->name[0] == TMPL_HOME) || (strchr (i->name, TMPL_REF) != NULL);
+
+    if ((o->str = prog_strdup (prog, i->name)) < 0)
+        return (-1);
+
+    return (0);
+}
+
+/*
+ *  Append an instruction to the current program, returning its index.
+ */
+static int emit (int op, int arg, struct lex_item *x, struct lex_item *y)
+{
+    struct insn *i;
+
+    if ((i = prog_insn_append (prog)) == NULL)
+        return (log_err ("Out of memory\n"));
+
+    i->op = op;
+    i->arg = arg;
+    i->line = lex_line ();
+
+    /*
+     *  The include action runs after the newline has been read, so
+     *   use the line of the include itself for error messages.
+     */
+    if (op == OP_INCLUDE)
+        i->line--;
+
+    if (operand_set (&i->x, x) < 0 || operand_set (&i->y, y) < 0)
+        return (log_err ("Out of memory\n"));
+
+    return (i - prog->insns);
+}
+
+/*
+ *  Emit an instruction whose first operand names a variable. Names
+ *   that contain symbol references can only be checked at evaluation.
+ */
+static int emit_name (int op, int arg, struct lex_item *x, struct lex_item *y)
+{
+    if (!strchr (x->name, TMPL_REF) && !is_valid_identifier (x->name)) {
+        switch (op) {
+        case OP_SET:
+            log_err ("Invalid identifier \"%s\" in expression\n", x->name);
+            return (0);
+        case OP_UNSET:
+            log_err ("Invalid identifier \"%s\" in unset\n", x->name);
+            return (0);
+        default:
+            log_err ("Unable to define invalid identifier \"%s\"\n", x->name);
+            return (-1);
+        }
+    }
+    return (emit (op, arg, x, y));
+}
+
+/*
+ *  Emit instruction [op] beginning a block.
+ */
+static int branch_begin (int op)
+{
+    int pc;
+
+    if (nblocks == MAX_BLOCK_DEPTH)
+        return (log_err ("if/in task blocks nested too deep\n"));
+
+    if ((pc = emit (op, -1, NULL, NULL)) < 0)
+        return (-1);
+
+    /*
+     *  In task context `in task' blocks are evaluated even within
+     *   false conditionals, so enclosing blocks can't be skipped there.
+     */
+    if (op == OP_IN_TASK_BEGIN) {
+        int i;
+        for (i = 0; i < nblocks; i++)
+            prog->insns [blocks [i]].flags |= INSN_HAS_TASK_BLOCK;
+    }
+
+    blocks [nblocks++] = pc;
+    return (pc);
+}
+
+/*
+ *  Emit instruction [op] ending the innermost block.
+ */
+static int branch_end (int op)
+{
+    int pc;
+
+    if ((pc = emit (op, 0, NULL, NULL)) < 0)
+        return (-1);
+
+    if (nblocks > 0)
+        prog->insns [blocks [--nblocks]].arg = pc;
+
+    return (pc);
+}
+
+/*
+ *  Emit instruction [op] ending the innermost block and beginning another.
+ */
+static int branch_next (int op)
+{
+    int pc;
+
+    if ((pc = branch_end (op)) < 0)
+        return (-1);
+
+    prog->insns [pc].arg = -1;
+    blocks [nblocks++] = pc;
+    return (pc);
+}
+
+/****************************************************************************
+ *  Compilation
+ ****************************************************************************/
+
+static struct use_env_prog * prog_compile (const char *path, int depth);
+
+/*
+ *  Compile any included files of [p] whose names are known now, so
+ *   that they need not be read again when [p] is evaluated. Errors are
+ *   not reported here, but when (and if) the include is evaluated.
+ */
+static void prog_compile_includes (struct use_env_prog *p, int depth)
+{
+    int i;
+
+    if (depth >= MAX_INCLUDE_DEPTH)
+        return;
+
+    for (i = 0; i < p->ninsns; i++) {
+        struct insn *in = &p->insns [i];
+        struct use_env_prog *inc;
+        char buf [4096];
+        const char *path;
+        const char *key;
+        int quiet;
+
+        if (in->op != OP_INCLUDE || in->x.tmpl)
+            continue;
+
+        path = prog_include_path (p, prog_str (p, &in->x), buf, sizeof (buf));
+        if (!path || !(key = intern (path)))
+            continue;
+
+        if (  hash_find (p->includes, key) 
+           || hash_find (active, key) 
+           || access (path, R_OK) < 0)
+            continue;
+
+        quiet = log_msg_set_quiet (1);
+        inc = prog_compile (path, depth + 1);
+        log_msg_set_quiet (quiet);
+
+        if (inc && !hash_insert (p->includes, key, inc))
+            use_env_prog_destroy (inc);
+    }
+}
+
+static struct use_env_prog * prog_compile (const char *path, int depth)
+{
+    struct use_env_prog *p;
+    const char *key;
+    int rc;
+
+    if (lex_file_init (path) < 0) {
+        if (depth == 0) {
+            log_err ("Failed to open %s: %s\n", path, strerror (errno));
+            log_err ("Failed to open config file %s\n", path);
+        }
+        return (NULL);
+    }
+
+    if (!(p = prog_create (path)) || !(key = intern (p->path))) {
+        log_err ("Out of memory\n");
+        lex_fini ();
+        use_env_prog_destroy (p);
+        return (NULL);
+    }
+
+    prog = p;
+    nblocks = 0;
+    nerrors = 0;
+
+    rc = yyparse ();
+
+    /*
+     *  After a syntax error the block structure can't be trusted,
+     *   so evaluate every instruction as the old parser would have.
+     */
+    p->noskip = (nerrors > 0) || (nblocks > 0);
+
+    lex_fini ();
+    prog = NULL;
+
+    if (rc) {
+        if (depth == 0)
+            log_err ("%s: Parser failed.\n", p->path);
+        use_env_prog_destroy (p);
+        return (NULL);
+    }
+
+    if (!active)
+        active = hash_create (NULL);
+
+    hash_insert (active, key, p);
+    prog_compile_includes (p, depth);
+    hash_delete (active, key);
+
+    return (p);
+}
+
+/****************************************************************************
+ *  Evaluation
+ ****************************************************************************/
+
+static int prog_eval (struct use_env_prog *p, int depth);
+
+static int buf_append (char **bufp, size_t *lenp, size_t *sizep, 
+    const char *str, size_t n)
+{
+    if (*lenp + n + 1 > *sizep) {
+        size_t size = *sizep;
+        char *new;
+
+        while (*lenp + n + 1 > size)
+            size *= 2;
+        if (!(new = realloc (*bufp, size)))
+            return (-1);
+        *bufp = new;
+        *sizep = size;
+    }
+    memcpy (*bufp + *lenp, str, n);
+    *lenp += n;
+    (*bufp) [*lenp] = '\0';
+    return (0);
+}
+
+/*
+ *  Return a copy of string [t] with symbol references expanded.
+ */
+static char * tmpl_expand (const char *t)
+{
+    size_t size = strlen (t) + 64;
+    size_t len = 0;
+    char *buf = malloc (size);
+
+    if (buf == NULL)
+        return (NULL);
+    buf [0] = '\0';
+
+    if (*t == TMPL_HOME) {
+        const char *home = getenv ("HOME");
+        if (buf_append (&buf, &len, &size, home ? home : "~", 
+                        home ? strlen (home) : 1) < 0)
+            goto nomem;
+        t++;
+    }
+
+    while (*t) {
+        char name [256];
+        const struct sym *m;
+        const char *end;
+
+        if (*t != TMPL_REF) {
+            size_t n = strcspn (t, "\001");
+            if (buf_append (&buf, &len, &size, t, n) < 0)
+                goto nomem;
+            t += n;
+            continue;
+        }
+
+        t++;
+        if ((end = strchr (t, TMPL_END)) == NULL)
+            end = t + strlen (t);
+
+        snprintf (name, sizeof (name), "%.*s", (int) (end - t), t);
+
+        if ((m = sym (name)) && 
+            buf_append (&buf, &len, &size, m->string, strlen (m->string)) < 0)
+            goto nomem;
+
+        t = *end ? end + 1 : end;
+    }
+
+    return (buf);
+
+nomem:
+    free (buf);
+    return (NULL);
+}
+
+/*
+ *  Fill in item [i] with the current value of operand [o]. 
+ */
+static void operand_item (struct use_env_prog *p, struct operand *o, 
+    struct lex_item *i)
+{
+    memset (i, 0, sizeof (*i));
+
+    i->type = o->type;
+    i->name = i->str = prog_str (p, o);
+
+    if (o->type == TYPE_INT)
+        i->val.num = o->num;
+    else if (o->type == TYPE_SYM) {
+        if ((i->val.sym = sym (i->name)))
+            i->str = i->val.sym->string;
+        else
+            i->str = "";
+    }
+    else {
+        if (o->tmpl) {
+            if ((i->str = tmpl_expand (i->name)) == NULL) {
+                log_err ("Out of memory\n");
+                i->str = "";
+            }
+            else
+                i->freestr = 1;
+            i->name = i->str;
+        }
+        i->val.str = i->str;
+    }
+}
+
+static void item_release (struct lex_item *i)
+{
+    if (i->freestr)
+        free (i->str);
+    i->freestr = 0;
+}
+
+/*
+ *  Return the name of variable operand [o] in [buf].
+ */
+static const char * operand_name (struct use_env_prog *p, struct operand *o,
+    char *buf, size_t len)
+{
+    struct lex_item i;
+
+    if (!o->tmpl)
+        return (prog_str (p, o));
+
+    operand_item (p, o, &i);
+    snprintf (buf, len, "%s", item_str (&i));
+    item_release (&i);
+
+    return (buf);
+}
+
+static int include_file (struct use_env_prog *p, struct insn *in, int depth)
+{
+    struct use_env_prog *inc;
+    struct lex_item x;
+    char buf [4096];
+    const char *path;
+    const char *key;
+    int rc;
+
+    if (!condition ())
+        return (0);
+
+    operand_item (p, &in->x, &x);
+    path = prog_include_path (p, item_str (&x), buf, sizeof (buf));
+    item_release (&x);
+
+    if (!path || !(key = intern (path)))
+        return (log_err ("Out of memory\n"));
+
+    if (hash_find (active, key))
+        return (log_err ("Recursively included file\n"));
+
+    if (depth >= MAX_INCLUDE_DEPTH)
+        return (log_err ("include files nested too deep\n"));
+
+    if (!(inc = hash_find (p->includes, key))) {
+        if (!(inc = prog_compile (path, depth + 1))) {
+            lex_location_set (p->path, in->line);
+            return (log_err ("failed to include \"%s\"\n", path));
+        }
+        if (!hash_insert (p->includes, key, inc)) {
+            use_env_prog_destroy (inc);
+            return (log_err ("Out of memory\n"));
+        }
+    }
+
+    log_verbose ("including file %s\n", path);
+
+    hash_insert (active, key, inc);
+    rc = prog_eval (inc, depth + 1);
+    hash_delete (active, key);
+
+    lex_location_set (p->path, in->line);
+    log_verbose ("popping back to file %s\n", p->path);
+
+    return (rc);
+}
+
+/*
+ *  Skip to the end of the block begun by instruction [pc] if the
+ *   condition [val] it pushed is false.
+ */
+static int skip_block (struct use_env_prog *p, int pc, int val)
+{
+    int end = p->insns [pc].arg;
+
+    if (val || p->noskip || end <= pc)
+        return (pc);
+
+    if (ctx.in_task && (p->insns [pc].flags & INSN_HAS_TASK_BLOCK))
+        return (pc);
+
+    return (end - 1);
+}
+
+/*
+ *  Return the number of values instruction [op] pops from the stack.
+ */
+static int stack_pops (int op)
+{
+    switch (op) {
+    case OP_AND:
+    case OP_OR:
+        return (2);
+    case OP_NOT:
+    case OP_IF:
+    case OP_ELSE_IF:
+        return (1);
+    default:
+        return (0);
+    }
+}
+
+static int prog_eval (struct use_env_prog *p, int depth)
+{
+    int stack [16];
+    int sp = 0;
+    int pc;
+
+    for (pc = 0; pc < p->ninsns; pc++) {
+        struct insn *in = &p->insns [pc];
+        struct lex_item x, y;
+        char buf [1024];
+        const char *name;
+        int val = 0;
+
+        lex_location_set (p->path, in->line);
+
+        /*
+         *  Tests push at most two values, since parenthesized tests
+         *   may not themselves contain && or ||.
+         */
+        if (sp >= (int) (sizeof (stack) / sizeof (*stack)))
+            return (log_err ("Expression too complex\n"));
+
+        /*
+         *  Programs unpacked from the environment may not have come
+         *   from the parser, so never pop more values than were pushed.
+         */
+        if (sp < stack_pops (in->op))
+            return (log_err ("Invalid test expression\n"));
+
+        switch (in->op) {
+        case OP_SET:
+            name = operand_name (p, &in->x, buf, sizeof (buf));
+            if (!is_valid_identifier (name)) {
+                log_err ("Invalid identifier \"%s\" in expression\n", name);
+                break;
+            }
+            if (!condition ())
+                break;
+            operand_item (p, &in->y, &y);
+            env_var_set (name, item_str (&y), in->arg);
+            item_release (&y);
+            break;
+        case OP_UNSET:
+            name = operand_name (p, &in->x, buf, sizeof (buf));
+            if (!is_valid_identifier (name)) {
+                log_err ("Invalid identifier \"%s\" in unset\n", name);
+                break;
+            }
+            env_var_unset (name);
+            break;
+        case OP_PRINT:
+            if (!condition ())
+                break;
+            operand_item (p, &in->x, &x);
+            printf ("%s\n", item_str (&x));
+            item_release (&x);
+            break;
+        case OP_DEFINE:
+            name = operand_name (p, &in->x, buf, sizeof (buf));
+            if (!is_valid_identifier (name))
+                return (log_err ("Unable to define invalid identifier \"%s\"\n",
+                                 name));
+            if (!condition ())
+                break;
+            operand_item (p, &in->y, &y);
+            define_symbol (name, &y);
+            item_release (&y);
+            break;
+        case OP_UNDEF:
+            if (condition ())
+                sym_delete (prog_str (p, &in->x));
+            break;
+        case OP_SETOPT:
+            operand_item (p, &in->y, &y);
+            set_parser_option (prog_str (p, &in->x), &y);
+            item_release (&y);
+            break;
+        case OP_DUMP:
+            dump_item (operand_name (p, &in->x, buf, sizeof (buf)));
+            break;
+        case OP_INCLUDE:
+            if (include_file (p, in, depth) < 0)
+                return (-1);
+            break;
+        case OP_CMP:
+            operand_item (p, &in->x, &x);
+            operand_item (p, &in->y, &y);
+            val = cmp_items (in->arg, &x, &y);
+            item_release (&x);
+            item_release (&y);
+            if (val < 0)
+                return (-1);
+            stack [sp++] = val;
+            break;
+        case OP_DEFINED:
+            operand_item (p, &in->x, &x);
+            stack [sp++] = item_defined (&x);
+            item_release (&x);
+            break;
+        case OP_TEST:
+            operand_item (p, &in->x, &x);
+            stack [sp++] = test_item (&x);
+            item_release (&x);
+            break;
+        case OP_MATCH:
+            operand_item (p, &in->x, &x);
+            operand_item (p, &in->y, &y);
+            stack [sp++] = do_fnmatch (&x, &y);
+            item_release (&x);
+            item_release (&y);
+            break;
+        case OP_NOT:
+            val = stack [--sp];
+            stack [sp++] = condition () ? !val : 0;
+            break;
+        case OP_AND:
+            val = stack [--sp];
+            stack [sp - 1] = stack [sp - 1] && val;
+            break;
+        case OP_OR:
+            val = stack [--sp];
+            stack [sp - 1] = stack [sp - 1] || val;
+            break;
+        case OP_IF:
+            val = condition_push_if (stack [--sp]);
+            sp = 0;
+            if (val < 0)
+                return (-1);
+            pc = skip_block (p, pc, val);
+            break;
+        case OP_ELSE:
+            if ((val = condition_push_else ()) < 0)
+                return (-1);
+            pc = skip_block (p, pc, val);
+            break;
+        case OP_ELSE_IF_BEGIN:
+            condition_pop ();
+            break;
+        case OP_ELSE_IF:
+            val = condition_push_else_if (stack [--sp]);
+            sp = 0;
+            if (val < 0)
+                return (-1);
+            pc = skip_block (p, pc, val);
+            break;
+        case OP_ENDIF:
+            condition_pop_endif ();
+            break;
+        case OP_IN_TASK_BEGIN:
+            val = in_task_begin ();
+            pc = skip_block (p, pc, val);
+            break;
+        case OP_IN_TASK_END:
+            in_task_end ();
+            break;
+        }
+    }
 
     return (0);
 }
@@ -249,13 +876,17 @@ static int do_fnmatch (struct lex_item *x, struct lex_item *y)
     return (0);
 }
 
-static int item_defined (struct lex_item *i)
+static int item_check_defined (struct lex_item *i)
 {
     if (i->type != TYPE_SYM) {
         log_err ("use of `defined' keyword on non-symbol \"%s\"\n", i->name);
         return (-1);
     } 
-    
+    return (0);
+}
+
+static int item_defined (struct lex_item *i)
+{
     if (condition ())
         return (i->val.sym != NULL);
     else
@@ -319,7 +950,7 @@ static int set_parser_option (const char *option, struct lex_item *x)
     return (0);
 }
 
-static void dump_item (char *name)
+static void dump_item (const char *name)
 {
     if (condition() == 0)
         return;
@@ -328,9 +959,12 @@ static void dump_item (char *name)
         dump_symbols ();
     else if (strncmp (name, "keywords", strlen (name)) == 0)
         dump_keywords ();
+    else if (strncmp (name, "environment", strlen (name)) == 0)
+        dump_env_changes ();
     else if (strncmp (name, "all", strlen (name)) == 0) {
         dump_keywords ();
         dump_symbols ();
+        dump_env_changes ();
     } 
     else
         log_err ("Invalid argument \"%s\" to `dump' command\n", name);
@@ -338,26 +972,24 @@ static void dump_item (char *name)
     return;
 }
 
-static int define_symbol (char *name, struct lex_item *x)
+static int define_symbol (const char *name, struct lex_item *x)
 {
-    if (!is_valid_identifier (name)) {
-        log_err ("Unable to define invalid identifier \"%s\"\n", name);
-        return (-1);
-    }
-
     if (condition() == 0)
         return (0);
 
     log_verbose ("define %s = \"%s\"\n", name, item_str (x));
 
-    return (sym_define (name, item_str (x)) != NULL);
+    return (sym_define ((char *) name, item_str (x)) != NULL);
 }
 
 /****************************************************************************
  *  Environment manipulation
  ****************************************************************************/
 
-const char * xgetenv (const char *name)
+/*
+ *  Value of [name] in the environment, ignoring pending changes
+ */
+static const char * env_getenv (const char *name)
 {
     if (ctx.ops && ctx.ops->getenv)
         return ((*ctx.ops->getenv) (ctx.arg, name));
@@ -381,30 +1013,227 @@ int xsetenv (const char *name, const char *value, int overwrite)
         return (setenv (name, value, overwrite));
 }
 
-static char * env_var_add (char *buf, size_t size,
-        const char *orig, const char *val, int append)
+/*
+ *  Changes to the environment are not made as each assignment is
+ *   evaluated. Instead the resulting value of each variable, and where
+ *   it was last changed, is kept in a delta table which is applied once
+ *   at the end of use_env_eval(), in the order variables were first
+ *   changed. xgetenv() returns pending values, so evaluation sees the
+ *   same environment as if each change had been applied immediately.
+ */
+struct env_delta {
+    const char * name;  /* Variable name (interned)                     */
+    char *       orig;  /* Original value, NULL if unset                */
+    char *       value; /* Pending value, NULL if unset                 */
+    size_t       len;   /* Length of value                              */
+    size_t       size;  /* Size of value buffer                         */
+    const char * file;  /* Location of last change                      */
+    int          line;
+    int          count; /* Number of changes                            */
+};
+
+static hash_t env_deltas = NULL;      /* env_delta by name            */
+static List   env_delta_list = NULL;  /* env_delta in order of change */
+
+static void env_delta_destroy (struct env_delta *d)
 {
-    if (strlen (val) >= size)
-        return (NULL);
+    free (d->orig);
+    free (d->value);
+    free (d);
+}
+
+static int env_delta_reserve (struct env_delta *d, size_t len)
+{
+    size_t size = d->size ? d->size : 64;
+    char *new;
+
+    if (len + 1 <= d->size)
+        return (0);
+
+    while (len + 1 > size)
+        size *= 2;
 
-    if (strlen (orig) == 0)
-        return (strcpy (buf, val));
+    if (!(new = realloc (d->value, size)))
+        return (log_err ("Out of memory\n"));
 
-    if ((strlen (val) + strlen (orig) + 2) > size)
+    d->value = new;
+    d->size = size;
+    return (0);
+}
+
+static struct env_delta * env_delta_find (const char *name)
+{
+    return (hash_find (env_deltas, intern_lookup (name)));
+}
+
+/*
+ *  Return the delta for [name], creating it from the current
+ *   environment if necessary.
+ */
+static struct env_delta * env_delta_get (const char *name)
+{
+    struct env_delta *d;
+    const char *val;
+
+    if ((d = env_delta_find (name)))
+        return (d);
+
+    if (!env_deltas) {
+        env_deltas = hash_create (NULL);
+        env_delta_list = list_create ((ListDelF) env_delta_destroy);
+    }
+
+    if (!(d = malloc (sizeof (*d))))
         return (NULL);
+    memset (d, 0, sizeof (*d));
+
+    if (!(d->name = intern (name)))
+        goto nomem;
+
+    if ((val = env_getenv (name))) {
+        d->len = strlen (val);
+        if (!(d->orig = strdup (val)) || env_delta_reserve (d, d->len) < 0)
+            goto nomem;
+        memcpy (d->value, val, d->len + 1);
+    }
+
+    if (!hash_insert (env_deltas, d->name, d))
+        goto nomem;
+    list_append (env_delta_list, d);
+
+    return (d);
+
+nomem:
+    log_err ("Out of memory\n");
+    env_delta_destroy (d);
+    return (NULL);
+}
+
+static void env_delta_changed (struct env_delta *d)
+{
+    d->file = lex_file ();
+    d->line = lex_line ();
+    d->count++;
+}
+
+/*
+ *  Set pending value of [d] to [val], or add [val] to the end 
+ *   (APPEND) or beginning (PREPEND) of a non-empty value. The
+ *   value is updated in place so repeated appends don't copy it.
+ */
+static int env_delta_set (struct env_delta *d, const char *val, int op)
+{
+    size_t n = strlen (val);
+
+    if (d->value == NULL || d->len == 0 || (op != APPEND && op != PREPEND)) {
+        if (env_delta_reserve (d, n) < 0)
+            return (-1);
+        memcpy (d->value, val, n + 1);
+        d->len = n;
+    }
+    else if (env_delta_reserve (d, d->len + n + 1) < 0)
+        return (-1);
+    else if (op == APPEND) {
+        d->value [d->len] = ':';
+        memcpy (d->value + d->len + 1, val, n + 1);
+        d->len += n + 1;
+    }
+    else {
+        memmove (d->value + n + 1, d->value, d->len + 1);
+        memcpy (d->value, val, n);
+        d->value [n] = ':';
+        d->len += n + 1;
+    }
+
+    env_delta_changed (d);
+    return (0);
+}
+
+static void env_delta_unset (struct env_delta *d)
+{
+    free (d->value);
+    d->value = NULL;
+    d->len = d->size = 0;
+    env_delta_changed (d);
+}
+
+static int env_delta_apply (struct env_delta *d, void *arg)
+{
+    /*
+     *  Skip variables that ended up with their original value
+     */
+    if (d->value == NULL && d->orig == NULL)
+        return (0);
+    if (d->value && d->orig && strcmp (d->value, d->orig) == 0)
+        return (0);
+
+    lex_location_set (d->file, d->line);
+
+    log_debug ("applying %s = \"%s\" (%d change%s)\n", d->name, 
+               d->value ? d->value : "(unset)", d->count, 
+               d->count == 1 ? "" : "s");
 
-    if (append)
-        snprintf (buf, size, "%s:%s", orig, val);
+    if (d->value == NULL) {
+        if (xunsetenv (d->name) < 0)
+            log_err ("unsetenv (%s): %s\n", d->name, strerror (errno));
+    }
+    else if (xsetenv (d->name, d->value, 1) < 0)
+        log_err ("setenv (%s): %s\n", d->name, strerror (errno));
+
+    return (0);
+}
+
+static void env_deltas_apply (void)
+{
+    if (env_delta_list) {
+        list_for_each (env_delta_list, (ListForF) env_delta_apply, NULL);
+        list_destroy (env_delta_list);
+    }
+    hash_destroy (env_deltas);
+    env_deltas = NULL;
+    env_delta_list = NULL;
+    lex_location_set (NULL, 0);
+}
+
+static int print_env_delta (struct env_delta *d, void *arg)
+{
+    const char *file;
+
+    if (d->value == NULL && d->orig == NULL)
+        return (0);
+    if (d->value && d->orig && strcmp (d->value, d->orig) == 0)
+        return (0);
+
+    file = strrchr (d->file, '/') ? strrchr (d->file, '/') + 1 : d->file;
+
+    if (d->value == NULL)
+        log_msg ("-%s (%s: %d)\n", d->name, file, d->line);
     else
-        snprintf (buf, size, "%s:%s", val, orig);
+        log_msg ("%s%s = \"%s\" (%s: %d)\n", d->orig ? " " : "+", 
+                 d->name, d->value, file, d->line);
+    return (0);
+}
 
-    return (buf);
+static void dump_env_changes (void)
+{
+    log_msg ("Dumping environment changes\n");
+    if (env_delta_list)
+        list_for_each (env_delta_list, (ListForF) print_env_delta, NULL);
 }
 
-static int env_var_unset (char *name)
+const char * xgetenv (const char *name)
 {
-    if (!is_valid_identifier (name))
-        return (log_err ("Invalid identifier \"%s\" in unset\n", name));
+    struct env_delta *d;
+
+    if ((d = env_delta_find (name)))
+        return (d->value);
+
+    return (env_getenv (name));
+}
+
+static int env_var_unset (const char *name)
+{
+    struct env_delta *d;
 
     if (condition () == 0)
         return (0);
@@ -414,43 +1243,47 @@ static int env_var_unset (char *name)
     /* 
      * Delete any references to this value in the local env_cache
      */
-    env_cache_delete (name);
+    env_cache_delete ((char *) name);
 
-    if (xunsetenv (name) < 0)
-        return ((log_err ("unsetenv (%s): %s\n", name, strerror (errno))));
+    if (!(d = env_delta_get (name)))
+        return (-1);
+
+    env_delta_unset (d);
 
     return (0);
 }
 
 
-static int env_var_set (char *name, char *val, int op)
+static int env_var_set (const char *name, char *val, int op)
 {
-    char buf [4096];
-    const char *orig = NULL;
-    char *newval = val;
-    int overwrite = 1;
-
-    if (!is_valid_identifier (name))
-        return (log_err ("Invalid identifier \"%s\" in expression\n", name));
+    struct env_delta *d;
 
     if (condition () == 0)
         return (0);
 
-    if (op == COND_SET)
-        overwrite = 0;
+    if (!(d = env_delta_get (name)))
+        return (-1);
 
-    if (((op == APPEND) || (op == PREPEND)) && (orig = xgetenv (name)))
-        newval = env_var_add (buf, sizeof (buf), orig, val, op == APPEND);
+    /*
+     *  |= only sets variables that aren't already set
+     */
+    if (op == COND_SET && d->value != NULL) {
+        log_verbose ("setenv (%s, \"%s\", overwrite=0)\n", name, val);
+        return (0);
+    }
 
     /* 
      * Delete any references to this value in the local env_cache
      */
-    env_cache_delete (name);
+    env_cache_delete ((char *) name);
+
+    if (env_delta_set (d, val, op) < 0)
+        return (-1);
 
     log_verbose ("setenv (%s, \"%s\", overwrite=%d)\n", 
-                 name, newval, overwrite);
+                 name, d->value, op != COND_SET);
 
-    return (xsetenv (name, newval, overwrite));
+    return (0);
 }
 
 
@@ -551,9 +1384,12 @@ static int condition_pop ()
     int rv;
     struct cond *c;
 
-
-    if (!(c = list_pop (cond_stack))) 
-        return (log_err ("else/endif without if"));
+    /*
+     *  Never pop the initial condition, as an else or endif left
+     *   unmatched by a syntax error would.
+     */
+    if (list_count (cond_stack) <= 1 || !(c = list_pop (cond_stack))) 
+        return (log_err ("else/endif without if\n"));
 
     log_debug2 ("Popped old condition %d\n", c->val);
 
@@ -635,11 +1471,10 @@ static int in_task_end (void)
 
 void use_env_parser_init (int in_task)
 {
-    ctx.in_task = in_task;
     /*
-     *  Keytab created on-demand
+     *  Keytab created on-demand, condition stack for each evaluation
      */
-    condition_init ();
+    ctx.in_task = in_task;
 }
 
 void use_env_set_operations (struct use_env_ops *ops, void *arg)
@@ -648,27 +1483,58 @@ void use_env_set_operations (struct use_env_ops *ops, void *arg)
     ctx.arg = arg;
 }
 
+struct use_env_prog * use_env_compile (const char *filename)
+{
+    return (prog_compile (filename, 0));
+}
+
+int use_env_eval (struct use_env_prog *p)
+{
+    const char *key = intern (p->path);
+    int rc;
+
+    if (!active)
+        active = hash_create (NULL);
+
+    condition_init ();
+    hash_insert (active, key, p);
+
+    rc = prog_eval (p, 0);
+
+    env_deltas_apply ();
+    hash_delete (active, key);
+    condition_fini ();
+    symtab_destroy ();
+    lex_location_set (NULL, 0);
+
+    return (rc);
+}
+
 int use_env_parse (const char *filename)
 {
-    if (lex_file_init (filename) < 0) {
-        log_err ("Failed to open config file %s\n", filename);
-        return (-1);
-    }
+    struct use_env_prog *p;
+    int rc;
 
-    if (yyparse ()) {
-        log_err ("%s: Parser failed.\n", filename);
+    if (!(p = use_env_compile (filename)))
         return (-1);
-    }
 
-    lex_fini ();
+    if ((rc = use_env_eval (p)) < 0)
+        log_err ("%s: Parser failed.\n", p->path);
 
-    return (0);
+    use_env_prog_destroy (p);
+
+    return (rc);
 }
 
 void use_env_parser_fini ()
 {
     condition_fini ();
     keytab_destroy ();
+    symtab_destroy ();
+    lex_fini ();
+    hash_destroy (active);
+    active = NULL;
+    intern_fini ();
 }
 
 /*
@@ -0,0 +1,743 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+/*
+ *  Compiled use-env programs: construction, and encoding of the
+ *   task context parts of a program as a printable string so that
+ *   they can be passed from srun to remote tasks in the environment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+
+#include "use-env.h"
+#include "use-env-prog.h"
+#include "log_msg.h"
+
+/****************************************************************************
+ *  Program construction
+ ****************************************************************************/
+
+struct use_env_prog * prog_create (const char *path)
+{
+    struct use_env_prog *p = malloc (sizeof (*p));
+
+    if (p == NULL)
+        return (NULL);
+
+    memset (p, 0, sizeof (*p));
+
+    p->path = strdup (path ? path : "stdin");
+    p->includes = hash_create ((hash_del_f) use_env_prog_destroy);
+
+    if (!p->path || !p->includes) {
+        use_env_prog_destroy (p);
+        return (NULL);
+    }
+
+    return (p);
+}
+
+void use_env_prog_destroy (struct use_env_prog *p)
+{
+    if (p == NULL)
+        return;
+    hash_destroy (p->includes);
+    free (p->path);
+    free (p->insns);
+    free (p->strings);
+    free (p);
+}
+
+const char * use_env_prog_path (struct use_env_prog *p)
+{
+    return (p->path);
+}
+
+struct insn * prog_insn_append (struct use_env_prog *p)
+{
+    struct insn *i;
+
+    if (p->ninsns == p->maxinsns) {
+        int n = p->maxinsns ? 2 * p->maxinsns : 64;
+        struct insn *new = realloc (p->insns, n * sizeof (*new));
+
+        if (new == NULL)
+            return (NULL);
+        p->insns = new;
+        p->maxinsns = n;
+    }
+
+    i = &p->insns [p->ninsns++];
+    memset (i, 0, sizeof (*i));
+    i->x.str = i->y.str = -1;
+
+    return (i);
+}
+
+static int prog_strndup (struct use_env_prog *p, const char *str, int n)
+{
+    int off = p->len;
+
+    if (p->len + n + 1 > p->size) {
+        int size = p->size ? p->size : 1024;
+        char *new;
+
+        while (p->len + n + 1 > size)
+            size *= 2;
+        if (!(new = realloc (p->strings, size)))
+            return (-1);
+        p->strings = new;
+        p->size = size;
+    }
+
+    memcpy (p->strings + off, str, n);
+    p->strings [off + n] = '\0';
+    p->len += n + 1;
+
+    return (off);
+}
+
+int prog_strdup (struct use_env_prog *p, const char *str)
+{
+    return (prog_strndup (p, str, strlen (str)));
+}
+
+char * prog_str (struct use_env_prog *p, struct operand *o)
+{
+    return (p->strings + o->str);
+}
+
+char * prog_include_path (struct use_env_prog *p, const char *include, 
+    char *buf, size_t len)
+{
+    char *path;
+    char *prefix;
+
+    if (include[0] == '/') {
+        snprintf (buf, len, "%s", include);
+        return (buf);
+    }
+
+    if ((path = strdup (p->path)) == NULL)
+        return (NULL);
+
+    if (strcmp ("stdin", path) == 0)
+        prefix = ".";
+    else 
+        prefix = dirname (path);
+
+    snprintf (buf, len, "%s/%s", prefix, include);
+
+    buf [len - 1] = '\0';
+
+    free (path);
+
+    return (buf);
+}
+
+/****************************************************************************
+ *  Packing
+ ****************************************************************************/
+
+/*
+ *  Packed programs are a sequence of 32 bit big-endian integers and
+ *   length-prefixed strings (length -1 for none):
+ *
+ *   prog    := path noskip ninsns insn* nincludes (path prog)*
+ *   insn    := op arg line flags operand operand
+ *   operand := type num tmpl string
+ *
+ *  For the top level program only the outermost `in task' blocks are
+ *   packed, since nothing else is evaluated in task context. Included
+ *   files are packed whole if they were compiled along with the file
+ *   including them; others are compiled when they are evaluated.
+ */
+#define PACK_MAGIC 0x55450001
+
+struct pack {
+    char * buf;
+    size_t len;
+    size_t size;
+    int    err;
+};
+
+static void pack_bytes (struct pack *pk, const void *data, size_t n)
+{
+    if (pk->err)
+        return;
+
+    if (pk->len + n > pk->size) {
+        size_t size = pk->size ? pk->size : 1024;
+        char *new;
+
+        while (pk->len + n > size)
+            size *= 2;
+        if (!(new = realloc (pk->buf, size))) {
+            pk->err = 1;
+            return;
+        }
+        pk->buf = new;
+        pk->size = size;
+    }
+
+    memcpy (pk->buf + pk->len, data, n);
+    pk->len += n;
+}
+
+static void pack_int (struct pack *pk, int val)
+{
+    unsigned int v = val;
+    unsigned char b [4];
+
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+
+    pack_bytes (pk, b, 4);
+}
+
+static void pack_str (struct pack *pk, const char *s)
+{
+    if (s == NULL) {
+        pack_int (pk, -1);
+        return;
+    }
+    pack_int (pk, strlen (s));
+    pack_bytes (pk, s, strlen (s));
+}
+
+static void pack_operand (struct pack *pk, struct use_env_prog *p,
+    struct operand *o)
+{
+    pack_int (pk, o->type);
+    pack_int (pk, o->num);
+    pack_int (pk, o->tmpl);
+    pack_str (pk, o->str >= 0 ? prog_str (p, o) : NULL);
+}
+
+static int is_branch (int op)
+{
+    return (op == OP_IF || op == OP_ELSE || op == OP_ELSE_IF 
+         || op == OP_IN_TASK_BEGIN);
+}
+
+/*
+ *  Get the next range [start, end] of instructions of [p] to pack,
+ *   beginning the search at *pcp. Returns 0 when there are no more.
+ */
+static int next_range (struct use_env_prog *p, int task_only, int *pcp,
+    int *startp, int *endp)
+{
+    int pc = *pcp;
+
+    if (!task_only) {
+        if (pc >= p->ninsns)
+            return (0);
+        *startp = pc;
+        *endp = p->ninsns - 1;
+    }
+    else {
+        while (pc < p->ninsns && p->insns [pc].op != OP_IN_TASK_BEGIN)
+            pc++;
+        if (pc >= p->ninsns)
+            return (0);
+        *startp = pc;
+        *endp = p->insns [pc].arg;
+    }
+
+    *pcp = *endp + 1;
+    return (1);
+}
+
+/*
+ *  Return the compiled include for OP_INCLUDE instruction [in], if any.
+ */
+static struct use_env_prog * include_prog (struct use_env_prog *p, 
+    struct insn *in, const char **pathp)
+{
+    static char buf [4096];
+    const char *path;
+
+    if (in->op != OP_INCLUDE || in->x.tmpl)
+        return (NULL);
+
+    path = prog_include_path (p, prog_str (p, &in->x), buf, sizeof (buf));
+    if (path == NULL)
+        return (NULL);
+
+    *pathp = path;
+    return (hash_find (p->includes, intern_lookup (path)));
+}
+
+static void pack_prog (struct pack *pk, struct use_env_prog *p, int task_only)
+{
+    int start, end;
+    int pc;
+    int n = 0;
+
+    pack_str (pk, p->path);
+    pack_int (pk, p->noskip);
+
+    pc = 0;
+    while (next_range (p, task_only, &pc, &start, &end))
+        n += end - start + 1;
+    pack_int (pk, n);
+
+    /*
+     *  Block ends are rebased to the index of the packed instruction
+     */
+    n = 0;
+    pc = 0;
+    while (next_range (p, task_only, &pc, &start, &end)) {
+        int i;
+        for (i = start; i <= end; i++) {
+            struct insn *in = &p->insns [i];
+            int arg = in->arg;
+
+            if (is_branch (in->op) && arg >= 0)
+                arg = arg - start + n;
+
+            pack_int (pk, in->op);
+            pack_int (pk, arg);
+            pack_int (pk, in->line);
+            pack_int (pk, in->flags);
+            pack_operand (pk, p, &in->x);
+            pack_operand (pk, p, &in->y);
+        }
+        n += end - start + 1;
+    }
+
+    n = 0;
+    pc = 0;
+    while (next_range (p, task_only, &pc, &start, &end)) {
+        const char *path;
+        int i;
+        for (i = start; i <= end; i++)
+            if (include_prog (p, &p->insns [i], &path))
+                n++;
+    }
+    pack_int (pk, n);
+
+    pc = 0;
+    while (next_range (p, task_only, &pc, &start, &end)) {
+        struct use_env_prog *inc;
+        const char *path;
+        int i;
+        for (i = start; i <= end; i++) {
+            if ((inc = include_prog (p, &p->insns [i], &path))) {
+                pack_str (pk, path);
+                pack_prog (pk, inc, 0);
+            }
+        }
+    }
+}
+
+static const char b64 [] = 
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char * base64_encode (const unsigned char *data, size_t len)
+{
+    char *s = malloc (4 * ((len + 2) / 3) + 1);
+    char *q = s;
+    size_t i;
+
+    if (s == NULL)
+        return (NULL);
+
+    for (i = 0; i < len; i += 3) {
+        unsigned int v = data [i] << 16;
+        if (i + 1 < len)
+            v |= data [i+1] << 8;
+        if (i + 2 < len)
+            v |= data [i+2];
+
+        *q++ = b64 [(v >> 18) & 0x3f];
+        *q++ = b64 [(v >> 12) & 0x3f];
+        *q++ = (i + 1 < len) ? b64 [(v >> 6) & 0x3f] : '=';
+        *q++ = (i + 2 < len) ? b64 [v & 0x3f] : '=';
+    }
+    *q = '\0';
+
+    return (s);
+}
+
+char * use_env_task_pack (struct use_env_prog *p)
+{
+    struct pack pk = { NULL, 0, 0, 0 };
+    char *s;
+    int i;
+
+    /*
+     *  Block structure of a file with syntax errors can't be trusted
+     */
+    if (p->noskip)
+        return (NULL);
+
+    for (i = 0; i < p->ninsns; i++)
+        if (p->insns [i].op == OP_IN_TASK_BEGIN)
+            break;
+    if (i == p->ninsns)
+        return (strdup (""));
+
+    pack_int (&pk, PACK_MAGIC);
+    pack_prog (&pk, p, 1);
+
+    if (pk.err) {
+        free (pk.buf);
+        return (NULL);
+    }
+
+    s = base64_encode ((unsigned char *) pk.buf, pk.len);
+    free (pk.buf);
+
+    return (s);
+}
+
+/****************************************************************************
+ *  Unpacking
+ ****************************************************************************/
+
+struct unpack {
+    const unsigned char * p;
+    size_t                left;
+    int                   err;
+};
+
+static int unpack_int (struct unpack *u)
+{
+    unsigned int v;
+
+    if (u->err || u->left < 4) {
+        u->err = 1;
+        return (0);
+    }
+
+    v = ((unsigned int) u->p[0] << 24) | (u->p[1] << 16) | (u->p[2] << 8)
+      | u->p[3];
+    u->p += 4;
+    u->left -= 4;
+
+    return ((int) v);
+}
+
+/*
+ *  Unpack a string into the string pool of [p], returning its offset
+ *   or -1 if there is no string (or on error).
+ */
+static int unpack_str (struct unpack *u, struct use_env_prog *p)
+{
+    int n = unpack_int (u);
+    int off;
+
+    if (u->err || n < 0)
+        return (-1);
+
+    if ((size_t) n > u->left || memchr (u->p, '\0', n)) {
+        u->err = 1;
+        return (-1);
+    }
+
+    if ((off = prog_strndup (p, (const char *) u->p, n)) < 0)
+        u->err = 1;
+
+    u->p += n;
+    u->left -= n;
+
+    return (off);
+}
+
+static void unpack_operand (struct unpack *u, struct use_env_prog *p,
+    struct operand *o)
+{
+    o->type = unpack_int (u);
+    o->num  = unpack_int (u);
+    o->tmpl = unpack_int (u);
+    o->str  = unpack_str (u, p);
+
+    if (o->type != TYPE_STR && o->type != TYPE_INT && o->type != TYPE_SYM)
+        u->err = 1;
+}
+
+/*
+ *  Check that the operands instruction [pc] uses are present.
+ */
+static int insn_valid (struct use_env_prog *p, int pc)
+{
+    struct insn *in = &p->insns [pc];
+    int x = 0, y = 0;
+
+    switch (in->op) {
+    case OP_SET:
+    case OP_DEFINE:
+    case OP_SETOPT:
+    case OP_CMP:
+    case OP_MATCH:
+        y = 1;
+        /* fall through */
+    case OP_UNSET:
+    case OP_PRINT:
+    case OP_UNDEF:
+    case OP_DUMP:
+    case OP_INCLUDE:
+    case OP_DEFINED:
+    case OP_TEST:
+        x = 1;
+        break;
+    default:
+        if (in->op < 0 || in->op >= OP_COUNT)
+            return (0);
+    }
+
+    return ((!x || in->x.str >= 0) && (!y || in->y.str >= 0));
+}
+
+/*
+ *  Check that the blocks of [p] nest as the parser would have emitted
+ *   them, with each block beginning pointing to the instruction that
+ *   ends it, since the evaluator relies on this to keep its condition
+ *   stack balanced.
+ */
+static int blocks_valid (struct use_env_prog *p)
+{
+    int blocks [MAX_BLOCK_DEPTH];
+    int nblocks = 0;
+    int else_if = 0;
+    int pc;
+
+    for (pc = 0; pc < p->ninsns; pc++) {
+        int op = p->insns [pc].op;
+        int top = nblocks ? p->insns [blocks [nblocks - 1]].op : -1;
+
+        /*
+         *  Only tests may come between `else if' and its condition
+         */
+        if (else_if && op != OP_ELSE_IF && (op < OP_CMP || op > OP_OR))
+            return (0);
+
+        switch (op) {
+        case OP_ELSE:
+        case OP_ELSE_IF_BEGIN:
+            if (top != OP_IF && top != OP_ELSE_IF)
+                return (0);
+            break;
+        case OP_ENDIF:
+            if (top != OP_IF && top != OP_ELSE_IF && top != OP_ELSE)
+                return (0);
+            break;
+        case OP_IN_TASK_END:
+            if (top != OP_IN_TASK_BEGIN)
+                return (0);
+            break;
+        case OP_ELSE_IF:
+            if (!else_if)
+                return (0);
+            break;
+        }
+
+        switch (op) {
+        case OP_ELSE:
+        case OP_ELSE_IF_BEGIN:
+        case OP_ENDIF:
+        case OP_IN_TASK_END:
+            if (p->insns [blocks [--nblocks]].arg != pc)
+                return (0);
+            break;
+        }
+
+        else_if = (op == OP_ELSE_IF_BEGIN);
+
+        switch (op) {
+        case OP_IF:
+        case OP_ELSE:
+        case OP_ELSE_IF:
+        case OP_IN_TASK_BEGIN:
+            if (nblocks == MAX_BLOCK_DEPTH)
+                return (0);
+            blocks [nblocks++] = pc;
+            break;
+        }
+    }
+
+    return (nblocks == 0 && !else_if);
+}
+
+static struct use_env_prog * unpack_prog (struct unpack *u, int depth)
+{
+    struct use_env_prog *p;
+    int n, i;
+
+    if (depth > MAX_INCLUDE_DEPTH || !(p = prog_create ("")))
+        return (NULL);
+
+    /*
+     *  The path is unpacked into the string pool and then copied
+     */
+    if ((i = unpack_str (u, p)) < 0)
+        goto fail;
+    free (p->path);
+    if (!(p->path = strdup (p->strings + i)))
+        goto fail;
+
+    p->noskip = unpack_int (u);
+
+    /*
+     *  Each instruction takes at least 40 bytes
+     */
+    n = unpack_int (u);
+    if (u->err || n < 0 || (size_t) n > u->left / 40)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        struct insn *in = prog_insn_append (p);
+
+        if (in == NULL)
+            goto fail;
+
+        in->op    = unpack_int (u);
+        in->arg   = unpack_int (u);
+        in->line  = unpack_int (u);
+        in->flags = unpack_int (u);
+        unpack_operand (u, p, &in->x);
+        unpack_operand (u, p, &in->y);
+
+        if (u->err)
+            goto fail;
+    }
+
+    for (i = 0; i < n; i++)
+        if (!insn_valid (p, i))
+            goto fail;
+
+    if (!blocks_valid (p))
+        goto fail;
+
+    n = unpack_int (u);
+    if (u->err || n < 0)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        struct use_env_prog *inc;
+        const char *key;
+        int off;
+
+        if ((off = unpack_str (u, p)) < 0)
+            goto fail;
+        if (!(key = intern (p->strings + off)))
+            goto fail;
+        if (!(inc = unpack_prog (u, depth + 1)))
+            goto fail;
+        if (!hash_insert (p->includes, key, inc)) {
+            use_env_prog_destroy (inc);
+            goto fail;
+        }
+    }
+
+    return (p);
+
+fail:
+    u->err = 1;
+    use_env_prog_destroy (p);
+    return (NULL);
+}
+
+static int b64_val (int c)
+{
+    const char *s = (c != '\0') ? strchr (b64, c) : NULL;
+    return (s ? s - b64 : -1);
+}
+
+static unsigned char * base64_decode (const char *s, size_t *lenp)
+{
+    size_t n = strlen (s);
+    unsigned char *buf;
+    size_t i, len = 0;
+
+    if (n % 4)
+        return (NULL);
+
+    if (!(buf = malloc (3 * (n / 4) + 1)))
+        return (NULL);
+
+    for (i = 0; i < n; i += 4) {
+        int a = b64_val (s[i]);
+        int b = b64_val (s[i+1]);
+        int c = (s[i+2] == '=' && i + 4 == n) ? 0 : b64_val (s[i+2]);
+        int d = (s[i+3] == '=' && i + 4 == n) ? 0 : b64_val (s[i+3]);
+        unsigned int v;
+
+        if (  a < 0 || b < 0 || c < 0 || d < 0 
+           || (s[i+2] == '=' && s[i+3] != '=')) {
+            free (buf);
+            return (NULL);
+        }
+
+        v = (a << 18) | (b << 12) | (c << 6) | d;
+        buf [len++] = v >> 16;
+        if (s[i+2] != '=')
+            buf [len++] = v >> 8;
+        if (s[i+3] != '=')
+            buf [len++] = v;
+    }
+
+    *lenp = len;
+    return (buf);
+}
+
+struct use_env_prog * use_env_task_unpack (const char *s)
+{
+    struct use_env_prog *p = NULL;
+    struct unpack u;
+    unsigned char *buf;
+    size_t len;
+
+    if (!(buf = base64_decode (s, &len))) {
+        log_err ("Invalid packed task program\n");
+        return (NULL);
+    }
+
+    u.p = buf;
+    u.left = len;
+    u.err = 0;
+
+    if (unpack_int (&u) == PACK_MAGIC)
+        p = unpack_prog (&u, 0);
+
+    if (!p || u.left != 0) {
+        log_err ("Invalid packed task program\n");
+        use_env_prog_destroy (p);
+        p = NULL;
+    }
+
+    free (buf);
+    return (p);
+}
+
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
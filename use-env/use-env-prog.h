@@ -0,0 +1,124 @@
+/*****************************************************************************
+ *
+ *  Copyright (C) 2007-2008 Lawrence Livermore National Security, LLC.
+ *  Produced at Lawrence Livermore National Laboratory.
+ *  Written by Mark Grondona <mgrondona@llnl.gov>.
+ *
+ *  UCRL-CODE-235358
+ *
+ *  This file is part of chaos-spankings, a set of spank plugins for SLURM.
+ *
+ *  This is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ ****************************************************************************/
+
+
+#ifndef _USE_ENV_PROG_H
+#define _USE_ENV_PROG_H
+
+#include <stddef.h>
+
+#include "hash.h"
+
+#define MAX_INCLUDE_DEPTH 20
+#define MAX_BLOCK_DEPTH   256
+
+/*
+ *  Opcodes of compiled programs. Tests are evaluated in postfix order
+ *   on a small value stack; IF, ELSE_IF, ELSE and IN_TASK_BEGIN hold
+ *   the index of the instruction ending their block, which is skipped
+ *   when the pushed condition is false.
+ */
+enum {
+    OP_SET,             /* x op= y                                      */
+    OP_UNSET,           /* unset x                                      */
+    OP_PRINT,           /* print x                                      */
+    OP_DEFINE,          /* define x = y                                 */
+    OP_UNDEF,           /* undefine x                                   */
+    OP_SETOPT,          /* set x y                                      */
+    OP_DUMP,            /* dump x                                       */
+    OP_INCLUDE,         /* include x                                    */
+    OP_CMP,             /* push (x cmp y)                               */
+    OP_DEFINED,         /* push (defined x)                             */
+    OP_TEST,            /* push (x)                                     */
+    OP_MATCH,           /* push (y matches x)                           */
+    OP_NOT,
+    OP_AND,
+    OP_OR,
+    OP_IF,
+    OP_ELSE,
+    OP_ELSE_IF_BEGIN,   /* pop condition of previous if/else if         */
+    OP_ELSE_IF,
+    OP_ENDIF,
+    OP_IN_TASK_BEGIN,
+    OP_IN_TASK_END,
+    OP_COUNT
+};
+
+/*
+ *  Instruction flags
+ */
+#define INSN_HAS_TASK_BLOCK 0x1 /* Block contains an `in task' block    */
+
+struct operand {
+    int type;           /* Type of item (int, string, symbol)           */
+    int str;            /* Offset of item name in string pool, or -1    */
+    int num;            /* Value if type is TYPE_INT                    */
+    int tmpl;           /* Nonzero if string contains symbol references */
+};
+
+struct insn {
+    int op;             /* Opcode                                       */
+    int arg;            /* Assignment op, comparison, or end of block   */
+    int line;           /* Line in source file                          */
+    int flags;          /* INSN_* flags                                 */
+    struct operand x;
+    struct operand y;
+};
+
+struct use_env_prog {
+    char *        path;     /* Source file                              */
+    struct insn * insns;    /* Instructions                             */
+    int           ninsns;
+    int           maxinsns;
+    char *        strings;  /* String pool                              */
+    int           len;
+    int           size;
+    int           noskip;   /* Never skip blocks (file had errors)      */
+    hash_t        includes; /* Compiled include files by interned path  */
+};
+
+struct use_env_prog * prog_create (const char *path);
+
+/*
+ *  Append a new instruction with no operands to [p], returning NULL
+ *   if out of memory.
+ */
+struct insn * prog_insn_append (struct use_env_prog *p);
+
+/*
+ *  Copy [str] into the string pool of [p], returning its offset.
+ */
+int prog_strdup (struct use_env_prog *p, const char *str);
+char * prog_str (struct use_env_prog *p, struct operand *o);
+
+/*
+ *  Place the path of file [include], included from [p], into [buf].
+ */
+char * prog_include_path (struct use_env_prog *p, const char *include,
+    char *buf, size_t len);
+
+#endif /* !_USE_ENV_PROG_H */
+/*
+ * vi: ts=4 sw=4 expandtab
+ */
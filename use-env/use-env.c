@@ -44,6 +44,15 @@
 #define SYSCONFDIR   "/etc/slurm/"
 #endif
 
+/*
+ *  The `in task' blocks of env files read by srun are passed to remote
+ *   tasks in this variable as TASK_ENV_VERSION followed by a comma
+ *   separated list of packed programs.
+ */
+#define TASK_ENV_VAR     "SPANK_USE_ENV_TASK"
+#define TASK_ENV_VERSION "1:"
+#define TASK_ENV_MAX     (64 * 1024)
+
 
 SPANK_PLUGIN(use-env, 1)
 
@@ -57,6 +66,8 @@ static int disable_use_env =  0;         /*  Disable the plugin           */
 static int disable_in_task =  0;         /*  Don't run in task if nonzero */
 static char * default_name = "default";  /*  Name of system default file  */
 static List   env_list     = NULL;       /*  Global list of files to read */
+static List   prog_list    = NULL;       /*  env_list compiled for tasks  */
+static char * task_env     = NULL;       /*  Task programs from srun      */
 static char * home         = NULL;       /*  $HOME                        */
 
 /****************************************************************************
@@ -99,6 +110,11 @@ static int process_args (int ac, char **av);
 static char * xgetenv_copy (const char *var);
 static char * env_override_file_search (char *, size_t, const char *, int);
 static int do_env_override (const char *path, spank_t sp);
+static int compile_env_file (const char *path, List l);
+static int eval_env_file (struct use_env_prog *prog, spank_t sp);
+static int task_env_set (List progs);
+static char * task_env_get (spank_t sp);
+static int unpack_task_env (List progs);
 static int define_all_keywords (spank_t sp);
 
 /****************************************************************************
@@ -122,6 +138,12 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
     if (process_args (ac, av) < 0)
         return (-1);
 
+    /*
+     *  Never pass on task programs from an enclosing job
+     */
+    if (!spank_remote (sp))
+        unsetenv (TASK_ENV_VAR);
+
     env_list = list_create ((ListDelF) free);
 
     /*
@@ -149,18 +171,26 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
     }
 
     /*
-     *  Check for default files in the following order:
-     *   /etc/slurm/environment/default || /etc/slurm/env-default.conf
-     *   ~/.slurm/environment/default   || ~/.slurm/env-default.conf
+     *  If srun passed on the `in task' blocks of the files it read,
+     *   then there are no files to look for on this node.
      */
-    if (env_override_file_search (buf, len, default_name, NO_SEARCH_USER))
-        list_append (env_list, strdup (buf));
-    
-    /*
-     *  Always use name "default" for user default environment
-     */
-    if (env_override_file_search (buf, len, "default", NO_SEARCH_SYSTEM))
-        list_append (env_list, strdup (buf));
+    if (spank_remote (sp) && (task_env = task_env_get (sp)))
+        slurm_verbose ("use-env: using task env from srun");
+    else {
+        /*
+         *  Check for default files in the following order:
+         *   /etc/slurm/environment/default || /etc/slurm/env-default.conf
+         *   ~/.slurm/environment/default   || ~/.slurm/env-default.conf
+         */
+        if (env_override_file_search (buf, len, default_name, NO_SEARCH_USER))
+            list_append (env_list, strdup (buf));
+
+        /*
+         *  Always use name "default" for user default environment
+         */
+        if (env_override_file_search (buf, len, "default", NO_SEARCH_SYSTEM))
+            list_append (env_list, strdup (buf));
+    }
 
     /*
      *  Initialize logging and parser:
@@ -181,20 +211,84 @@ int slurm_spank_init (spank_t sp, int ac, char **av)
     return (0);
 }
 
+/*
+ *  Evaluate env files in srun, whose environment is propagated to the
+ *   remote tasks. Their `in task' blocks are passed on as well, so that
+ *   remote nodes don't have to read the files again.
+ */
 int slurm_spank_local_user_init (spank_t sp, int ac, char **av)
 {
+    struct use_env_prog *prog;
+    ListIterator i;
+    List progs;
+    char *path;
+    int failed = 0;
+
     if (disable_use_env)
         return (0);
 
     if (define_all_keywords (sp) < 0)
         return (-1);
 
-    list_for_each (env_list, (ListForF) do_env_override, NULL);
+    progs = list_create ((ListDelF) use_env_prog_destroy);
+
+    i = list_iterator_create (env_list);
+    while ((path = list_next (i))) {
+        slurm_verbose ("use_env_compile (%s)", path);
+        if (!(prog = use_env_compile (path))) {
+            slurm_error ("--use-env: Errors reading %s\n", path);
+            failed = 1;
+            continue;
+        }
+        list_append (progs, prog);
+        eval_env_file (prog, sp);
+    }
+    list_iterator_destroy (i);
+
+    /*
+     *  If any file couldn't be compiled, tasks read the files instead
+     */
+    if (!failed)
+        task_env_set (progs);
+
+    list_destroy (progs);
     list_destroy (env_list);
 
     return (0);
 }
 
+/*
+ *  Compile env files once in slurmstepd so that each task only has to
+ *   evaluate them. Messages from this context don't reach the user, so
+ *   compile quietly: if any file fails, the files are parsed (and errors
+ *   reported) in each task instead.
+ */
+int slurm_spank_user_init (spank_t sp, int ac, char **av)
+{
+    int quiet;
+
+    if (disable_use_env || !spank_remote (sp))
+        return (0);
+
+    prog_list = list_create ((ListDelF) use_env_prog_destroy);
+
+    if (task_env) {
+        if (unpack_task_env (prog_list) < 0)
+            slurm_error ("use-env: Invalid %s, skipping in task blocks", 
+                         TASK_ENV_VAR);
+        return (0);
+    }
+
+    quiet = log_msg_set_quiet (1);
+    if (list_for_each (env_list, (ListForF) compile_env_file, prog_list) < 0) {
+        list_destroy (prog_list);
+        prog_list = NULL;
+    }
+    log_msg_set_quiet (quiet);
+
+    return (0);
+}
+
 int slurm_spank_task_init (spank_t sp, int ac, char **av)
 {
     /*
@@ -203,10 +297,16 @@ int slurm_spank_task_init (spank_t sp, int ac, char **av)
      */
     use_env_set_operations (&spank_env_ops, sp);
 
+    if (task_env)
+        spank_unsetenv (sp, TASK_ENV_VAR);
+
     if (define_all_keywords (sp) < 0)
         return (-1);
 
-    list_for_each (env_list, (ListForF) do_env_override, (void *) sp);
+    if (prog_list)
+        list_for_each (prog_list, (ListForF) eval_env_file, (void *) sp);
+    else
+        list_for_each (env_list, (ListForF) do_env_override, (void *) sp);
     list_destroy (env_list);
     return (0);
 }
@@ -216,6 +316,9 @@ int slurm_spank_exit (spank_t sp, int ac, char **av)
     if (disable_use_env)
         return (0);
 
+    if (prog_list)
+        list_destroy (prog_list);
+    free (task_env);
     use_env_parser_fini ();
     log_msg_fini ();
     return (0);
@@ -294,6 +397,151 @@ static int do_env_override (const char *path, spank_t sp)
     return (0);
 }
 
+static int compile_env_file (const char *path, List l)
+{
+    struct use_env_prog *prog;
+
+    slurm_verbose ("use_env_compile (%s)", path);
+
+    if (!(prog = use_env_compile (path)))
+        return (-1);
+
+    list_append (l, prog);
+    return (0);
+}
+
+static int eval_env_file (struct use_env_prog *prog, spank_t sp)
+{
+    if (use_env_eval (prog) < 0) {
+        slurm_error ("--use-env: Errors reading %s\n", use_env_prog_path (prog));
+        return (-1);
+    }
+    return (0);
+}
+
+static int pack_task_env (struct use_env_prog *prog, List l)
+{
+    char *s = use_env_task_pack (prog);
+
+    if (s == NULL)
+        return (-1);
+
+    if (*s == '\0')
+        free (s);
+    else
+        list_append (l, s);
+
+    return (0);
+}
+
+/*
+ *  Pass the `in task' blocks of compiled [progs] to remote tasks. Nothing
+ *   is set if any can't be packed or the result is too large, in which
+ *   case tasks read the env files themselves.
+ */
+static int task_env_set (List progs)
+{
+    List l = list_create ((ListDelF) free);
+    ListIterator i;
+    size_t len = strlen (TASK_ENV_VERSION) + 1;
+    char *val = NULL;
+    char *s;
+    int rc = -1;
+
+    if (list_for_each (progs, (ListForF) pack_task_env, l) < 0)
+        goto out;
+
+    i = list_iterator_create (l);
+    while ((s = list_next (i)))
+        len += strlen (s) + 1;
+    list_iterator_destroy (i);
+
+    if (len > TASK_ENV_MAX) {
+        slurm_verbose ("use-env: task env too large (%lu bytes)", 
+                       (unsigned long) len);
+        goto out;
+    }
+
+    if (!(val = malloc (len)))
+        goto out;
+
+    strcpy (val, TASK_ENV_VERSION);
+    i = list_iterator_create (l);
+    while ((s = list_next (i))) {
+        if (val [strlen (TASK_ENV_VERSION)] != '\0')
+            strcat (val, ",");
+        strcat (val, s);
+    }
+    list_iterator_destroy (i);
+
+    rc = setenv (TASK_ENV_VAR, val, 1);
+out:
+    free (val);
+    list_destroy (l);
+    return (rc);
+}
+
+/*
+ *  Return a copy of the task env passed on from srun, or NULL if there
+ *   is none (or it is from an incompatible version of this plugin).
+ */
+static char * task_env_get (spank_t sp)
+{
+    size_t len = 4096;
+    char *buf = NULL;
+    spank_err_t err;
+
+    for (;;) {
+        char *new = realloc (buf, len);
+
+        if (new == NULL) {
+            free (buf);
+            return (NULL);
+        }
+        buf = new;
+
+        err = spank_getenv (sp, TASK_ENV_VAR, buf, len);
+        if (err != ESPANK_NOSPACE || len > TASK_ENV_MAX)
+            break;
+        len *= 2;
+    }
+
+    if (  err != ESPANK_SUCCESS 
+       || strncmp (buf, TASK_ENV_VERSION, strlen (TASK_ENV_VERSION)) != 0) {
+        free (buf);
+        return (NULL);
+    }
+
+    return (buf);
+}
+
+static int unpack_task_prog (char *str, List progs)
+{
+    struct use_env_prog *prog;
+
+    if (!(prog = use_env_task_unpack (str)))
+        return (-1);
+
+    list_append (progs, prog);
+    return (0);
+}
+
+static int unpack_task_env (List progs)
+{
+    const char *s = task_env + strlen (TASK_ENV_VERSION);
+    List l;
+    int rc;
+
+    if (*s == '\0')
+        return (0);
+
+    l = list_split (",", (char *) s);
+    rc = list_for_each (l, (ListForF) unpack_task_prog, progs);
+    list_destroy (l);
+
+    return (rc);
+}
+
 static int path_cmp (char *x, char *y)
 {
     return (strcmp (x, y) == 0);
@@ -326,6 +574,12 @@ static int use_env_opt_process (int val, char *optarg, int remote)
 {
     List l;
 
+    /*
+     *  Files named by --use-env were already read by srun
+     */
+    if (remote && task_env)
+        return (0);
+
     if  (optarg == NULL) {
         slurm_error ("--use-env: Invalid argument");
         return (-1);
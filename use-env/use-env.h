@@ -28,8 +28,17 @@
 enum { TYPE_STR, TYPE_INT, TYPE_SYM };
 enum { SYM_INT, SYM_STR };
 
+/*
+ *  Symbol references in strings are not expanded by the lexer. Instead
+ *   they are kept in the string as TMPL_REF name TMPL_END, and a leading
+ *   `~' as TMPL_HOME, and are expanded each time the string is evaluated.
+ */
+#define TMPL_REF  '\001'
+#define TMPL_END  '\002'
+#define TMPL_HOME '\003'
+
 struct lex_item {
-    int    used;   /* Is item still used (for item cache) */
+    int    freestr; /* Free str when item is released     */
     char * name;   /* Name of item                        */
     int    type;   /* Type of item (int, string, symbol)  */
     char * str;    /* String representation of item       */
@@ -42,7 +51,7 @@ struct lex_item {
 };
 
 struct sym {
-    char * name;   /* Name of symbol                     */
+    const char * name; /* Name of symbol (interned)      */
     int    type;   /* Type of symbol (INT || STRING)     */
     int    val;    /* Value if type is INT               */
     char * string; /* String representation              */
@@ -75,6 +84,34 @@ void use_env_set_operations (struct use_env_ops *ops, void *arg);
 int use_env_parse (const char *filename);
 void use_env_parser_fini ();
 
+/*
+ *  Compiled env files:
+ *
+ *  use_env_compile() parses [filename] (and any includes that can be
+ *   found at compile time) once into a program that may then be
+ *   evaluated any number of times with use_env_eval(), e.g. once per
+ *   task. use_env_parse() is compile, eval, and destroy in one step.
+ */
+struct use_env_prog;
+
+struct use_env_prog * use_env_compile (const char *filename);
+int use_env_eval (struct use_env_prog *prog);
+void use_env_prog_destroy (struct use_env_prog *prog);
+const char * use_env_prog_path (struct use_env_prog *prog);
+
+/*
+ *  Task programs:
+ *
+ *  use_env_task_pack() encodes the `in task' blocks of compiled [prog],
+ *   along with any include files compiled with it, as a printable string
+ *   from which use_env_task_unpack() recreates a program that can be
+ *   evaluated in task context without reading any files. Returns "" if
+ *   [prog] has no `in task' blocks, or NULL if it can't be packed.
+ *   The returned string must be freed by the caller.
+ */
+char * use_env_task_pack (struct use_env_prog *prog);
+struct use_env_prog * use_env_task_unpack (const char *str);
+
 /*
  *  Lexer cleanup
  */
@@ -107,16 +144,20 @@ void dump_keywords ();
 void dump_symbols ();
 
 /*
- * include file functions
+ * Source file functions
  */
 int lex_file_init (const char *file);
-int lex_include_push (const char *include);
-int lex_include_pop ();
 
 const char *lex_file ();
 int lex_line ();
 int lex_line_increment ();
 
+/*
+ *  Set file and line reported by lex_file() and lex_line() while
+ *   no file is being lexed (i.e. during evaluation).
+ */
+void lex_location_set (const char *file, int line);
+
 #endif
 /*
  * vi: ts=4 sw=4 expandtab